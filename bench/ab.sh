@@ -0,0 +1,161 @@
+#!/bin/sh
+# A/B two revisions of server.c on this machine: is a change a real win or
+# noise?
+#
+# Builds the server (and bench/micro.c, if the revision has it) from each
+# revision. Then it runs trials: in each one, both builds get the same load
+# (bench/load.c from the working tree, closed loop against pool mode) and
+# the same microbenchmarks. The order alternates between trials (AB, BA,
+# AB, ...), so drift in machine state (thermal, page cache, other
+# tenants) hits both sides equally.
+#
+# For every metric it reports the mean of each side and the change from A
+# to B, with a 95% confidence interval (Welch's t). The verdict is "noise"
+# unless the interval excludes zero. Every row is also appended to a CSV
+# history file, so results can be tracked across changes.
+#
+# Usage: bench/ab.sh [-n trials] [-d seconds] [-c connections] [-w workers]
+#                    [-m micro_filter | -m -] [-o history.csv] <rev_a> <rev_b>
+#   rev:  any git revision, or "." for the working tree
+#   -m -: skip the microbenchmarks
+# e.g.   bench/ab.sh -n 10 HEAD .     # uncommitted change against HEAD
+
+TRIALS=6
+SECONDS_PER_RUN=5
+CONNS=32
+WORKERS=4
+MICRO_FILTER=
+HISTORY=ab_history.csv
+PORT=18090
+
+while getopts "n:d:c:w:m:o:" opt; do
+    case $opt in
+    n) TRIALS=$OPTARG ;;
+    d) SECONDS_PER_RUN=$OPTARG ;;
+    c) CONNS=$OPTARG ;;
+    w) WORKERS=$OPTARG ;;
+    m) MICRO_FILTER=$OPTARG ;;
+    o) HISTORY=$OPTARG ;;
+    *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 2 ] || [ "$TRIALS" -lt 2 ]; then
+    sed -n '17,21p' "$0" | sed 's/^# \{0,1\}//' >&2
+    exit 1
+fi
+
+REPO=$(git -C "$(dirname "$0")" rev-parse --show-toplevel) || exit 1
+WORK=$(mktemp -d)
+trap 'kill $SERVER_PID 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+SERVER_PID=
+
+# Short name for a revision, for the report and the history
+rev_name() {
+    if [ "$1" = . ]; then
+        echo "worktree"
+    else
+        git -C "$REPO" rev-parse --short "$1"
+    fi
+}
+
+# build <label> <rev>: server and micro into $WORK/<label>/
+build() {
+    dir=$WORK/$1
+    mkdir -p "$dir/bench"
+    if [ "$2" = . ]; then
+        cp "$REPO/server.c" "$dir/server.c"
+        cp "$REPO/bench/micro.c" "$dir/bench/micro.c" 2>/dev/null
+    else
+        git -C "$REPO" show "$2:server.c" >"$dir/server.c" || exit 1
+        git -C "$REPO" show "$2:bench/micro.c" >"$dir/bench/micro.c" 2>/dev/null || rm -f "$dir/bench/micro.c"
+    fi
+    gcc -O2 -o "$dir/server" "$dir/server.c" -lpthread || exit 1
+    if [ -f "$dir/bench/micro.c" ] && [ "$MICRO_FILTER" != - ]; then
+        gcc -O2 -o "$dir/micro" "$dir/bench/micro.c" -lpthread 2>/dev/null || rm -f "$dir/micro"
+    fi
+}
+
+# trial <label>: one load run and one micro run, appended to $WORK/results
+# as "<label> <metric> <value>"
+trial() {
+    dir=$WORK/$1
+    "$dir/server" -w "$WORKERS" "$PORT" "$REPO/public" >/dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    "$WORK/load" -j -t 2 -c "$CONNS" -d "$SECONDS_PER_RUN" -r "$REPO/public" "$PORT" |
+        sed -n 's/.*"rps": \([0-9.]*\).*"latency_ms": {"p50": \([0-9.]*\), "p90": [0-9.]*, "p99": \([0-9.]*\).*/\1 \2 \3/p' |
+        while read -r rps p50 p99; do
+            echo "$1 load_rps $rps"
+            echo "$1 load_p50_ms $p50"
+            echo "$1 load_p99_ms $p99"
+        done >>"$WORK/results"
+    kill "$SERVER_PID"
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=
+
+    # micro reads public/ relative to the current directory
+    if [ -x "$dir/micro" ] && [ -x "$WORK/a/micro" ] && [ -x "$WORK/b/micro" ]; then
+        (cd "$REPO" && "$dir/micro" -f csv $MICRO_FILTER) |
+            awk -F, -v label="$1" 'NR > 1 { print label, "micro_" $2 "_ns", $3 }' >>"$WORK/results"
+    fi
+}
+
+NAME_A=$(rev_name "$1") || exit 1
+NAME_B=$(rev_name "$2") || exit 1
+echo "building A=$NAME_A B=$NAME_B"
+build a "$1"
+build b "$2"
+gcc -O2 -pthread -o "$WORK/load" "$REPO/bench/load.c" || exit 1
+
+i=1
+while [ "$i" -le "$TRIALS" ]; do
+    if [ $((i % 2)) -eq 1 ]; then order="a b"; else order="b a"; fi
+    echo "trial $i/$TRIALS ($order)"
+    for side in $order; do
+        trial "$side"
+    done
+    i=$((i + 1))
+done
+
+[ -f "$HISTORY" ] || echo "date,rev_a,rev_b,metric,trials,mean_a,mean_b,delta_pct,ci_low_pct,ci_high_pct,verdict" >"$HISTORY"
+
+awk -v a_name="$NAME_A" -v b_name="$NAME_B" -v date="$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+    -v history="$HISTORY" '
+# Two-sided 95% Student t quantiles by degrees of freedom
+function tcrit(df) {
+    if (df < 1) df = 1
+    split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 2.201 2.179 2.160 2.145 2.131 " \
+          "2.120 2.110 2.101 2.093 2.086 2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042", t, " ")
+    return df <= 30 ? t[int(df)] : 1.96
+}
+{
+    if (!($2 in seen)) { seen[$2] = 1; order[++nmetrics] = $2 }
+    n[$1, $2]++; sum[$1, $2] += $3; sumsq[$1, $2] += $3 * $3
+}
+END {
+    printf "%-40s %12s %12s %9s %21s  %s\n", "metric", "A " a_name, "B " b_name, "delta", "95% CI", "verdict"
+    for (k = 1; k <= nmetrics; k++) {
+        m = order[k]
+        na = n["a", m]; nb = n["b", m]
+        if (na < 2 || nb < 2) continue
+        ma = sum["a", m] / na; mb = sum["b", m] / nb
+        va = (sumsq["a", m] - na * ma * ma) / (na - 1); if (va < 0) va = 0
+        vb = (sumsq["b", m] - nb * mb * mb) / (nb - 1); if (vb < 0) vb = 0
+        se = sqrt(va / na + vb / nb)
+        # Welch-Satterthwaite degrees of freedom
+        df = se > 0 ? (va / na + vb / nb) ^ 2 / ((va / na) ^ 2 / (na - 1) + (vb / nb) ^ 2 / (nb - 1)) : na + nb - 2
+        half = tcrit(df) * se
+        if (ma == 0) continue
+        delta = (mb - ma) / ma * 100
+        lo = (mb - ma - half) / ma * 100; hi = (mb - ma + half) / ma * 100
+        higher_is_better = m ~ /rps/
+        if (lo <= 0 && hi >= 0) verdict = "noise"
+        else if ((delta > 0) == higher_is_better) verdict = "better"
+        else verdict = "worse"
+        printf "%-40s %12.3f %12.3f %+8.2f%% [%+8.2f%%, %+8.2f%%]  %s\n", m, ma, mb, delta, lo, hi, verdict
+        printf "%s,%s,%s,%s,%d,%.4f,%.4f,%.3f,%.3f,%.3f,%s\n", date, a_name, b_name, m, na, ma, mb, delta, lo, hi,
+               verdict >> history
+    }
+}' "$WORK/results"
+echo "history: $HISTORY"
@@ -0,0 +1,388 @@
+// Connection-scaling benchmark: what N concurrent, mostly idle connections
+// cost the server (pool mode), for growing N.
+//
+// For each step N the client tops the number of open connections up to N,
+// then sends a trickle of requests over random idle ones for a while. Per
+// step it reports:
+//   - accept rate: new connections the server took per second while
+//     ramping up (from its open_connections in /__stats, not from the
+//     client's connect(), which the kernel completes on its own)
+//   - server RSS (from /proc/<pid>/status) and RSS per connection over the
+//     idle baseline
+//   - p50/p99/max latency of the trickle requests
+// A trickle request uses up its connection (the server answers HTTP/1.0
+// and closes), so each one is replaced by a fresh idle connection.
+//
+// Connections are spread over source addresses 127.0.0.1, 127.0.0.2, ...
+// (PER_SOURCE_IP each) so the ephemeral port range does not run out, and
+// the client raises its own descriptor limit to the hard limit. The server
+// needs a descriptor limit above the largest N (ulimit -n) and a listen
+// backlog that does not bottleneck the ramp (-b).
+//
+// Build: gcc -O2 -o c10k bench/c10k.c
+// Run:   ./server -a 2 -w 4 -b 4096 8080 public &
+//        ./c10k [-r trickle_rps] [-d seconds] [-f text|csv] <port> <server_pid> <N,N,...>
+// e.g.   ./c10k -r 200 -d 5 8080 $! 1000,10000,50000,100000
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PER_SOURCE_IP 20000
+#define RAMP_INFLIGHT 512 // connects outstanding at once while ramping
+#define RAMP_TIMEOUT_NS (60ULL * 1000000000ULL)
+#define MAX_STEPS 16
+
+static const char REQUEST[] = "GET /index.html HTTP/1.0\r\n\r\n";
+
+enum
+{
+    FREE,
+    CONNECTING,
+    IDLE,
+    BUSY,
+};
+
+struct conn
+{
+    int fd;
+    int state;
+    int ok; // response started with a 200
+    uint64_t sent_ns;
+};
+
+static int port;
+static int epfd;
+static struct conn *conns;
+static int nconns;    // slots in use (0..N-1)
+static int nopen;     // CONNECTING + IDLE + BUSY
+static int nidle;
+static int connecting;
+static unsigned next_source; // for spreading over source addresses
+static long errors;
+static long rejected; // closed by the server before we sent anything
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int conn_open(struct conn *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1)
+        return -1;
+
+    struct sockaddr_in src = {.sin_family = AF_INET};
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + next_source++ / PER_SOURCE_IP);
+    struct sockaddr_in dst = {.sin_family = AF_INET, .sin_port = htons(port)};
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(c->fd, (struct sockaddr *)&src, sizeof(src)) == -1 ||
+        (connect(c->fd, (struct sockaddr *)&dst, sizeof(dst)) == -1 && errno != EINPROGRESS))
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    c->state = CONNECTING;
+    connecting++;
+    nopen++;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+static void conn_close(struct conn *c)
+{
+    if (c->state == CONNECTING)
+        connecting--;
+    if (c->state == IDLE)
+        nidle--;
+    close(c->fd);
+    c->fd = -1;
+    c->state = FREE;
+    nopen--;
+}
+
+// Latencies of the current step's trickle requests
+static uint64_t *latencies;
+static size_t nlatencies;
+static size_t latency_cap;
+
+static void on_event(struct conn *c, uint32_t events)
+{
+    if (c->state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & EPOLLERR))
+        {
+            errors++;
+            conn_close(c);
+            return;
+        }
+        connecting--;
+        c->state = IDLE;
+        nidle++;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+
+    if (c->state == IDLE)
+    {
+        // The server shed or dropped a connection we never used
+        rejected++;
+        conn_close(c);
+        return;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(c->fd, buf, sizeof(buf), 0)) > 0)
+        if (!c->ok && n >= 12 && memcmp(buf, "HTTP/1.0 200", 12) == 0)
+            c->ok = 1;
+    if (n == -1 && errno == EAGAIN)
+        return;
+
+    // Response complete (the server closed)
+    if (c->ok && nlatencies < latency_cap)
+        latencies[nlatencies++] = now_ns() - c->sent_ns;
+    else if (!c->ok)
+        errors++;
+    conn_close(c);
+}
+
+static void poll_events(int timeout_ms)
+{
+    struct epoll_event events[1024];
+    int n = epoll_wait(epfd, events, 1024, timeout_ms);
+    for (int i = 0; i < n; i++)
+        on_event(events[i].data.ptr, events[i].events);
+}
+
+// Opens connections in free slots until `target` are open or in progress
+static void top_up(int target)
+{
+    for (int i = 0; i < target && nopen < target && connecting < RAMP_INFLIGHT; i++)
+    {
+        if (conns[i].state != FREE)
+            continue;
+        if (conn_open(&conns[i]) == -1)
+        {
+            errors++;
+            break;
+        }
+    }
+}
+
+// The server's open_connections from /__stats, or -1
+static long server_open_connections(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in dst = {.sin_family = AF_INET, .sin_port = htons(port)};
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct timeval tv = {.tv_sec = 2};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    static const char req[] = "GET /__stats HTTP/1.0\r\n\r\n";
+    send(fd, req, sizeof(req) - 1, MSG_NOSIGNAL);
+
+    char buf[65536];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(buf) - 1 && (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+        len += n;
+    close(fd);
+    buf[len] = '\0';
+
+    const char *p = strstr(buf, "\"open_connections\": ");
+    return p ? atol(p + 20) : -1;
+}
+
+static long server_rss_kb(pid_t pid)
+{
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    double rate = 100;
+    int seconds = 5;
+    int csv = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:f:r:")) != -1)
+    {
+        if (opt == 'd')
+            seconds = atoi(optarg);
+        else if (opt == 'f')
+            csv = strcmp(optarg, "csv") == 0;
+        else if (opt == 'r')
+            rate = atof(optarg);
+        else
+            optind = argc + 1;
+    }
+    if (argc - optind != 3 || rate <= 0 || seconds <= 0)
+    {
+        fprintf(stderr, "Usage: %s [-r trickle_rps] [-d seconds] [-f text|csv] <port> <server_pid> <N,N,...>\n",
+                argv[0]);
+        return 1;
+    }
+    port = atoi(argv[optind]);
+    pid_t server_pid = atoi(argv[optind + 1]);
+
+    int steps[MAX_STEPS], nsteps = 0, max_n = 0;
+    for (char *tok = strtok(argv[optind + 2], ","); tok && nsteps < MAX_STEPS; tok = strtok(NULL, ","))
+    {
+        steps[nsteps] = atoi(tok);
+        if (steps[nsteps] > max_n)
+            max_n = steps[nsteps];
+        nsteps++;
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)max_n + 64)
+        fprintf(stderr, "warning: descriptor limit %llu is below %d connections\n",
+                (unsigned long long)rl.rlim_cur, max_n);
+
+    epfd = epoll_create1(0);
+    conns = calloc(max_n, sizeof(struct conn));
+    latency_cap = (size_t)(rate * seconds * 2) + 16;
+    latencies = malloc(latency_cap * sizeof(uint64_t));
+    if (epfd == -1 || !conns || !latencies)
+    {
+        perror("setup");
+        return 1;
+    }
+    for (int i = 0; i < max_n; i++)
+        conns[i].fd = -1;
+
+    long base_open = server_open_connections();
+    long base_rss = server_rss_kb(server_pid);
+    if (base_open < 0 || base_rss < 0)
+    {
+        fprintf(stderr, "cannot read /__stats on port %d or /proc/%d/status\n", port, (int)server_pid);
+        return 1;
+    }
+    base_open--; // our own stats connection
+
+    if (csv)
+        printf("connections,open,accept_per_s,rss_kb,rss_per_conn_kb,requests,p50_ms,p99_ms,max_ms,errors,rejected\n");
+    else
+        printf("%8s %8s %11s %9s %12s %8s %9s %9s %9s %7s %8s\n", "N", "open", "accepts/s", "rss_MB",
+               "KB/conn", "reqs", "p50_ms", "p99_ms", "max_ms", "errors", "rejected");
+
+    for (int s = 0; s < nsteps; s++)
+    {
+        int target = steps[s];
+        nconns = target;
+
+        // Ramp: open up to N and time how fast the server takes them
+        long before = server_open_connections() - 1 - base_open;
+        uint64_t ramp_start = now_ns();
+        long accepted = before;
+        uint64_t last_check = 0;
+        while (now_ns() - ramp_start < RAMP_TIMEOUT_NS)
+        {
+            top_up(target);
+            poll_events(1);
+            if (now_ns() - last_check > 100000000ULL && connecting == 0 && nopen >= target)
+            {
+                last_check = now_ns();
+                accepted = server_open_connections() - 1 - base_open;
+                if (accepted >= target)
+                    break;
+            }
+        }
+        double ramp_s = (now_ns() - ramp_start) / 1e9;
+        double accept_rate = ramp_s > 0 ? (accepted - before) / ramp_s : 0;
+
+        // Trickle: one request every 1/rate seconds on a random idle connection
+        nlatencies = 0;
+        long errors_before = errors, rejected_before = rejected;
+        uint64_t start = now_ns(), next = start;
+        uint64_t interval = (uint64_t)(1e9 / rate);
+        while (now_ns() - start < (uint64_t)seconds * 1000000000ULL)
+        {
+            uint64_t now = now_ns();
+            while (next <= now && nidle > 0)
+            {
+                int i = rand() % target;
+                while (conns[i].state != IDLE)
+                    i = (i + 1) % target;
+                struct conn *c = &conns[i];
+                c->state = BUSY;
+                nidle--;
+                c->ok = 0;
+                c->sent_ns = now_ns();
+                if (send(c->fd, REQUEST, sizeof(REQUEST) - 1, MSG_NOSIGNAL) == -1)
+                {
+                    errors++;
+                    conn_close(c);
+                }
+                next += interval;
+            }
+            top_up(target); // replace used connections
+            poll_events(1);
+        }
+        // Let the last requests finish
+        uint64_t drain_start = now_ns();
+        while (nopen - nidle - connecting > 0 && now_ns() - drain_start < 2000000000ULL)
+            poll_events(10);
+
+        long rss = server_rss_kb(server_pid);
+        qsort(latencies, nlatencies, sizeof(uint64_t), cmp_u64);
+        double p50 = nlatencies ? latencies[nlatencies / 2] / 1e6 : 0;
+        double p99 = nlatencies ? latencies[(size_t)(nlatencies * 0.99)] / 1e6 : 0;
+        double max = nlatencies ? latencies[nlatencies - 1] / 1e6 : 0;
+        double per_conn = accepted > 0 ? (double)(rss - base_rss) / accepted : 0;
+
+        if (csv)
+            printf("%d,%ld,%.0f,%ld,%.2f,%zu,%.3f,%.3f,%.3f,%ld,%ld\n", target, accepted, accept_rate, rss, per_conn,
+                   nlatencies, p50, p99, max, errors - errors_before, rejected - rejected_before);
+        else
+            printf("%8d %8ld %11.0f %9.1f %12.2f %8zu %9.3f %9.3f %9.3f %7ld %8ld\n", target, accepted,
+                   accept_rate, rss / 1024.0, per_conn, nlatencies, p50, p99, max, errors - errors_before,
+                   rejected - rejected_before);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+// Connection-rate benchmark: how many connections per second the server
+// accepts and hands off.
+//
+// Each client thread keeps <inflight> non-blocking connects outstanding on
+// its own epoll instance. In "req" mode every connection sends a tiny GET and
+// waits for the server to close; in "connect" mode the client resets the
+// connection as soon as it is established, which measures the accept and
+// handoff path alone (and avoids filling the port range with TIME_WAIT).
+//
+// Build: gcc -O2 -pthread -o connrate bench/connrate.c
+// Run:   ./connrate <port> <threads> <seconds> [req|connect] [inflight]
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char REQUEST[] = "GET /index.html HTTP/1.0\r\n\r\n";
+
+static int port;
+static int connect_only;
+static int inflight = 64;
+static uint64_t deadline_ns;
+
+struct client
+{
+    pthread_t thread;
+    long completed;
+    long errors;
+};
+
+// Per-connection state: still connecting, or waiting for the response
+enum
+{
+    CONNECTING,
+    READING
+};
+
+struct slot
+{
+    int fd;
+    int state;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int start_connect(int epfd, struct slot *s)
+{
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s->fd == -1)
+        return -1;
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+    {
+        close(s->fd);
+        return -1;
+    }
+
+    s->state = CONNECTING;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = s};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+    return 0;
+}
+
+static void finish(int epfd, struct slot *s, int rst)
+{
+    if (rst)
+    {
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(s->fd);
+    while (start_connect(epfd, s) == -1 && now_ns() < deadline_ns)
+        ;
+}
+
+static void on_event(struct client *c, int epfd, struct slot *s, uint32_t events)
+{
+    if (s->state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & EPOLLERR))
+        {
+            c->errors++;
+            finish(epfd, s, 1);
+            return;
+        }
+
+        if (connect_only)
+        {
+            c->completed++;
+            finish(epfd, s, 1);
+            return;
+        }
+
+        send(s->fd, REQUEST, sizeof(REQUEST) - 1, MSG_NOSIGNAL);
+        s->state = READING;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        return;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(s->fd, buf, sizeof(buf), 0)) > 0)
+        ;
+    if (n == 0)
+    {
+        c->completed++;
+        finish(epfd, s, 0);
+    }
+    else if (errno != EAGAIN)
+    {
+        c->errors++;
+        finish(epfd, s, 1);
+    }
+}
+
+static void *client_main(void *arg)
+{
+    struct client *c = arg;
+    int epfd = epoll_create1(0);
+    struct slot *slots = calloc(inflight, sizeof(struct slot));
+
+    for (int i = 0; i < inflight; i++)
+        if (start_connect(epfd, &slots[i]) == -1)
+            c->errors++;
+
+    struct epoll_event events[256];
+    while (now_ns() < deadline_ns)
+    {
+        int n = epoll_wait(epfd, events, 256, 100);
+        for (int i = 0; i < n; i++)
+            on_event(c, epfd, events[i].data.ptr, events[i].events);
+    }
+
+    close(epfd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <port> <threads> <seconds> [req|connect] [inflight]\n", argv[0]);
+        return 1;
+    }
+
+    port = atoi(argv[1]);
+    int nthreads = atoi(argv[2]);
+    int seconds = atoi(argv[3]);
+    connect_only = argc > 4 && strcmp(argv[4], "connect") == 0;
+    if (argc > 5)
+        inflight = atoi(argv[5]);
+
+    struct client *clients = calloc(nthreads, sizeof(struct client));
+    deadline_ns = now_ns() + (uint64_t)seconds * 1000000000ULL;
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+
+    long completed = 0, errors = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        completed += clients[i].completed;
+        errors += clients[i].errors;
+    }
+
+    printf("mode=%s connections=%ld rate=%.0f/s errors=%ld\n",
+           connect_only ? "connect" : "req", completed, (double)completed / seconds, errors);
+    return 0;
+}
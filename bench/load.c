@@ -0,0 +1,775 @@
+// HTTP/1.1 load generator with coordinated-omission-corrected latencies.
+//
+// Each thread drives its share of the connections from its own epoll
+// instance. Two ways to generate load:
+//
+//   closed loop (default): every connection keeps <depth> requests in flight
+//     and sends the next one as soon as a response arrives. Measures the
+//     maximum throughput, but a stalled server also stalls the client, so
+//     the latencies it sees are optimistic.
+//
+//   open loop (-R rate): requests are scheduled at fixed intervals no matter
+//     how the server is doing, and each one's latency is measured from the
+//     time it *should* have been sent. Requests that had to wait for a free
+//     connection are charged for that wait, which is what a real user would
+//     have seen (the correction wrk2 applies for coordinated omission). The
+//     uncorrected latency, from the actual send, is reported next to it.
+//
+// With -k connections are reused (HTTP/1.1 keep-alive) and -p sends up to
+// <depth> requests back to back before reading (pipelining). A response
+// marked "Connection: close" (or an HTTP/1.0 one without keep-alive) makes
+// the client reconnect; requests still in flight on that connection are
+// sent again on the new one with their original schedule.
+//
+// URLs come from a file (-u, one per line) or from every regular file under
+// a directory (-r, e.g. public/), and are used round-robin per connection.
+//
+// Build: gcc -O2 -pthread -o load bench/load.c
+// Run:   ./load [-t threads] [-c connections] [-d seconds] [-R rate] [-k] [-p depth]
+//               [-u url_file | -r root_dir] [-j] <port>
+// e.g.   ./load -t 2 -c 64 -d 10 -R 20000 -r public 8080
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 64
+#define MAX_URLS 65536
+#define RBUF_SIZE 16384
+#define BACKLOG_SIZE (1 << 20) // open loop: requests due but not yet sent, per thread
+
+// Same log-linear shape as the server's histograms: 32 sub-buckets per
+// power of two, ~3% relative error, values up to 2^36 ns
+#define HIST_SUB_BITS 5
+#define HIST_MAX_EXP 36
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram
+{
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+// A request that is due: when it should have been sent, and which URL
+struct pending
+{
+    uint64_t intended_ns;
+    uint64_t sent_ns;
+    int url;
+};
+
+enum
+{
+    CONNECTING,
+    OPEN,
+};
+
+struct conn
+{
+    int fd;
+    int state;
+    int next_url;
+    struct pending inflight[MAX_DEPTH]; // sent, oldest first
+    int head;
+    int count;
+    char wbuf[MAX_DEPTH * 512];
+    size_t wlen;
+    size_t woff;
+    char rbuf[RBUF_SIZE];
+    size_t rlen;
+    long body_left;  // bytes of the current body still to skip, -1 = in headers
+    int status;      // of the current response
+    int close_after; // current response ends the connection
+};
+
+struct worker
+{
+    pthread_t thread;
+    int epfd;
+    struct conn *conns;
+    int nconns;
+    struct pending *backlog; // ring of due requests (open loop)
+    uint64_t backlog_head;
+    uint64_t backlog_tail;
+    double interval_ns; // between scheduled requests on this thread, 0 = closed loop
+    uint64_t scheduled;
+    uint64_t start_ns;
+
+    struct histogram corrected; // from the intended send time
+    struct histogram raw;       // from the actual send time
+    uint64_t completed;
+    uint64_t status[6]; // by class: 1xx .. 5xx, [0] = unparsable
+    uint64_t errors;
+    uint64_t reconnects;
+    uint64_t overflow; // open loop: due requests dropped because the backlog was full
+    uint64_t bytes;
+};
+
+static struct sockaddr_in server_addr;
+static int keep_alive;
+static int depth = 1;
+static uint64_t deadline_ns;
+static char *urls[MAX_URLS];
+static int nurls;
+static const char *url_root;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t v)
+{
+    if (v >= (1ULL << HIST_MAX_EXP))
+        v = (1ULL << HIST_MAX_EXP) - 1;
+    if (v < (1ULL << HIST_SUB_BITS))
+        return (int)v;
+    int exp = 63 - __builtin_clzll(v);
+    int shift = exp - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t histogram_bucket_upper(int b)
+{
+    if (b < (1 << HIST_SUB_BITS))
+        return b;
+    int shift = (b >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (uint64_t)(b & ((1 << HIST_SUB_BITS) - 1)) | (1ULL << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histogram_record(struct histogram *h, uint64_t v)
+{
+    h->buckets[histogram_bucket(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void histogram_merge(struct histogram *out, const struct histogram *h)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        out->buckets[b] += h->buckets[b];
+    out->count += h->count;
+    if (h->max > out->max)
+        out->max = h->max;
+}
+
+static uint64_t histogram_quantile(const struct histogram *h, double q)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen > rank)
+            return histogram_bucket_upper(b) < h->max ? histogram_bucket_upper(b) : h->max;
+    }
+    return h->max;
+}
+
+// -------------------------------------------
+// URL list
+// -------------------------------------------
+static int add_url(const char *url)
+{
+    if (strlen(url) > 400)
+        return 0; // would not fit the write buffer; skip
+    if (nurls == MAX_URLS)
+        return -1;
+    urls[nurls] = strdup(url);
+    return urls[nurls] ? nurls++, 0 : -1;
+}
+
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    if (type != FTW_F)
+        return 0;
+    // /<path relative to the root>
+    return add_url(path + strlen(url_root)) == -1;
+}
+
+static int load_urls_from_tree(const char *root)
+{
+    char clean[PATH_MAX];
+    snprintf(clean, sizeof(clean), "%s", root);
+    size_t len = strlen(clean);
+    while (len > 1 && clean[len - 1] == '/')
+        clean[--len] = '\0';
+    url_root = clean;
+    return nftw(clean, add_file, 16, FTW_PHYS);
+}
+
+static int load_urls_from_file(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    if (!f)
+        return -1;
+    char line[2048];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '/' && add_url(line) == -1)
+            break;
+    }
+    fclose(f);
+    return 0;
+}
+
+// -------------------------------------------
+// Connections
+// -------------------------------------------
+static int conn_open(struct worker *w, struct conn *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    c->state = CONNECTING;
+    c->rlen = 0;
+    c->wlen = c->woff = 0;
+    c->body_left = -1;
+    c->close_after = 0;
+    struct epoll_event ev = {.events = EPOLLOUT | EPOLLIN, .data.ptr = c};
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+// Puts a request back at the front of the backlog (open loop) so it keeps
+// its place and its intended time
+static void backlog_unshift(struct worker *w, struct pending p)
+{
+    if (w->backlog_tail - w->backlog_head == BACKLOG_SIZE)
+    {
+        w->overflow++;
+        return;
+    }
+    w->backlog_head--;
+    w->backlog[w->backlog_head % BACKLOG_SIZE] = p;
+}
+
+// Closes and reconnects. The first request in flight failed if error is
+// set; the others never got an answer and are sent again.
+static void conn_reset(struct worker *w, struct conn *c, int error)
+{
+    if (error && c->count > 0)
+    {
+        w->errors++;
+        c->head++;
+        c->count--;
+    }
+    else if (error)
+        w->errors++;
+
+    // Newest first, so the backlog ends up in the original order
+    for (int i = c->count - 1; i >= 0; i--)
+    {
+        struct pending p = c->inflight[(c->head + i) % MAX_DEPTH];
+        if (w->interval_ns > 0)
+            backlog_unshift(w, p);
+    }
+    c->count = 0;
+    c->head = 0;
+
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    w->reconnects++;
+    if (now_ns() < deadline_ns && conn_open(w, c) == -1)
+        w->errors++;
+}
+
+static void conn_want_write(struct worker *w, struct conn *c, int want)
+{
+    struct epoll_event ev = {.events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_flush(struct worker *w, struct conn *c)
+{
+    while (c->woff < c->wlen)
+    {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EAGAIN)
+            {
+                conn_want_write(w, c, 1);
+                return;
+            }
+            conn_reset(w, c, 1);
+            return;
+        }
+        c->woff += n;
+    }
+    c->wlen = c->woff = 0;
+}
+
+// Queues one request on the connection (sent by the next conn_flush())
+static void conn_add_request(struct worker *w, struct conn *c, struct pending p)
+{
+    if (p.url < 0)
+        p.url = c->next_url++ % nurls;
+    p.sent_ns = now_ns();
+    c->inflight[(c->head + c->count) % MAX_DEPTH] = p;
+    c->count++;
+
+    int n = snprintf(c->wbuf + c->wlen, sizeof(c->wbuf) - c->wlen,
+                     keep_alive ? "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                                : "GET %s HTTP/1.0\r\nHost: localhost\r\nConnection: close\r\n\r\n",
+                     urls[p.url]);
+    if (n > 0 && (size_t)n < sizeof(c->wbuf) - c->wlen)
+        c->wlen += n;
+    (void)w;
+}
+
+// Fills an open connection up to the pipeline depth (one request without
+// keep-alive): from the backlog in open loop mode, with fresh requests in
+// closed loop mode
+static void conn_fill(struct worker *w, struct conn *c)
+{
+    int limit = keep_alive ? depth : 1;
+    if (c->state != OPEN || c->fd == -1 || (!keep_alive && c->close_after))
+        return;
+
+    int added = 0;
+    while (c->count < limit)
+    {
+        struct pending p = {.url = -1};
+        if (w->interval_ns > 0)
+        {
+            if (w->backlog_head == w->backlog_tail)
+                break;
+            p = w->backlog[w->backlog_head++ % BACKLOG_SIZE];
+        }
+        else
+            p.intended_ns = now_ns();
+        conn_add_request(w, c, p);
+        added++;
+    }
+    if (added && c->woff == 0)
+        conn_flush(w, c);
+}
+
+static void dispatch(struct worker *w)
+{
+    for (int i = 0; i < w->nconns && w->backlog_head != w->backlog_tail; i++)
+        conn_fill(w, &w->conns[i]);
+}
+
+// One complete response for the oldest request in flight
+static void conn_complete(struct worker *w, struct conn *c, int status)
+{
+    uint64_t now = now_ns();
+    struct pending *p = &c->inflight[c->head % MAX_DEPTH];
+    if (now < deadline_ns)
+    {
+        histogram_record(&w->corrected, now - p->intended_ns);
+        histogram_record(&w->raw, now - p->sent_ns);
+        w->completed++;
+        w->status[status >= 100 && status < 600 ? status / 100 : 0]++;
+    }
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->count--;
+}
+
+// Parses as many responses as rbuf holds. Returns -1 if the connection has
+// to be reset (malformed response), 1 if the server is closing it, else 0.
+static int conn_parse(struct worker *w, struct conn *c)
+{
+    size_t off = 0;
+    int ret = 0;
+
+    while (1)
+    {
+        // Skip the body of the current response
+        if (c->body_left >= 0)
+        {
+            size_t take = c->rlen - off < (size_t)c->body_left ? c->rlen - off : (size_t)c->body_left;
+            off += take;
+            c->body_left -= take;
+            if (c->body_left > 0)
+                break;
+            c->body_left = -1;
+            conn_complete(w, c, c->status);
+            if (c->close_after)
+            {
+                ret = 1;
+                break;
+            }
+            continue;
+        }
+        if (off == c->rlen)
+            break;
+
+        char *end = memmem(c->rbuf + off, c->rlen - off, "\r\n\r\n", 4);
+        if (!end)
+        {
+            if (off == 0 && c->rlen == sizeof(c->rbuf))
+                return -1; // headers larger than the buffer
+            break;
+        }
+        if (c->count == 0)
+            return -1; // response nobody asked for
+
+        // Status line and the two headers that matter here
+        char *line = c->rbuf + off;
+        *end = '\0';
+        int minor = 0;
+        if (sscanf(line, "HTTP/1.%d %d", &minor, &c->status) != 2)
+            return -1;
+        if (c->status >= 100 && c->status < 200)
+        {
+            // Interim response (103 Early Hints): no body, the final one follows
+            off = end + 4 - c->rbuf;
+            continue;
+        }
+        long length = -1;
+        int close_conn = !keep_alive || minor == 0;
+        for (char *h = strstr(line, "\r\n"); h; h = strstr(h + 2, "\r\n"))
+        {
+            if (strncasecmp(h + 2, "Content-Length:", 15) == 0)
+                length = atol(h + 17);
+            else if (strncasecmp(h + 2, "Connection:", 11) == 0)
+            {
+                const char *v = h + 13;
+                while (*v == ' ')
+                    v++;
+                if (strncasecmp(v, "close", 5) == 0)
+                    close_conn = 1;
+                else if (strncasecmp(v, "keep-alive", 10) == 0)
+                    close_conn = 0;
+            }
+        }
+        if (length < 0)
+            return -1; // the server always sends Content-Length
+        off = end + 4 - c->rbuf;
+        c->body_left = length;
+        c->close_after = close_conn;
+        w->bytes += length;
+    }
+
+    memmove(c->rbuf, c->rbuf + off, c->rlen - off);
+    c->rlen -= off;
+    return ret;
+}
+
+static void conn_on_event(struct worker *w, struct conn *c, uint32_t events)
+{
+    if (c->state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & EPOLLERR))
+        {
+            conn_reset(w, c, 1);
+            return;
+        }
+        c->state = OPEN;
+        conn_want_write(w, c, 0);
+        conn_fill(w, c);
+        return;
+    }
+
+    if ((events & EPOLLOUT) && c->woff < c->wlen)
+    {
+        conn_flush(w, c);
+        if (c->fd == -1 || c->state != OPEN)
+            return;
+        if (c->woff == 0)
+            conn_want_write(w, c, 0);
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    while (1)
+    {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+        if (n > 0)
+        {
+            c->rlen += n;
+            int r = conn_parse(w, c);
+            if (r != 0)
+            {
+                conn_reset(w, c, r == -1);
+                return;
+            }
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN)
+            break;
+        // EOF or error: anything still in flight was lost
+        conn_reset(w, c, c->count > 0);
+        return;
+    }
+
+    // A response came back: this connection can take more
+    conn_fill(w, c);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+
+    for (int i = 0; i < w->nconns; i++)
+    {
+        w->conns[i].next_url = i;
+        if (conn_open(w, &w->conns[i]) == -1)
+            w->errors++;
+    }
+
+    struct epoll_event events[256];
+    while (1)
+    {
+        uint64_t now = now_ns();
+        if (now >= deadline_ns)
+            break;
+
+        // Open loop: everything whose time has come is due, whether or not
+        // a connection is free to take it
+        int timeout = 100;
+        if (w->interval_ns > 0)
+        {
+            while (1)
+            {
+                uint64_t at = w->start_ns + (uint64_t)(w->scheduled * w->interval_ns);
+                if (at > now)
+                {
+                    uint64_t wait_ms = (at - now + 999999) / 1000000;
+                    timeout = wait_ms < 100 ? (int)wait_ms : 100;
+                    break;
+                }
+                struct pending p = {.intended_ns = at, .url = -1};
+                if (w->backlog_tail - w->backlog_head < BACKLOG_SIZE)
+                    w->backlog[w->backlog_tail++ % BACKLOG_SIZE] = p;
+                else
+                    w->overflow++;
+                w->scheduled++;
+            }
+            dispatch(w);
+        }
+
+        int n = epoll_wait(w->epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++)
+            conn_on_event(w, events[i].data.ptr, events[i].events);
+    }
+
+    for (int i = 0; i < w->nconns; i++)
+        if (w->conns[i].fd != -1)
+            close(w->conns[i].fd);
+    close(w->epfd);
+    return NULL;
+}
+
+// -------------------------------------------
+// Report
+// -------------------------------------------
+static const double QUANTILES[] = {0.50, 0.90, 0.99, 0.999, 0.9999};
+static const char *QUANTILE_NAMES[] = {"p50", "p90", "p99", "p999", "p9999"};
+#define NQUANTILES (sizeof(QUANTILES) / sizeof(QUANTILES[0]))
+
+static void print_text(const char *label, const struct histogram *h)
+{
+    printf("%-11s", label);
+    for (size_t q = 0; q < NQUANTILES; q++)
+        printf(" %s=%.3fms", QUANTILE_NAMES[q], histogram_quantile(h, QUANTILES[q]) / 1e6);
+    printf(" max=%.3fms\n", h->max / 1e6);
+}
+
+static void print_json(const char *label, const struct histogram *h)
+{
+    printf("\"%s_ms\": {", label);
+    for (size_t q = 0; q < NQUANTILES; q++)
+        printf("\"%s\": %.4f, ", QUANTILE_NAMES[q], histogram_quantile(h, QUANTILES[q]) / 1e6);
+    printf("\"max\": %.4f}", h->max / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = 1;
+    int nconns = 16;
+    int seconds = 10;
+    double rate = 0;
+    int json = 0;
+    const char *url_file = NULL;
+    const char *root = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:jkp:r:t:u:R:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        case 'p':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            root = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'u':
+            url_file = optarg;
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+
+    if (argc - optind != 1 || nthreads <= 0 || nconns < nthreads || seconds <= 0 || depth <= 0 ||
+        depth > MAX_DEPTH || rate < 0)
+    {
+        fprintf(stderr,
+                "Usage: %s [-t threads] [-c connections] [-d seconds] [-R rate] [-k] [-p depth]\n"
+                "          [-u url_file | -r root_dir] [-j] <port>\n"
+                "  -R  open loop at this many requests/s in total, latency corrected for\n"
+                "      coordinated omission (default: closed loop)\n"
+                "  -k  keep connections alive (HTTP/1.1)\n"
+                "  -p  requests pipelined per connection with -k, 1..%d (default 1)\n"
+                "  -u  URLs to request, one per line\n"
+                "  -r  request every file under this directory (e.g. public)\n"
+                "  -j  print one JSON object instead of text\n",
+                argv[0], MAX_DEPTH);
+        return 1;
+    }
+
+    if ((url_file && load_urls_from_file(url_file) == -1) || (root && load_urls_from_tree(root) == -1))
+    {
+        perror("url list");
+        return 1;
+    }
+    if (nurls == 0)
+        add_url("/");
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind]));
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    uint64_t start = now_ns();
+    deadline_ns = start + (uint64_t)seconds * 1000000000ULL;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct worker *w = &workers[i];
+        w->nconns = nconns / nthreads + (i < nconns % nthreads);
+        w->conns = calloc(w->nconns, sizeof(struct conn));
+        w->epfd = epoll_create1(0);
+        w->start_ns = start;
+        if (rate > 0)
+        {
+            w->interval_ns = 1e9 * nthreads / rate;
+            w->backlog = malloc(BACKLOG_SIZE * sizeof(struct pending));
+        }
+        if (!w->conns || w->epfd == -1 || (rate > 0 && !w->backlog))
+        {
+            perror("setup");
+            return 1;
+        }
+        pthread_create(&w->thread, NULL, worker_main, w);
+    }
+
+    struct worker total = {0};
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        histogram_merge(&total.corrected, &w->corrected);
+        histogram_merge(&total.raw, &w->raw);
+        total.completed += w->completed;
+        total.errors += w->errors;
+        total.reconnects += w->reconnects;
+        total.overflow += w->overflow;
+        total.bytes += w->bytes;
+        for (int s = 0; s < 6; s++)
+            total.status[s] += w->status[s];
+    }
+
+    double rps = (double)total.completed / seconds;
+    uint64_t non2xx = total.completed - total.status[2];
+    if (json)
+    {
+        printf("{\"mode\": \"%s\", \"target_rps\": %.0f, \"threads\": %d, \"connections\": %d, "
+               "\"keep_alive\": %d, \"depth\": %d, \"urls\": %d, \"seconds\": %d, "
+               "\"requests\": %llu, \"rps\": %.1f, \"mb_per_s\": %.2f, \"non_2xx\": %llu, "
+               "\"errors\": %llu, \"reconnects\": %llu, \"backlog_overflow\": %llu, ",
+               rate > 0 ? "open" : "closed", rate, nthreads, nconns, keep_alive, depth, nurls, seconds,
+               (unsigned long long)total.completed, rps, total.bytes / 1e6 / seconds,
+               (unsigned long long)non2xx, (unsigned long long)total.errors,
+               (unsigned long long)total.reconnects, (unsigned long long)total.overflow);
+        print_json("latency", rate > 0 ? &total.corrected : &total.raw);
+        printf(", ");
+        print_json("uncorrected", &total.raw);
+        printf("}\n");
+        return 0;
+    }
+
+    printf("%s loop, %d threads, %d connections, %s, depth %d, %d urls, %ds\n",
+           rate > 0 ? "open" : "closed", nthreads, nconns, keep_alive ? "keep-alive" : "close", depth, nurls,
+           seconds);
+    if (rate > 0)
+        printf("target     %.0f req/s\n", rate);
+    printf("requests   %llu (%.1f req/s, %.2f MB/s body)\n", (unsigned long long)total.completed, rps,
+           total.bytes / 1e6 / seconds);
+    printf("non-2xx    %llu   errors %llu   reconnects %llu   backlog overflow %llu\n",
+           (unsigned long long)non2xx, (unsigned long long)total.errors, (unsigned long long)total.reconnects,
+           (unsigned long long)total.overflow);
+    if (rate > 0)
+    {
+        print_text("corrected", &total.corrected);
+        print_text("uncorrected", &total.raw);
+    }
+    else
+        print_text("latency", &total.raw);
+    return 0;
+}
@@ -0,0 +1,471 @@
+// Microbenchmarks for the request-path helpers in server.c, one at a time:
+// request parsing, MIME lookup, path resolution and response formatting.
+// Each helper is measured next to a candidate replacement, so a change can
+// be judged by how much it moves its own helper, not only end to end.
+//
+// server.c is compiled in directly (its main() renamed), so the benchmarks
+// always run the current code. malloc/calloc/realloc are wrapped to count
+// allocations per operation, including those made inside libc (fopen).
+//
+// Every benchmark is calibrated to run for about 100 ms, then repeated
+// REPEATS times; the median and best ns/op are reported.
+//
+// Build: gcc -O2 -o micro bench/micro.c
+// Run:   ./micro [-f text|csv|json] [name_filter]   (from the repo root: uses public/)
+
+#define main server_main
+#include "../server.c"
+#undef main
+
+#include <linux/openat2.h>
+
+#define REPEATS 5
+#define TARGET_NS 100000000ULL
+
+// -------------------------------------------
+// Allocation counting
+// -------------------------------------------
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocations;
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+// Keeps the compiler from dropping a result it can see is unused
+#define KEEP(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+
+// -------------------------------------------
+// Inputs
+// -------------------------------------------
+static const char *REQUESTS[] = {
+    "GET /index.html HTTP/1.1\r\nHost: localhost\r\nUser-Agent: micro\r\nAccept: */*\r\n\r\n",
+    "GET /nested/subpath1.html?utm_source=x HTTP/1.1\r\nHost: localhost\r\n\r\n",
+    "GET /image.jpg HTTP/1.0\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+};
+#define NREQUESTS (sizeof(REQUESTS) / sizeof(REQUESTS[0]))
+
+static const char *PATHS[] = {"/var/www/index.html", "/var/www/image.jpg", "/var/www/app.js",
+                              "/var/www/style.css", "/var/www/logo.png", "/var/www/README"};
+#define NPATHS (sizeof(PATHS) / sizeof(PATHS[0]))
+
+static const char *ROOT = "public";
+static int root_fd;
+static char real_root[PATH_MAX];
+static size_t real_root_len;
+static int sink_fd[2];
+
+// -------------------------------------------
+// Candidates
+// -------------------------------------------
+// Request line split by hand: one pass with memchr, no format parsing.
+// Same results as parse_request() for well-formed request lines.
+int parse_request_scan(const char *buf, struct request *req, const char **error)
+{
+    const char *eol = strstr(buf, "\r\n");
+    size_t line_len = eol ? (size_t)(eol - buf) : strlen(buf);
+    const char *sp1 = memchr(buf, ' ', line_len);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', line_len - (sp1 + 1 - buf)) : NULL;
+    size_t mlen = sp1 ? (size_t)(sp1 - buf) : 0;
+    size_t plen = sp2 ? (size_t)(sp2 - sp1 - 1) : 0;
+    size_t vlen = sp2 ? line_len - (sp2 + 1 - buf) : 0;
+
+    if (!sp2 || mlen == 0 || mlen >= sizeof(req->method) || plen == 0 || plen >= sizeof(req->path) ||
+        vlen == 0 || vlen >= sizeof(req->protocol))
+    {
+        *error = "Malformed request";
+        return 400;
+    }
+    memcpy(req->method, buf, mlen);
+    req->method[mlen] = '\0';
+    memcpy(req->protocol, sp2 + 1, vlen);
+    req->protocol[vlen] = '\0';
+
+    // Path up to the query string or fragment
+    size_t keep = strcspn(sp1 + 1, "?# ");
+    if (keep > plen)
+        keep = plen;
+    memcpy(req->path, sp1 + 1, keep);
+    req->path[keep] = '\0';
+
+    if (memmem(req->path, keep, "..", 2))
+    {
+        *error = "Forbidden path traversal";
+        return 403;
+    }
+    if (mlen != 3 || memcmp(req->method, "GET", 3) != 0)
+    {
+        *error = "Only GET is supported";
+        return 501;
+    }
+    return 0;
+}
+
+// Extension compared by length first, then with one memcmp
+const char *get_content_type_table(const char *path)
+{
+    static const struct
+    {
+        const char *ext;
+        size_t len;
+        const char *type;
+    } types[] = {
+        {".html", 5, "text/html"}, {".jpg", 4, "image/jpeg"}, {".jpeg", 5, "image/jpeg"},
+        {".png", 4, "image/png"},  {".css", 4, "text/css"},   {".js", 3, "application/javascript"},
+    };
+
+    const char *ext = strrchr(path, '.');
+    if (!ext)
+        return "text/plain";
+    size_t len = strlen(ext);
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (types[i].len == len && memcmp(types[i].ext, ext, len) == 0)
+            return types[i].type;
+    return "application/octet-stream";
+}
+
+// One realpath(): the root is resolved once at startup
+int resolve_path_cached_root(const struct request *req, struct response *res)
+{
+    char requested_path[PATH_MAX];
+    snprintf(requested_path, sizeof(requested_path), "%s%s", ROOT,
+             strcmp(req->path, "/") == 0 ? "/index.html" : req->path);
+    if (!realpath(requested_path, res->path))
+        return -1;
+    return strncmp(res->path, real_root, real_root_len) == 0 ? 0 : -1;
+}
+
+// No realpath(): openat2() with RESOLVE_BENEATH lets the kernel refuse
+// anything outside the root, and returns the fd the read needs anyway
+int resolve_openat2(const struct request *req)
+{
+    struct open_how how = {.flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH};
+    const char *rel = strcmp(req->path, "/") == 0 ? "index.html" : req->path + 1;
+    int fd = syscall(SYS_openat2, root_fd, rel, &how, sizeof(how));
+    if (fd != -1)
+        close(fd);
+    return fd == -1 ? -1 : 0;
+}
+
+// The header send_response() builds, assembled with memcpy instead of snprintf
+int format_header_memcpy(char *out, int status_code, const char *status_text, const char *content_type,
+                         long body_len)
+{
+    char *p = out;
+    memcpy(p, "HTTP/1.0 ", 9);
+    p += 9;
+    *p++ = '0' + status_code / 100;
+    *p++ = '0' + status_code / 10 % 10;
+    *p++ = '0' + status_code % 10;
+    *p++ = ' ';
+    size_t n = strlen(status_text);
+    memcpy(p, status_text, n);
+    p += n;
+    memcpy(p, "\r\nContent-Type: ", 16);
+    p += 16;
+    n = strlen(content_type);
+    memcpy(p, content_type, n);
+    p += n;
+    memcpy(p, "\r\nContent-Length: ", 18);
+    p += 18;
+
+    char digits[24];
+    int d = 0;
+    do
+        digits[d++] = '0' + body_len % 10;
+    while ((body_len /= 10) > 0);
+    while (d > 0)
+        *p++ = digits[--d];
+    memcpy(p, "\r\n\r\n", 4);
+    return (int)(p + 4 - out);
+}
+
+// -------------------------------------------
+// Benchmarks: each runs n operations
+// -------------------------------------------
+static void bench_parse_sscanf(uint64_t n)
+{
+    struct request req;
+    const char *error;
+    for (uint64_t i = 0; i < n; i++)
+    {
+        KEEP(parse_request(REQUESTS[i % NREQUESTS], &req, &error));
+        KEEP(req.path[0]);
+    }
+}
+
+static void bench_parse_scan(uint64_t n)
+{
+    struct request req;
+    const char *error;
+    for (uint64_t i = 0; i < n; i++)
+    {
+        KEEP(parse_request_scan(REQUESTS[i % NREQUESTS], &req, &error));
+        KEEP(req.path[0]);
+    }
+}
+
+static void bench_mime_strcmp(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+        KEEP(get_content_type(PATHS[i % NPATHS]));
+}
+
+static void bench_mime_table(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+        KEEP(get_content_type_table(PATHS[i % NPATHS]));
+}
+
+static struct request resolve_requests[3];
+
+static void bench_resolve_realpath2(uint64_t n)
+{
+    struct response res;
+    for (uint64_t i = 0; i < n; i++)
+        KEEP(resolve_path(&resolve_requests[i % 3], ROOT, &res));
+}
+
+static void bench_resolve_realpath1(uint64_t n)
+{
+    struct response res;
+    for (uint64_t i = 0; i < n; i++)
+        KEEP(resolve_path_cached_root(&resolve_requests[i % 3], &res));
+}
+
+static void bench_resolve_openat2(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+        KEEP(resolve_openat2(&resolve_requests[i % 3]));
+}
+
+static void bench_header_snprintf(uint64_t n)
+{
+    char header[512];
+    for (uint64_t i = 0; i < n; i++)
+    {
+        // The format send_response() and send_loaded_response() use
+        KEEP(snprintf(header, sizeof(header),
+                      "HTTP/1.0 %d %s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Length: %ld\r\n"
+                      "\r\n",
+                      200, "OK", "text/html", (long)(i & 0xffff)));
+        KEEP(header[0]);
+    }
+}
+
+static void bench_header_memcpy(uint64_t n)
+{
+    char header[512];
+    for (uint64_t i = 0; i < n; i++)
+    {
+        KEEP(format_header_memcpy(header, 200, "OK", "text/html", (long)(i & 0xffff)));
+        KEEP(header[0]);
+    }
+}
+
+// The whole function, sends included, into a local socket that is drained
+// every so often (the drain is part of the measured time)
+static void bench_send_response(uint64_t n)
+{
+    char drain[65536];
+    for (uint64_t i = 0; i < n; i++)
+    {
+        KEEP(send_response(sink_fd[0], 200, "OK", "application/json", "{\"ok\": true}"));
+        if (i % 64 == 63)
+            while (recv(sink_fd[1], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+                ;
+    }
+    while (recv(sink_fd[1], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+        ;
+}
+
+static void bench_read_file(uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+    {
+        long size;
+        char *body = read_file("public/index.html", &size);
+        KEEP(body);
+        free(body);
+    }
+}
+
+struct benchmark
+{
+    const char *group;
+    const char *name;
+    void (*run)(uint64_t n);
+};
+
+static const struct benchmark BENCHMARKS[] = {
+    {"parse", "parse_request_sscanf", bench_parse_sscanf},
+    {"parse", "parse_request_scan", bench_parse_scan},
+    {"mime", "get_content_type", bench_mime_strcmp},
+    {"mime", "get_content_type_table", bench_mime_table},
+    {"resolve", "resolve_path_realpath2", bench_resolve_realpath2},
+    {"resolve", "resolve_path_realpath1", bench_resolve_realpath1},
+    {"resolve", "resolve_openat2_beneath", bench_resolve_openat2},
+    {"format", "header_snprintf", bench_header_snprintf},
+    {"format", "header_memcpy", bench_header_memcpy},
+    {"format", "send_response", bench_send_response},
+    {"read", "read_file", bench_read_file},
+};
+#define NBENCHMARKS (sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]))
+
+struct result
+{
+    double median_ns;
+    double best_ns;
+    double allocs;
+    uint64_t iterations;
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static struct result measure(const struct benchmark *b)
+{
+    // Grow the batch until one run takes long enough to time reliably
+    uint64_t n = 16;
+    while (1)
+    {
+        uint64_t start = now_ns();
+        b->run(n);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= TARGET_NS / 10 || n >= (1ULL << 32))
+        {
+            n = elapsed ? n * TARGET_NS / elapsed : n * 16;
+            break;
+        }
+        n *= 4;
+    }
+    if (n == 0)
+        n = 1;
+
+    double per_op[REPEATS];
+    uint64_t allocs_before = allocations;
+    for (int r = 0; r < REPEATS; r++)
+    {
+        uint64_t start = now_ns();
+        b->run(n);
+        per_op[r] = (double)(now_ns() - start) / n;
+    }
+    qsort(per_op, REPEATS, sizeof(double), cmp_double);
+
+    struct result res = {
+        .median_ns = per_op[REPEATS / 2],
+        .best_ns = per_op[0],
+        .allocs = (double)(allocations - allocs_before) / ((double)n * REPEATS),
+        .iterations = n,
+    };
+    return res;
+}
+
+// Both parsers must agree on the sample requests before their speed means anything
+static int check_parsers(void)
+{
+    for (size_t i = 0; i < NREQUESTS; i++)
+    {
+        struct request a, b;
+        const char *ea, *eb;
+        int sa = parse_request(REQUESTS[i], &a, &ea);
+        int sb = parse_request_scan(REQUESTS[i], &b, &eb);
+        if (sa != sb || (sa == 0 && (strcmp(a.path, b.path) || strcmp(a.method, b.method) ||
+                                     strcmp(a.protocol, b.protocol))))
+        {
+            fprintf(stderr, "parsers disagree on request %zu: %s vs %s\n", i, a.path, b.path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *format = "text";
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1)
+    {
+        if (opt == 'f')
+            format = optarg;
+        else
+        {
+            fprintf(stderr, "Usage: %s [-f text|csv|json] [name_filter]\n", argv[0]);
+            return 1;
+        }
+    }
+    const char *filter = optind < argc ? argv[optind] : NULL;
+
+    root_fd = open(ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1 || !realpath(ROOT, real_root))
+    {
+        perror("public/ (run from the repo root)");
+        return 1;
+    }
+    real_root_len = strlen(real_root);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sink_fd) == -1)
+    {
+        perror("socketpair");
+        return 1;
+    }
+    int sndbuf = 1 << 20;
+    setsockopt(sink_fd[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    const char *resolve_paths[] = {"/index.html", "/nested/subpath1.html", "/missing.html"};
+    for (int i = 0; i < 3; i++)
+    {
+        snprintf(resolve_requests[i].method, sizeof(resolve_requests[i].method), "GET");
+        snprintf(resolve_requests[i].path, sizeof(resolve_requests[i].path), "%s", resolve_paths[i]);
+    }
+
+    if (check_parsers() == -1)
+        return 1;
+
+    if (strcmp(format, "csv") == 0)
+        printf("group,name,ns_per_op,best_ns_per_op,allocs_per_op,iterations\n");
+    else if (strcmp(format, "text") == 0)
+        printf("%-8s %-26s %12s %12s %10s\n", "group", "name", "ns/op", "best ns/op", "allocs/op");
+
+    for (size_t i = 0; i < NBENCHMARKS; i++)
+    {
+        const struct benchmark *b = &BENCHMARKS[i];
+        if (filter && !strstr(b->name, filter) && strcmp(b->group, filter) != 0)
+            continue;
+
+        struct result r = measure(b);
+        if (strcmp(format, "csv") == 0)
+            printf("%s,%s,%.2f,%.2f,%.3f,%llu\n", b->group, b->name, r.median_ns, r.best_ns, r.allocs,
+                   (unsigned long long)r.iterations);
+        else if (strcmp(format, "json") == 0)
+            printf("{\"group\": \"%s\", \"name\": \"%s\", \"ns_per_op\": %.2f, \"best_ns_per_op\": %.2f, "
+                   "\"allocs_per_op\": %.3f, \"iterations\": %llu}\n",
+                   b->group, b->name, r.median_ns, r.best_ns, r.allocs, (unsigned long long)r.iterations);
+        else
+            printf("%-8s %-26s %12.1f %12.1f %10.2f\n", b->group, b->name, r.median_ns, r.best_ns, r.allocs);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Training workload and speedup report for the PGO build (make pgo).
+#
+#   bench/pgo.sh train <instrumented_server>
+#     Runs the -fprofile-generate build against public/ with bench/load.c
+#     and the URL mix in bench/pgo_urls.txt: html and jpg hits, misses,
+#     404s, a rejected traversal and /__stats. It runs serial mode, then
+#     pool mode with the content cache and an I/O thread, so every serving
+#     path gets a profile. Each run ends with SIGTERM, which the server
+#     turns into exit(), so the profile is written out.
+#
+#   bench/pgo.sh compare <baseline_server> <pgo_server> [trials]
+#     Runs the same mix in closed loop against both builds, in alternating
+#     order. Prints the mean throughput and p99 of each build, and the
+#     speedup.
+#
+# Expects ./load (make load) and runs from the repo root.
+
+PORT=18091
+ROOT=$(dirname "$0")/../public
+URLS=$(dirname "$0")/pgo_urls.txt
+
+# serve <server> <seconds> <server options...>: one load run, JSON on stdout
+serve() {
+    server=$1
+    seconds=$2
+    shift 2
+    "$server" "$@" "$PORT" "$ROOT" >/dev/null &
+    pid=$!
+    sleep 0.5
+    ./load -j -t 2 -c 32 -d "$seconds" -u "$URLS" "$PORT"
+    kill -TERM "$pid"
+    wait "$pid"
+}
+
+case $1 in
+train)
+    [ $# -eq 2 ] || { echo "Usage: $0 train <instrumented_server>" >&2; exit 1; }
+    serve "$2" 3 >/dev/null || exit 1
+    serve "$2" 5 -a 2 -w 2 -i 1 -m 8 >/dev/null || exit 1
+    ;;
+compare)
+    [ $# -ge 3 ] || { echo "Usage: $0 compare <baseline_server> <pgo_server> [trials]" >&2; exit 1; }
+    trials=${4:-4}
+    out=$(mktemp)
+    i=1
+    while [ "$i" -le "$trials" ]; do
+        if [ $((i % 2)) -eq 1 ]; then order="$2 $3"; else order="$3 $2"; fi
+        for server in $order; do
+            serve "$server" 5 -w 2 |
+                sed -n "s|.*\"rps\": \([0-9.]*\).*\"latency_ms\": {[^}]*\"p99\": \([0-9.]*\).*|$server \1 \2|p" >>"$out"
+        done
+        i=$((i + 1))
+    done
+    awk -v base="$2" -v pgo="$3" '
+    { n[$1]++; rps[$1] += $2; p99[$1] += $3 }
+    END {
+        if (!n[base] || !n[pgo]) { print "no results"; exit 1 }
+        for (s in n) printf "%-24s %10.1f req/s   p99 %8.3f ms   (%d runs)\n", s, rps[s] / n[s], p99[s] / n[s], n[s]
+        printf "speedup: %+.2f%% throughput, %+.2f%% p99\n",
+               (rps[pgo] / n[pgo]) / (rps[base] / n[base]) * 100 - 100,
+               (p99[pgo] / n[pgo]) / (p99[base] / n[base]) * 100 - 100
+    }' "$out"
+    status=$?
+    rm -f "$out"
+    exit $status
+    ;;
+*)
+    sed -n '4,16p' "$0" | sed 's/^# \{0,1\}//' >&2
+    exit 1
+    ;;
+esac
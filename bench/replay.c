@@ -0,0 +1,420 @@
+// Replay traffic captured by the server's -r option against a server.
+//
+// Every connection in the capture is opened again at its original time and
+// sent the same bytes in the same chunks, at the same pace (or -s times
+// faster). Header sizes, the path mix and how requests were split across
+// packets are therefore the ones production saw. Chunks are replayed in
+// time order; the capture writer can store chunks from different server
+// threads slightly out of order, so they are sorted first.
+//
+// Reports status counts and latency (last chunk sent to response
+// complete). It also reports schedule lag: how late chunks went out. If
+// the lag is large, the replayer could not keep up and the run did not
+// reproduce the captured load; lower -s. With -v, prints one line per
+// connection ("conn_id status bytes latency_ms"). Two builds that serve the
+// same tree must print the same conn_id/status/bytes columns.
+//
+// Build: gcc -O2 -o replay bench/replay.c
+// Run:   ./server -r traffic.cap 8080 public      # capture, then stop the server
+//        ./replay [-s speed] [-v] traffic.cap <port>
+//        ./replay -p traffic.cap                  # print the capture as text
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_MAGIC "HTTPCAP1"
+#define CAPTURE_FIRST 1
+
+// Must match server.c
+struct capture_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t start_ns;
+};
+
+struct capture_record
+{
+    uint64_t offset_ns;
+    uint32_t conn_id;
+    uint16_t len;
+    uint16_t flags;
+};
+
+struct chunk
+{
+    struct capture_record rec;
+    const char *data;
+    int next; // next chunk of the same connection, -1 if last
+};
+
+struct conn
+{
+    int fd;
+    int connected;
+    int first;   // first chunk
+    int cursor;  // next chunk to send, -1 when all sent
+    int due;     // chunks due but not sent yet
+    size_t sent; // bytes of the cursor chunk already sent
+    uint64_t last_sent_ns;
+    uint64_t done_ns;
+    int status; // from the response status line, 0 until seen
+    long bytes;
+    char head[1024]; // start of the response, with room for a 103 ahead of the final one
+    int done;
+};
+
+static struct chunk *chunks;
+static size_t nchunks;
+static struct conn *conns; // indexed by conn_id
+static uint32_t max_id;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_chunk(const void *a, const void *b)
+{
+    const struct chunk *x = a, *y = b;
+    if (x->rec.offset_ns != y->rec.offset_ns)
+        return x->rec.offset_ns < y->rec.offset_ns ? -1 : 1;
+    return x < y ? -1 : x > y; // keep file order on ties
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Reads the whole capture into memory and sorts its chunks by time
+static char *load_capture(const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    struct stat st;
+    if (!in || fstat(fileno(in), &st) == -1)
+    {
+        perror(path);
+        exit(1);
+    }
+    char *file = malloc(st.st_size + 1);
+    if (!file || fread(file, 1, st.st_size, in) != (size_t)st.st_size)
+    {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(1);
+    }
+    fclose(in);
+
+    struct capture_header header;
+    if ((size_t)st.st_size < sizeof(header))
+        goto bad;
+    memcpy(&header, file, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != 1 ||
+        header.record_size != sizeof(struct capture_record))
+        goto bad;
+
+    // Count, then index
+    size_t cap = 1024;
+    chunks = malloc(cap * sizeof(struct chunk));
+    for (size_t pos = sizeof(header); pos + sizeof(struct capture_record) <= (size_t)st.st_size;)
+    {
+        struct chunk c;
+        memcpy(&c.rec, file + pos, sizeof(c.rec));
+        pos += sizeof(c.rec);
+        if (pos + c.rec.len > (size_t)st.st_size || c.rec.conn_id == 0)
+            break; // truncated tail (server killed mid-write)
+        c.data = file + pos;
+        pos += c.rec.len;
+        if (nchunks == cap)
+            chunks = realloc(chunks, (cap *= 2) * sizeof(struct chunk));
+        chunks[nchunks++] = c;
+        if (c.rec.conn_id > max_id)
+            max_id = c.rec.conn_id;
+    }
+    qsort(chunks, nchunks, sizeof(struct chunk), cmp_chunk);
+    return file;
+
+bad:
+    fprintf(stderr, "%s: not a version 1 capture\n", path);
+    exit(1);
+}
+
+static void print_capture(void)
+{
+    for (size_t i = 0; i < nchunks; i++)
+    {
+        const struct chunk *c = &chunks[i];
+        printf("%12.6f conn=%u len=%u%s ", c->rec.offset_ns / 1e9, c->rec.conn_id, c->rec.len,
+               c->rec.flags & CAPTURE_FIRST ? " first" : "");
+        for (int j = 0; j < c->rec.len; j++)
+        {
+            unsigned char ch = c->data[j];
+            if (ch == '\r')
+                printf("\\r");
+            else if (ch == '\n')
+                printf("\\n");
+            else if (isprint(ch))
+                putchar(ch);
+            else
+                printf("\\x%02x", ch);
+        }
+        putchar('\n');
+    }
+}
+
+static int epfd;
+static int port;
+static long errors;
+static long nopen;
+
+static void conn_open(struct conn *c)
+{
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (c->fd == -1 || (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS))
+    {
+        perror("connect");
+        exit(1);
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    nopen++;
+}
+
+static void conn_close(struct conn *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->done = 1;
+    nopen--;
+}
+
+// Sends the chunks that are due, as far as the socket takes them
+static void conn_flush(struct conn *c)
+{
+    while (c->connected && c->due > 0 && c->cursor != -1)
+    {
+        const struct chunk *ch = &chunks[c->cursor];
+        ssize_t n = send(c->fd, ch->data + c->sent, ch->rec.len - c->sent, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno != EAGAIN)
+            {
+                errors++;
+                conn_close(c);
+            }
+            return;
+        }
+        c->sent += n;
+        if (c->sent < ch->rec.len)
+            return;
+        c->sent = 0;
+        c->due--;
+        c->cursor = ch->next;
+        c->last_sent_ns = now_ns();
+    }
+}
+
+static void on_event(struct conn *c, uint32_t events)
+{
+    if (c->fd == -1)
+        return;
+    if (!c->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+        {
+            errors++;
+            conn_close(c);
+            return;
+        }
+        c->connected = 1;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    conn_flush(c);
+
+    if (c->fd == -1 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(c->fd, buf, sizeof(buf), 0)) > 0)
+    {
+        if (c->bytes < (long)sizeof(c->head) - 1)
+        {
+            size_t take = sizeof(c->head) - 1 - c->bytes;
+            memcpy(c->head + c->bytes, buf, (size_t)n < take ? (size_t)n : take);
+        }
+        c->bytes += n;
+    }
+    if (n == -1 && errno == EAGAIN)
+        return;
+
+    // The server closed: response complete. Interim responses (103 Early
+    // Hints) come first; the status is the final one's.
+    const char *head = c->head;
+    c->status = 0;
+    while (sscanf(head, "HTTP/%*d.%*d %d", &c->status) == 1 && c->status < 200)
+    {
+        const char *next = strstr(head, "\r\n\r\n");
+        c->status = 0;
+        if (!next)
+            break;
+        head = next + 4;
+    }
+    if (c->cursor != -1)
+        errors++; // closed before we sent everything
+    c->done_ns = now_ns();
+    conn_close(c);
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    int print = 0, verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ps:v")) != -1)
+    {
+        if (opt == 'p')
+            print = 1;
+        else if (opt == 's')
+            speed = atof(optarg);
+        else if (opt == 'v')
+            verbose = 1;
+        else
+            optind = argc + 1;
+    }
+    if (argc - optind != (print ? 1 : 2) || speed <= 0)
+    {
+        fprintf(stderr, "Usage: %s [-s speed] [-v] <capture_file> <port>\n"
+                        "       %s -p <capture_file>\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+    load_capture(argv[optind]);
+    if (print)
+    {
+        print_capture();
+        return 0;
+    }
+    port = atoi(argv[optind + 1]);
+
+    // Link every connection's chunks in time order
+    conns = calloc(max_id + 1, sizeof(struct conn));
+    int *last = malloc((max_id + 1) * sizeof(int));
+    for (uint32_t i = 0; i <= max_id; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].first = conns[i].cursor = last[i] = -1;
+    }
+    for (size_t i = 0; i < nchunks; i++)
+    {
+        uint32_t id = chunks[i].rec.conn_id;
+        chunks[i].next = -1;
+        if (last[id] == -1)
+            conns[id].first = conns[id].cursor = i;
+        else
+            chunks[last[id]].next = i;
+        last[id] = i;
+    }
+    free(last);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    epfd = epoll_create1(0);
+    uint64_t *lag = malloc((nchunks + 1) * sizeof(uint64_t));
+    size_t next = 0;
+    uint64_t start = now_ns();
+    while (next < nchunks || nopen > 0)
+    {
+        // Release every chunk whose time has come
+        uint64_t now = now_ns();
+        while (next < nchunks && start + (uint64_t)(chunks[next].rec.offset_ns / speed) <= now)
+        {
+            struct conn *c = &conns[chunks[next].rec.conn_id];
+            lag[next] = now - (start + (uint64_t)(chunks[next].rec.offset_ns / speed));
+            if (!c->done)
+            {
+                if (c->fd == -1)
+                    conn_open(c);
+                c->due++;
+                conn_flush(c);
+            }
+            next++;
+        }
+
+        int timeout = 10;
+        if (next < nchunks)
+        {
+            uint64_t due = start + (uint64_t)(chunks[next].rec.offset_ns / speed);
+            now = now_ns();
+            timeout = due > now ? (int)((due - now) / 1000000) : 0;
+            if (timeout > 10)
+                timeout = 10;
+        }
+        struct epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, timeout);
+        for (int i = 0; i < n; i++)
+            on_event(events[i].data.ptr, events[i].events);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // Summary
+    long by_class[6] = {0}; // 0: no status line
+    uint64_t *latency = malloc((max_id + 1) * sizeof(uint64_t));
+    size_t nlatency = 0, nconns = 0;
+    long bytes_in = 0;
+    for (uint32_t id = 1; id <= max_id; id++)
+    {
+        struct conn *c = &conns[id];
+        if (c->first == -1)
+            continue;
+        nconns++;
+        bytes_in += c->bytes;
+        by_class[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+        uint64_t ns = c->status && c->cursor == -1 ? c->done_ns - c->last_sent_ns : 0;
+        if (c->status && c->cursor == -1)
+            latency[nlatency++] = ns;
+        if (verbose)
+            printf("%u %d %ld %.3f\n", id, c->status, c->bytes, ns / 1e6);
+    }
+    qsort(latency, nlatency, sizeof(uint64_t), cmp_u64);
+    qsort(lag, nchunks, sizeof(uint64_t), cmp_u64);
+
+    printf("connections: %zu, chunks: %zu, %.2f s at %gx (captured %.2f s)\n", nconns, nchunks, elapsed, speed,
+           nchunks ? chunks[nchunks - 1].rec.offset_ns / 1e9 : 0.0);
+    printf("status: 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, none %ld; errors %ld; %ld bytes received\n", by_class[2],
+           by_class[3], by_class[4], by_class[5], by_class[0] + by_class[1], errors, bytes_in);
+    if (nlatency)
+        printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", latency[nlatency / 2] / 1e6,
+               latency[(size_t)(nlatency * 0.9)] / 1e6, latency[(size_t)(nlatency * 0.99)] / 1e6,
+               latency[nlatency - 1] / 1e6);
+    if (nchunks)
+        printf("schedule lag ms: p99 %.3f  max %.3f\n", lag[(size_t)(nchunks * 0.99)] / 1e6, lag[nchunks - 1] / 1e6);
+    return errors > 0;
+}
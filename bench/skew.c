@@ -0,0 +1,194 @@
+// Skewed-workload benchmark: a few huge files mixed with many tiny ones.
+//
+// Each client thread runs a closed loop of one-request-per-connection GETs.
+// A request is for the big file with probability <big_pct>%, otherwise for
+// one of the small files. Latency is reported per class, so head-of-line
+// blocking (tiny requests waiting behind a huge one) shows up in the small
+// files' p99.
+//
+// Build: gcc -O2 -pthread -o skew bench/skew.c
+// Run:   ./skew <port> <threads> <seconds> <big_pct> <big_path> <small_path>...
+// A/B:   bench/skew_ab.sh runs the same load against serial and pool mode.
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SAMPLES 200000
+
+struct samples
+{
+    uint64_t *ns;
+    int count;
+};
+
+struct client
+{
+    pthread_t thread;
+    unsigned seed;
+    struct samples big;
+    struct samples small;
+    long errors;
+};
+
+static int port;
+static int big_pct;
+static const char *big_path;
+static const char **small_paths;
+static int small_count;
+static uint64_t deadline_ns;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// One connection, one request, read until the server closes
+static int fetch(const char *path)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char req[512];
+    int len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: localhost\r\n\r\n", path);
+    if (send(fd, req, len, 0) != len)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char buf[65536];
+    ssize_t n, total = 0;
+    int ok = 0;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+    {
+        // Anything but a 200 counts as an error
+        if (total == 0)
+            ok = n >= 12 && memcmp(buf + 8, " 200", 4) == 0;
+        total += n;
+    }
+    close(fd);
+
+    return (ok && n == 0) ? 0 : -1;
+}
+
+static void record(struct samples *s, uint64_t ns)
+{
+    if (s->count < MAX_SAMPLES)
+        s->ns[s->count++] = ns;
+}
+
+static void *client_main(void *arg)
+{
+    struct client *c = arg;
+
+    while (now_ns() < deadline_ns)
+    {
+        int big = (int)(rand_r(&c->seed) % 100) < big_pct;
+        const char *path = big ? big_path : small_paths[rand_r(&c->seed) % small_count];
+
+        uint64_t start = now_ns();
+        if (fetch(path) == -1)
+        {
+            c->errors++;
+            continue;
+        }
+        record(big ? &c->big : &c->small, now_ns() - start);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, struct client *clients, int nthreads,
+                   struct samples *(*pick)(struct client *), int seconds)
+{
+    int total = 0;
+    for (int i = 0; i < nthreads; i++)
+        total += pick(&clients[i])->count;
+
+    uint64_t *all = malloc(sizeof(uint64_t) * (total ? total : 1));
+    int k = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        struct samples *s = pick(&clients[i]);
+        memcpy(all + k, s->ns, sizeof(uint64_t) * s->count);
+        k += s->count;
+    }
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+
+    if (total == 0)
+        printf("%-6s requests=0\n", name);
+    else
+        printf("%-6s requests=%d rps=%.0f p50=%.3fms p99=%.3fms max=%.3fms\n",
+               name, total, (double)total / seconds,
+               all[total / 2] / 1e6, all[(int)(total * 0.99)] / 1e6, all[total - 1] / 1e6);
+    free(all);
+}
+
+static struct samples *pick_big(struct client *c) { return &c->big; }
+static struct samples *pick_small(struct client *c) { return &c->small; }
+
+int main(int argc, char *argv[])
+{
+    if (argc < 7)
+    {
+        fprintf(stderr, "Usage: %s <port> <threads> <seconds> <big_pct> <big_path> <small_path>...\n", argv[0]);
+        return 1;
+    }
+
+    port = atoi(argv[1]);
+    int nthreads = atoi(argv[2]);
+    int seconds = atoi(argv[3]);
+    big_pct = atoi(argv[4]);
+    big_path = argv[5];
+    small_paths = (const char **)&argv[6];
+    small_count = argc - 6;
+
+    struct client *clients = calloc(nthreads, sizeof(struct client));
+    deadline_ns = now_ns() + (uint64_t)seconds * 1000000000ULL;
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        clients[i].seed = 0x9e3779b9u * (i + 1);
+        clients[i].big.ns = malloc(sizeof(uint64_t) * MAX_SAMPLES);
+        clients[i].small.ns = malloc(sizeof(uint64_t) * MAX_SAMPLES);
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+
+    long errors = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        errors += clients[i].errors;
+    }
+
+    report("big", clients, nthreads, pick_big, seconds);
+    report("small", clients, nthreads, pick_small, seconds);
+    printf("errors=%ld\n", errors);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# A/B the skewed workload (bench/skew.c) against serial mode and pool mode.
+#
+# Usage: bench/skew_ab.sh [workers] [client_threads] [seconds] [big_pct]
+# Expects ./server and ./skew in the current directory, built from
+# server.c and bench/skew.c.
+
+WORKERS=${1:-4}
+THREADS=${2:-32}
+SECONDS_PER_RUN=${3:-10}
+BIG_PCT=${4:-2}
+PORT=18080
+ROOT=$(dirname "$0")/../public
+
+run() {
+    label=$1
+    shift
+    ./server "$@" "$PORT" "$ROOT" >/dev/null &
+    pid=$!
+    sleep 0.5
+    echo "== $label"
+    ./skew "$PORT" "$THREADS" "$SECONDS_PER_RUN" "$BIG_PCT" /image.jpg \
+        /index.html /path1.html /path2.html /nested/subpath1.html
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+}
+
+run "serial" -w 0
+run "pool (-w $WORKERS)" -w "$WORKERS"
@@ -0,0 +1,101 @@
+#!/bin/sh
+# Smoke runs of the load and replay clients against ./server on public/.
+#
+#   bench/smoke.sh [server]
+#
+# Each load class starts the server with its options, runs ./load for a
+# second with keep-alive, and fails unless every response was a 2xx with
+# no errors. The replay class captures a load run with -r and replays it
+# against a fresh server; it fails on errors, non-2xx responses, or
+# responses with no final status line.
+#
+#   serial   serial mode, HTTP/1.0 responses
+#   pool     -w 2 -m 8, content cache hits
+#   hints    -m 8 -e on /preload.html: a 103 Early Hints precedes each 200
+#   replay   the hints class, captured and replayed
+#   limiter  -w 24 -q 64: 16 curl clients download a 16 MiB file at 32 MB/s
+#            while ./load sends 50 small requests/s. Slow body transfers
+#            must not shrink the admission limit: no 503s.
+#
+# Expects ./load and ./replay (make bench) and curl, and runs from the repo
+# root.
+
+SERVER=${1:-./server}
+PORT=18092
+ROOT=$(dirname "$0")/../public
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+printf '/index.html\n/image.jpg\n/nested/subpath1.html\n' >"$TMP/files.txt"
+echo /preload.html >"$TMP/preload.txt"
+failed=0
+
+# start <server options...>: the server in the background, pid in $pid
+start() {
+    "$SERVER" "$@" "$PORT" "${root:-$ROOT}" >/dev/null &
+    pid=$!
+    sleep 0.5
+}
+
+stop() {
+    kill -TERM "$pid"
+    wait "$pid"
+}
+
+# check <class> <ok>: report one class, remember a failure
+check() {
+    if [ "$2" = 1 ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        failed=1
+    fi
+}
+
+# load_class <class> <url_file> <server options...>
+load_class() {
+    class=$1
+    urls=$2
+    shift 2
+    start "$@"
+    out=$(./load -k -t 1 -c 4 -d 1 -u "$urls" "$PORT")
+    stop
+    echo "$out" | grep -q '^non-2xx    0   errors 0 ' && ! echo "$out" | grep -q '^requests   0 '
+    check "$class" $((! $?))
+}
+
+load_class serial "$TMP/files.txt"
+load_class pool "$TMP/files.txt" -w 2 -m 8
+load_class hints "$TMP/preload.txt" -m 8 -e
+
+start -m 8 -e -r "$TMP/traffic.cap"
+./load -k -t 1 -c 4 -d 1 -R 200 -u "$TMP/preload.txt" "$PORT" >/dev/null
+stop
+start -m 8 -e
+out=$(./replay "$TMP/traffic.cap" "$PORT")
+stop
+echo "$out" | grep -q '3xx 0, 4xx 0, 5xx 0, none 0; errors 0;' && ! echo "$out" | grep -q 'status: 2xx 0,'
+check replay $((! $?))
+
+mkdir "$TMP/root"
+cp -r "$ROOT"/. "$TMP/root"
+head -c 16M /dev/zero >"$TMP/root/large.bin"
+root=$TMP/root start -w 24 -q 64
+downloads=
+for i in $(seq 16); do
+    (
+        end=$(($(date +%s) + 6))
+        while [ "$(date +%s)" -lt "$end" ]; do
+            curl -s --limit-rate 32M -o /dev/null "http://127.0.0.1:$PORT/large.bin"
+        done
+    ) &
+    downloads="$downloads $!"
+done
+sleep 1
+out=$(./load -t 1 -c 4 -d 4 -R 50 -u "$TMP/files.txt" "$PORT")
+wait $downloads
+stats=$(curl -s "http://127.0.0.1:$PORT/__stats")
+stop
+echo "$out" | grep -q '^non-2xx    0   errors 0 ' && echo "$stats" | grep -q '"503": 0,'
+check limiter $((! $?))
+
+exit $failed
@@ -0,0 +1,273 @@
+// TLS benchmark: handshake rate and bulk throughput against the server's
+// HTTPS mode (-C/-K).
+//
+// Every request is a new connection, as the server closes after each
+// response. Client threads run closed loop with blocking sockets:
+//
+//   handshake  GET a small file (default /index.html) and report
+//              handshakes per second and handshake latency. With -r 0
+//              every handshake is a full one; by default the client
+//              offers the session from its previous connection, so the
+//              server resumes it (TLS 1.3 ticket or TLS 1.2 session id),
+//              which is the steady state of a returning browser.
+//   bulk       GET a large file (default /image.jpg) and report MB/s of
+//              response body. Run it once with TLS and once with -P
+//              (plain HTTP to a server without -C) to see what encryption
+//              costs; the server's /__stats "tls" block tells whether the
+//              kernel (kTLS + sendfile) or OpenSSL did the work.
+//
+// Build: gcc -O2 -pthread -o tls bench/tls.c -lssl -lcrypto   (or: make tls)
+// Run:   ./tls [-t threads] [-d seconds] [-r 0|1] [-P] <port> handshake|bulk [path]
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define MAX_SAMPLES (1 << 20) // handshake latencies kept per thread
+
+static int port;
+static int bulk;
+static int resume = 1;
+static int plaintext;
+static const char *path;
+static uint64_t deadline_ns;
+static SSL_CTX *ctx;
+
+struct client
+{
+    pthread_t thread;
+    long requests;
+    long resumed;
+    long errors;
+    uint64_t body_bytes;
+    uint32_t *samples; // handshake latency, us
+    long nsamples;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int tcp_connect(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    // The handshake is a few small writes; do not let Nagle hold them
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Reads the whole response; returns the body length, or -1 unless it is a
+// 200
+static long read_response(SSL *ssl, int fd)
+{
+    static _Thread_local char buf[1 << 16];
+    long total = 0, header_len = -1;
+    int status = 0;
+    while (1)
+    {
+        int n = ssl ? SSL_read(ssl, buf, sizeof(buf)) : (int)recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        if (header_len == -1)
+        {
+            // The status line and headers fit in the first read
+            char *end = memmem(buf, n, "\r\n\r\n", 4);
+            if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1 || !end)
+                return -1;
+            header_len = end + 4 - buf;
+        }
+        total += n;
+    }
+    return status == 200 ? total - header_len : -1;
+}
+
+// One connection, one request. The session to offer comes in *session
+// and the one to offer next time goes out there.
+static int one_request(struct client *c, SSL_SESSION **session)
+{
+    char request[512];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n", path);
+
+    uint64_t start = now_ns();
+    int fd = tcp_connect();
+    if (fd == -1)
+        return -1;
+
+    if (plaintext)
+    {
+        long body = send(fd, request, request_len, 0) == request_len ? read_response(NULL, fd) : -1;
+        close(fd);
+        if (body < 0)
+            return -1;
+        c->body_bytes += body;
+        return 0;
+    }
+
+    SSL *ssl = SSL_new(ctx);
+    SSL_set_fd(ssl, fd);
+    if (resume && *session)
+        SSL_set_session(ssl, *session);
+    if (SSL_connect(ssl) != 1)
+    {
+        ERR_clear_error();
+        SSL_free(ssl);
+        close(fd);
+        return -1;
+    }
+    if (c->nsamples < MAX_SAMPLES)
+        c->samples[c->nsamples++] = (now_ns() - start) / 1000;
+    c->resumed += SSL_session_reused(ssl);
+
+    long body = SSL_write(ssl, request, request_len) == request_len ? read_response(ssl, fd) : -1;
+
+    // TLS 1.3 sends the ticket after the handshake; it has arrived by now
+    if (resume)
+    {
+        SSL_SESSION *next = SSL_get1_session(ssl);
+        if (next)
+        {
+            SSL_SESSION_free(*session);
+            *session = next;
+        }
+    }
+    // Without our close_notify, SSL_free() marks the session not resumable
+    SSL_shutdown(ssl);
+    ERR_clear_error();
+    SSL_free(ssl);
+    close(fd);
+    if (body < 0)
+        return -1;
+    c->body_bytes += body;
+    return 0;
+}
+
+static void *client_main(void *arg)
+{
+    struct client *c = arg;
+    SSL_SESSION *session = NULL;
+    while (now_ns() < deadline_ns)
+    {
+        if (one_request(c, &session) == 0)
+            c->requests++;
+        else
+            c->errors++;
+    }
+    SSL_SESSION_free(session);
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+    int seconds = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:r:P")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'r':
+            resume = atoi(optarg);
+            break;
+        case 'P':
+            plaintext = 1;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (argc - optind < 2 || argc - optind > 3 || threads < 1 || threads > MAX_THREADS || seconds < 1 ||
+        (strcmp(argv[optind + 1], "handshake") != 0 && strcmp(argv[optind + 1], "bulk") != 0))
+    {
+        fprintf(stderr, "Usage: %s [-t threads] [-d seconds] [-r 0|1] [-P] <port> handshake|bulk [path]\n", argv[0]);
+        fprintf(stderr, "  -r  offer the previous session for resumption (default 1)\n");
+        fprintf(stderr, "  -P  plain HTTP, for comparison\n");
+        return 1;
+    }
+    port = atoi(argv[optind]);
+    bulk = strcmp(argv[optind + 1], "bulk") == 0;
+    path = argc - optind == 3 ? argv[optind + 2] : bulk ? "/image.jpg" : "/index.html";
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL); // benchmark against a self-signed certificate
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+    struct client clients[MAX_THREADS] = {0};
+    uint64_t start = now_ns();
+    deadline_ns = start + (uint64_t)seconds * 1000000000ULL;
+    for (int i = 0; i < threads; i++)
+    {
+        clients[i].samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+        pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+    }
+
+    struct client total = {0};
+    uint32_t *all = malloc((size_t)threads * MAX_SAMPLES * sizeof(uint32_t));
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        total.requests += clients[i].requests;
+        total.resumed += clients[i].resumed;
+        total.errors += clients[i].errors;
+        total.body_bytes += clients[i].body_bytes;
+        memcpy(all + total.nsamples, clients[i].samples, clients[i].nsamples * sizeof(uint32_t));
+        total.nsamples += clients[i].nsamples;
+        free(clients[i].samples);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%s %s%s: %d threads, %.1f s\n", bulk ? "bulk" : "handshake", path,
+           plaintext ? " (plain HTTP)" : "", threads, elapsed);
+    printf("requests:   %ld (%.0f/s), %ld errors\n", total.requests, total.requests / elapsed, total.errors);
+    if (!plaintext)
+    {
+        printf("handshakes: %ld full, %ld resumed\n", total.requests - total.resumed, total.resumed);
+        if (total.nsamples > 0)
+        {
+            qsort(all, total.nsamples, sizeof(uint32_t), cmp_u32);
+            printf("handshake:  p50 %.3f ms, p99 %.3f ms (connect included)\n", all[total.nsamples / 2] / 1000.0,
+                   all[total.nsamples * 99 / 100] / 1000.0);
+        }
+    }
+    printf("body:       %.1f MB/s\n", total.body_bytes / elapsed / 1e6);
+    free(all);
+    SSL_CTX_free(ctx);
+    return total.requests == 0;
+}
@@ -0,0 +1,241 @@
+// MSG_ZEROCOPY against plain send() for in-memory response bodies, by body
+// size: where does -z pay off?
+//
+// For each size, one connection sends the same body over and over for a
+// few seconds, once with send() (copy into the socket buffer) and once
+// with the server's zerocopy_send(), which pins the pages. After each
+// zerocopy body it reads the completions with zerocopy_drain(), as the
+// server's zerocopy thread does before releasing a cache entry, so both
+// sides of the cost land on the one measured thread. It reports
+// throughput, CPU time of the sending thread per GB, how many zerocopy
+// bodies the kernel copied after all, and how many it did not complete
+// within ZEROCOPY_WAIT_MS.
+//
+// Zerocopy only happens on the way out through a real NIC. Over loopback
+// the kernel copies on delivery, so every body counts as "copied", and the
+// numbers show only what the pinning and notification cost. For the real
+// comparison run a sink on another machine and point the sender at it:
+//
+//   other$ ./zerocopy -S 9000
+//   this$  ./zerocopy -H other -p 9000
+//
+// server.c is compiled in directly (its main() renamed), so the benchmark
+// always runs the current zerocopy_send() and zerocopy_drain().
+//
+// Build: gcc -O2 -pthread -o zerocopy bench/zerocopy.c   (or: make zerocopy)
+// Run:   ./zerocopy [-d seconds] [-H host -p port | -S port] [size_kb ...]
+
+#define main server_main
+#include "../server.c"
+#undef main
+
+#include <sys/time.h>
+
+#define SINK_BUF (1 << 20)
+
+static const long DEFAULT_SIZES_KB[] = {4, 16, 64, 256, 1024, 4096, 16384};
+
+static void *sink_conn(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char *buf = malloc(SINK_BUF);
+    while (recv(fd, buf, SINK_BUF, 0) > 0)
+        ;
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+// Accepts connections and discards what they send, one thread each
+static void *sink_main(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+    while (1)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        pthread_t thread;
+        pthread_create(&thread, NULL, sink_conn, (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+static int sink_listen(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+        perror("sink");
+        exit(1);
+    }
+    return fd;
+}
+
+static int sender_connect(const char *host, int port)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *ai;
+    if (getaddrinfo(host, service, &hints, &ai) != 0)
+        return -1;
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    int yes = 1;
+    if (fd != -1)
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes));
+    return fd;
+}
+
+static double thread_cpu_s(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// One zerocopy body: sends it and waits for its completions. Returns the
+// bytes sent, or -1 if none were or the completions did not arrive in time.
+static long zerocopy_body(int fd, const char *body, long size, long *copied, long *timeouts)
+{
+    uint32_t calls, done = 0;
+    int was_copied = 0;
+    long sent = zerocopy_send(fd, body, size, &calls);
+    uint64_t deadline = now_ns() + ZEROCOPY_WAIT_MS * 1000000ULL;
+    while (done < calls)
+    {
+        // The error queue shows up in poll() as POLLERR
+        struct pollfd pfd = {.fd = fd, .events = 0};
+        uint64_t now = now_ns();
+        if (now >= deadline)
+        {
+            (*timeouts)++;
+            return -1;
+        }
+        poll(&pfd, 1, (deadline - now) / 1000000 + 1);
+        zerocopy_drain(fd, &done, &was_copied);
+    }
+    *copied += was_copied || (calls == 0 && sent > 0);
+    return sent;
+}
+
+// One run: the body sent back to back for `seconds`
+static void run(const char *host, int port, const char *body, long size, int zerocopy, int seconds)
+{
+    int fd = sender_connect(host, port);
+    if (fd == -1)
+    {
+        fprintf(stderr, "cannot connect to %s:%d\n", host, port);
+        exit(1);
+    }
+
+    long bodies = 0, copied = 0, timeouts = 0;
+    double bytes = 0;
+    double cpu0 = thread_cpu_s();
+    uint64_t start = now_ns(), deadline = start + (uint64_t)seconds * 1000000000ULL;
+    while (now_ns() < deadline)
+    {
+        long n = zerocopy ? zerocopy_body(fd, body, size, &copied, &timeouts) : send(fd, body, size, 0);
+        if (n <= 0)
+            break;
+        bytes += n;
+        bodies++;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    double cpu = thread_cpu_s() - cpu0;
+    close(fd);
+
+    printf("%10ld %-9s %10.2f %12.3f", size >> 10, zerocopy ? "zerocopy" : "send", bytes * 8 / elapsed / 1e9,
+           bytes > 0 ? cpu / (bytes / 1e9) : 0.0);
+    if (zerocopy)
+        printf(" %9.0f%% %9ld", bodies ? 100.0 * copied / bodies : 0.0, timeouts);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int seconds = 3;
+    int port = 0;
+    int sink_only = 0;
+    const char *host = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:H:p:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'S':
+            port = atoi(optarg);
+            sink_only = 1;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    if (optind > argc || seconds < 1 || (host && port <= 0) || (sink_only && (host || port <= 0)))
+    {
+        fprintf(stderr, "Usage: %s [-d seconds] [-H host -p port | -S port] [size_kb ...]\n", argv[0]);
+        fprintf(stderr, "  -H/-p  send to a sink on another machine (./zerocopy -S port there)\n");
+        fprintf(stderr, "  -S     only run a sink on this port\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (sink_only)
+    {
+        sink_main((void *)(intptr_t)sink_listen(port));
+        return 0;
+    }
+    if (!host)
+    {
+        // Local sink on an ephemeral loopback port
+        int fd = sink_listen(0);
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        getsockname(fd, (struct sockaddr *)&addr, &len);
+        port = ntohs(addr.sin_port);
+        host = "127.0.0.1";
+        pthread_t thread;
+        pthread_create(&thread, NULL, sink_main, (void *)(intptr_t)fd);
+    }
+
+    int nsizes = argc - optind;
+    long sizes[64];
+    if (nsizes == 0)
+    {
+        nsizes = sizeof(DEFAULT_SIZES_KB) / sizeof(DEFAULT_SIZES_KB[0]);
+        memcpy(sizes, DEFAULT_SIZES_KB, sizeof(DEFAULT_SIZES_KB));
+    }
+    for (int i = 0; i < nsizes && i < 64; i++)
+        sizes[i] = i < argc - optind ? atol(argv[optind + i]) : sizes[i];
+
+    printf("sending to %s:%d, %d s per run\n", host, port, seconds);
+    printf("%10s %-9s %10s %12s %10s %9s\n", "size_kb", "mode", "Gbit/s", "cpu_s/GB", "copied", "timeouts");
+    for (int i = 0; i < nsizes && i < 64; i++)
+    {
+        long size = sizes[i] << 10;
+        char *body = malloc(size);
+        memset(body, 'x', size);
+        run(host, port, body, size, 0, seconds);
+        run(host, port, body, size, 1, seconds);
+        free(body);
+    }
+    return 0;
+}
@@ -3,6 +3,11 @@
 // https://www.reddit.com/r/C_Programming/comments/kbfa6t/building_a_http_server_in_c/
 // https://datatracker.ietf.org/doc/html/rfc1945
 
+#define _GNU_SOURCE
+// Enables Linux extensions in the system headers, such as:
+//   - preadv2(), RWF_NOWAIT, accept4()
+// In this code: probing the page cache without blocking before offloading a read
+
 #include <sys/types.h>
 // Provides basic data types used in system calls, such as:
 //   - pid_t, uid_t, gid_t, ssize_t, off_t, etc.
@@ -14,249 +19,6345 @@
 //   - Structures: struct sockaddr, struct sockaddr_storage
 // In this code: all the main TCP server functionality (creating socket, listening, accepting connections)
 
-#include <netdb.h>
-// Provides network database operations and utilities:
-//   - getaddrinfo(), freeaddrinfo(), gai_strerror()
-//   - struct addrinfo
-// In this code: used to resolve port and address info to bind the server socket (IPv4/IPv6 agnostic)
+#include <netdb.h>
+// Provides network database operations and utilities:
+//   - getaddrinfo(), freeaddrinfo(), gai_strerror()
+//   - struct addrinfo
+// In this code: used to resolve port and address info to bind the server socket (IPv4/IPv6 agnostic)
+
+#include <stdio.h>
+// Provides standard I/O functions:
+//   - printf(), fprintf(), perror(), snprintf(), fopen(), fread(), fclose()
+// In this code: printing logs, errors, building response strings, reading files
+
+#include <string.h>
+// Provides string manipulation functions:
+//   - strlen(), strcmp(), strncmp(), strstr(), strchr(), memset(), memcpy()
+// In this code: parsing HTTP requests, handling paths, cleaning buffers, comparing strings
+
+#include <stdlib.h>
+// Provides general utilities:
+//   - malloc(), free(), exit(), atoi(), system()
+// In this code: dynamic memory allocation for file content, exiting on fatal errors
+
+#include <unistd.h>
+// Provides POSIX API functions:
+//   - close(), read(), write(), getpid(), fork(), sleep()
+// In this code: closing sockets, sending data, interacting with file descriptors
+
+#include <limits.h>
+// Provides system limits constants:
+//   - PATH_MAX, INT_MAX, LONG_MAX, etc.
+// In this code: defining maximum allowed path length for safe file path operations
+
+#include <errno.h>
+// Provides the errno variable and error constants:
+//   - EAGAIN, EWOULDBLOCK, EINTR
+// In this code: telling "no more pending connections" apart from real accept() failures
+
+#include <fcntl.h>
+// Provides file control operations:
+//   - fcntl(), O_NONBLOCK
+//   - readahead()
+// In this code: putting the listening socket in non-blocking mode so the accept queue can be drained,
+// telling a send timeout (SO_SNDTIMEO) apart from a non-blocking socket's EAGAIN,
+// and pulling a large cold file into the page cache on an I/O thread
+
+#include <poll.h>
+// Provides I/O multiplexing:
+//   - poll(), struct pollfd
+// In this code: sleeping until a new connection arrives when there is no queued work
+
+#include <stdint.h>
+// Provides fixed-width integer types:
+//   - uint32_t, uint64_t
+// In this code: nanosecond timestamps for queueing and latency measurements
+
+#include <time.h>
+// Provides clocks and time functions:
+//   - clock_gettime(), CLOCK_MONOTONIC
+// In this code: timestamping accepted connections and measuring request latency
+
+#include <pthread.h>
+// Provides POSIX threads:
+//   - pthread_create(), pthread_mutex_*, pthread_cond_*, pthread_timedjoin_np()
+// In this code: the worker pool and event loop threads, and stopping them
+
+#include <stdatomic.h>
+// Provides C11 atomics:
+//   - _Atomic, atomic_load_explicit(), atomic_compare_exchange_strong_explicit(), atomic_thread_fence()
+// In this code: the Chase-Lev work-stealing deques, the MPMC handoff ring and shared counters
+
+#include <signal.h>
+// Provides signal handling:
+//   - signal(), SIGPIPE, SIG_IGN
+// In this code: ignoring SIGPIPE so a client hanging up mid-send does not kill the server
+
+#include <sched.h>
+// Provides scheduler control:
+//   - sched_yield()
+// In this code: backing off while an I/O thread waits for room to post a completion
+
+#include <stdarg.h>
+// Provides variable argument lists:
+//   - va_list, va_start(), va_end()
+// In this code: the printf-style string builder behind the stats endpoint
+
+#include <netinet/in.h>
+// Provides Internet address structures:
+//   - struct sockaddr_in, struct sockaddr_in6, ntohl(), IN6_IS_ADDR_LOOPBACK()
+// In this code: restricting the stats endpoint to loopback clients
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+// Provides x86 intrinsics:
+//   - __rdtsc()
+// In this code: cheap per-phase timestamps from the time stamp counter
+#endif
+
+#include <sys/resource.h>
+// Provides resource limits:
+//   - getrlimit(), setrlimit(), RLIMIT_NOFILE
+// In this code: raising the open file limit and sizing the connection cap in pool mode
+
+#include <sys/stat.h>
+// Provides file status:
+//   - fstat(), struct stat, S_ISREG()
+// In this code: sizing the body buffer before probing the page cache
+
+#include <sys/uio.h>
+// Provides vectored I/O:
+//   - preadv2(), struct iovec
+// In this code: non-blocking page cache reads (RWF_NOWAIT)
+
+#include <sys/signalfd.h>
+// Provides signal file descriptors:
+//   - signalfd(), struct signalfd_siginfo
+// In this code: handling SIGUSR1 (dump counters) and SIGTERM/SIGINT (stop)
+// inside the event loop or next to the listening socket
+
+#include <sys/eventfd.h>
+// Provides event notification file descriptors:
+//   - eventfd(), EFD_SEMAPHORE
+// In this code: waking exactly one idle worker per request handed to the
+// pool, and every waiting thread once the server is stopping
+
+#include <sys/epoll.h>
+// Provides the Linux epoll API:
+//   - epoll_create1(), epoll_ctl(), epoll_wait(), EPOLLONESHOT, EPOLLET
+// In this code: the event loop that accepts connections and reads requests in pool mode,
+// and the zerocopy thread's wait for MSG_ZEROCOPY completions
+
+#include <sys/syscall.h>
+// Provides raw system call numbers:
+//   - syscall(), SYS_perf_event_open
+// In this code: perf_event_open() has no libc wrapper
+
+#include <linux/perf_event.h>
+// Provides the perf events ABI:
+//   - struct perf_event_attr, PERF_TYPE_HARDWARE, PERF_FORMAT_GROUP
+// In this code: per-thread hardware counter groups around request phases (-c)
+
+#include <sys/sendfile.h>
+// Provides in-kernel file to socket copies:
+//   - sendfile()
+// In this code: sending uncached file bodies straight from the page cache
+
+#include <netinet/tcp.h>
+// Provides TCP-level socket options:
+//   - TCP_NODELAY, TCP_DEFER_ACCEPT, TCP_FASTOPEN, TCP_NOTSENT_LOWAT, TCP_INFO, struct tcp_info
+// In this code: the socket tuning profiles (-T) and per-connection RTT and retransmit stats
+
+#include <linux/errqueue.h>
+// Provides the socket error queue records:
+//   - struct sock_extended_err, SO_EE_ORIGIN_ZEROCOPY, SO_EE_CODE_ZEROCOPY_COPIED
+// In this code: knowing when the kernel is done with a MSG_ZEROCOPY body (-z)
+
+#include <ctype.h>
+#include <strings.h>
+// Provides character classes and case-insensitive comparison:
+//   - isspace(), strncasecmp()
+// In this code: finding the assets an HTML document references (Early Hints)
+
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+// Provides TLS (OpenSSL 3; link with -lssl -lcrypto):
+//   - SSL_CTX_new(), SSL_accept(), SSL_read(), SSL_write(), BIO_get_ktls_send()
+// In this code: HTTPS termination (-C/-K), handing the keys to kernel TLS when possible
+#endif
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+// Provides USDT (SystemTap/DTrace-style) static probes:
+//   - DTRACE_PROBE1() ... DTRACE_PROBE4()
+// In this code: the httpd:* tracepoints (see HTTPD_PROBE* below)
+#endif
+
+// -------------------------------------------
+// USDT probes (provider "httpd")
+// -------------------------------------------
+// Each probe is a single nop plus an ELF note (.note.stapsdt) describing
+// where its arguments live, so bpftrace/perf can attach to a running
+// server with no rebuild and nothing runs when no tracer is attached:
+//
+//   accept(fd)                               new connection
+//   request_parsed(fd, method, path)         request line parsed
+//   file_resolved(url, path, status)         realpath() + root check done
+//   response_start(fd, status, size)         about to send (size = body)
+//   response_done(fd, status, bytes, ns)     finished, ns since accept
+//
+// Uses <sys/sdt.h> when installed. Otherwise, on x86-64 ELF, emits the same
+// note by hand (every argument passed as a signed 64-bit value); elsewhere
+// the probes compile away.
+#if __has_include(<sys/sdt.h>)
+#define HTTPD_PROBE1(name, a) DTRACE_PROBE1(httpd, name, a)
+#define HTTPD_PROBE3(name, a, b, c) DTRACE_PROBE3(httpd, name, a, b, c)
+#define HTTPD_PROBE4(name, a, b, c, d) DTRACE_PROBE4(httpd, name, a, b, c, d)
+#elif defined(__x86_64__) && defined(__ELF__)
+#define HTTPD_PROBE_ARG(x) "nor"((int64_t)(intptr_t)(x))
+#define HTTPD_PROBE_NOTE(name, args, ...)                                   \
+    __asm__ __volatile__(                                                   \
+        "990: nop\n"                                                        \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                       \
+        ".balign 4\n"                                                       \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                  \
+        "991: .asciz \"stapsdt\"\n"                                         \
+        "992: .balign 4\n"                                                  \
+        "993: .8byte 990b\n"                                                \
+        ".8byte _.stapsdt.base\n"                                           \
+        ".8byte 0\n"                                                        \
+        ".asciz \"httpd\"\n"                                                \
+        ".asciz \"" #name "\"\n"                                            \
+        ".asciz \"" args "\"\n"                                             \
+        "994: .balign 4\n"                                                  \
+        ".popsection\n"                                                     \
+        ".ifndef _.stapsdt.base\n"                                          \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n"                                            \
+        ".hidden _.stapsdt.base\n"                                          \
+        "_.stapsdt.base: .space 1\n"                                        \
+        ".size _.stapsdt.base, 1\n"                                         \
+        ".popsection\n"                                                     \
+        ".endif\n"                                                          \
+        : : __VA_ARGS__)
+#define HTTPD_PROBE1(name, a) \
+    HTTPD_PROBE_NOTE(name, "-8@%0", HTTPD_PROBE_ARG(a))
+#define HTTPD_PROBE3(name, a, b, c) \
+    HTTPD_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2", HTTPD_PROBE_ARG(a), HTTPD_PROBE_ARG(b), HTTPD_PROBE_ARG(c))
+#define HTTPD_PROBE4(name, a, b, c, d)                                     \
+    HTTPD_PROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3", HTTPD_PROBE_ARG(a), \
+                     HTTPD_PROBE_ARG(b), HTTPD_PROBE_ARG(c), HTTPD_PROBE_ARG(d))
+#else
+#define HTTPD_PROBE1(name, a) ((void)(a))
+#define HTTPD_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define HTTPD_PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+#define DEFAULT_BACKLOG 128
+#define MAXDATASIZE 4096
+
+// Bounded user-space accept queue (connections waiting to be served)
+#define ACCEPT_QUEUE_MAX 1024
+
+// CoDel: shed from the queue head once the queueing delay stays above
+// TARGET for at least one INTERVAL (values from the CoDel paper)
+#define CODEL_TARGET_NS (5ULL * 1000000ULL)
+#define CODEL_INTERVAL_NS (100ULL * 1000000ULL)
+
+// Worker pool (-w): per-worker Chase-Lev deque size (power of two), size of
+// the shared handoff ring (power of two, >= ACCEPT_QUEUE_MAX), how many
+// ring entries a worker moves into its deque at once, and the most worker,
+// event loop (-a) and I/O (-i) threads we start
+#define WS_DEQUE_SIZE 1024
+#define MPMC_RING_SIZE 1024
+#define RING_BATCH 16
+#define MAX_WORKERS 64
+#define MAX_EVENT_LOOPS 16
+#define MAX_IO_THREADS 64
+#define PROBE_MAX_BYTES (1024 * 1024) // page cache probe (-i): larger files are not read into memory
+#define PROBE_PREFIX 4096             // bytes of a larger file the probe checks are resident
+#define SHUTDOWN_DRAIN_MS 5000 // on SIGTERM/SIGINT, how long requests already taken get to finish
+#define SEND_TIMEOUT_MS 10000  // a client that takes no response bytes for this long is reset
+
+_Static_assert(MPMC_RING_SIZE >= ACCEPT_QUEUE_MAX, "the limiter (-q) must fit under the in-flight cap");
+
+// AIMD concurrency limiter: latency (queueing + service) we aim to stay under
+#define LIMITER_TARGET_NS (50ULL * 1000000ULL)
+#define LIMITER_MIN 1.0
+#define LIMITER_BACKOFF 0.9
+
+// Metrics: threads that may record (main + event loops + workers + I/O +
+// HTTP/2 + the log, capture, cache and zerocopy threads), and the latency
+// histogram shape (see struct histogram)
+#define MAX_METRICS_THREADS (5 + MAX_EVENT_LOOPS + MAX_WORKERS + MAX_IO_THREADS + H2_MAX_CONNECTIONS)
+#define HIST_SUB_BITS 5
+#define HIST_MAX_EXP 36 // values are clamped below 2^36 ns (~69 s)
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+// Phase tracing (-t): sampled requests kept per thread for /__trace
+#define TRACE_RING_SIZE 256
+
+// Hot paths: Count-Min sketch shape, top-K table size, how often counts are
+// halved (in requests), how often the sorted table is republished, how many
+// published copies readers can hold, and how often the table is saved to -k
+#define CM_DEPTH 4
+#define CM_WIDTH 4096
+#define HOT_K 32
+#define HOT_DECAY_EVERY (1 << 18)
+#define HOT_PUBLISH_NS (10ULL * 1000000ULL)
+#define HOT_SNAPSHOTS 4
+#define HOT_SAVE_INTERVAL_NS (10ULL * 1000000000ULL)
+
+// Content cache (-m): hash buckets, how often a cached file is stat()ed to
+// catch edits, and how many fills and re-checks may wait for the cache thread
+#define CACHE_BUCKETS 256
+#define CACHE_REVALIDATE_NS (1000ULL * 1000000ULL)
+#define CACHE_QUEUE 64
+#define MAX_CACHE_MB (1L << 20)    // -m limit (1 TiB)
+#define MAX_ZEROCOPY_KB (1L << 30) // -z limit (1 TiB)
+#define ZEROCOPY_MIN_KB 256      // -z floor: below it pinning and completions cost more than a copy
+#define ZEROCOPY_WAIT_MS 5000    // a peer that has not taken a zerocopy body by then is reset
+#define SNDBUF_TARGET_MBPS 10000 // link rate the bulk profile sizes send buffers for (-T bulk)
+#define EARLY_HINTS_MAX 8      // preload links kept per cached HTML document
+#define EARLY_HINTS_LINKS 512  // room for their Link header value
+
+// TLS (-C/-K)
+#define TLS_SESSION_CACHE_SIZE 20000 // server-side sessions kept for resumption
+#define TLS_CHUNK 16384              // one full TLS record per SSL_write() of a file body
+
+// HTTP/2 and HPACK
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_MAX_STREAMS 100        // SETTINGS_MAX_CONCURRENT_STREAMS we announce
+#define H2_FRAME_MAX 16384        // largest frame either side sends (the protocol default)
+#define H2_HEADER_BLOCK_MAX 16384 // HEADERS + CONTINUATION payload of one request
+#define H2_OUT_BUF 16384          // control frames and response headers, batched
+#define H2_WINDOW_DEFAULT 65535
+#define H2_IDLE_TIMEOUT_MS 5000      // closed after this long without a request or body data
+#define H2_MAX_LIFETIME_MS 300000    // then GOAWAY: open streams finish, new ones are refused
+#define H2_MAX_CONNECTIONS 64        // served at once, each on an HTTP/2 thread of its own
+#define HPACK_TABLE_SIZE 4096   // dynamic table limit in both directions (the default)
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+#define HPACK_HUFFMAN_MAX_BITS 30
+
+// Access log (-l): per-thread ring size in records (power of two), stored
+// path bytes per record, writer buffer size and idle flush interval
+#define ACCESS_LOG_MAGIC "HTTPLOG1"
+#define ACCESS_LOG_RING_SIZE 4096
+#define ACCESS_LOG_PATH_MAX 92
+#define ACCESS_LOG_WRITE_BUF (1 << 20)
+#define ACCESS_LOG_FLUSH_NS (10 * 1000000L)
+
+// Traffic capture (-r)
+#define CAPTURE_MAGIC "HTTPCAP1"
+#define CAPTURE_RING_SIZE 256 // slots per thread; each holds one recv() of up to MAXDATASIZE bytes
+
+// Prebuilt overload response: sent as-is, no formatting on the shedding path
+static const char RESPONSE_503[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 33\r\n"
+    "Retry-After: 1\r\n"
+    "\r\n"
+    "{\"error\": \"Server is overloaded\"}";
+
+// -------------------------------------------
+// Helper: Monotonic clock in nanoseconds
+// -------------------------------------------
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// -------------------------------------------
+// Helper: Stop signal shared by every thread
+// -------------------------------------------
+// SIGTERM/SIGINT set `stopping` and leave shutdown_fd readable for good, so
+// a thread blocked in poll() or epoll_wait() on it wakes up and winds down.
+static _Atomic int stopping;
+static int shutdown_fd = -1; // eventfd, created by main()
+
+void shutdown_request(void)
+{
+    printf("👋 Shutting down\n");
+    atomic_store(&stopping, 1);
+    uint64_t one = 1;
+    if (write(shutdown_fd, &one, sizeof(one)) == -1)
+        perror("eventfd write");
+}
+
+// -------------------------------------------
+// Helper: Bump a counter that only one thread writes
+// -------------------------------------------
+// A relaxed load + store instead of an atomic add: no locked instruction on
+// the hot path, while readers on other threads still see whole values.
+void counter_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+uint64_t counter_read(const _Atomic uint64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// -------------------------------------------
+// Allocation tracking (-DALLOC_TRACKING, make server-alloc)
+// -------------------------------------------
+// Interposes the allocator so that every allocation made while a thread
+// works on a request is charged to that request, libc's own included
+// (fopen, realpath, stdio buffers). The count travels with the request
+// (phase_times.allocs) across the threads that serve it; each thread points
+// alloc_sink at the request it is working on, and record_request() clears
+// it. /__stats reports the totals; tools/alloc_check.c turns them into
+// per-request budgets. Release builds compile all of this away.
+#ifdef ALLOC_TRACKING
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static _Thread_local uint32_t *alloc_sink;
+
+void *malloc(size_t size)
+{
+    if (alloc_sink)
+        (*alloc_sink)++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (alloc_sink)
+        (*alloc_sink)++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (alloc_sink)
+        (*alloc_sink)++;
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alloc_sink)
+        (*alloc_sink)++;
+    return __libc_memalign(alignment, size);
+}
+
+#define ALLOC_SINK(counter) (alloc_sink = (counter))
+#else
+#define ALLOC_SINK(counter) ((void)(counter))
+#endif
+
+// -------------------------------------------
+// Phase timing: cheap timestamps for each stage of a request
+// -------------------------------------------
+// Stages are stamped with the TSC (a few ns, no syscall) on x86 and with
+// the monotonic clock elsewhere; ticks_init() calibrates ticks to ns once
+// at startup. A phase that did not run keeps begin == 0.
+enum phase
+{
+    PHASE_RECV,    // reading the request (from accept in pool mode)
+    PHASE_PARSE,   // request line parsing
+    PHASE_QUEUE,   // waiting for a worker (pool mode)
+    PHASE_RESOLVE, // realpath() and root checks
+    PHASE_READ,    // getting the file into memory (incl. I/O thread handoff)
+    PHASE_SEND,    // writing headers and body
+    PHASES
+};
+
+static const char *PHASE_NAMES[PHASES] = {"recv", "parse", "queue", "resolve", "read", "send"};
+
+// Hardware counters (-c) read around the CPU-bound phases
+enum perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
+
+static const char *PERF_COUNTER_NAMES[PERF_COUNTERS] = {"cycles", "instructions", "cache_misses",
+                                                        "branch_misses"};
+static const uint64_t PERF_COUNTER_CONFIGS[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES};
+#define PERF_PHASE_MASK ((1u << PHASE_PARSE) | (1u << PHASE_RESOLVE) | (1u << PHASE_SEND))
+
+struct phase_times
+{
+    uint64_t begin[PHASES]; // ticks
+    uint64_t end[PHASES];
+    uint16_t thread[PHASES]; // metrics slot of the thread that ran the phase
+    uint32_t allocs;         // heap allocations made for the request (ALLOC_TRACKING builds)
+    uint64_t headers_ns;     // now_ns() once the response headers were written, 0 before
+};
+
+static double ns_per_tick = 1.0;
+static uint64_t ticks_epoch; // ticks at startup, origin for trace timestamps
+
+uint64_t ticks_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+void ticks_init(void)
+{
+    uint64_t ns0 = now_ns(), t0 = ticks_now();
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000000L};
+    nanosleep(&pause, NULL);
+    uint64_t ns1 = now_ns(), t1 = ticks_now();
+
+    if (t1 > t0)
+        ns_per_tick = (double)(ns1 - ns0) / (double)(t1 - t0);
+    ticks_epoch = t1;
+}
+
+uint64_t ticks_to_ns(uint64_t ticks)
+{
+    return (uint64_t)(ticks * ns_per_tick);
+}
+
+// -------------------------------------------
+// Metrics: per-thread counters and latency histograms
+// -------------------------------------------
+// Every thread that serves requests owns one cache-line-aligned slot and is
+// its only writer, so recording is a few relaxed loads and stores: no lock,
+// no locked instruction, no syscall. Readers merge all slots on demand.
+//
+// Latency goes into an HDR-style log-linear histogram: values below
+// 2^HIST_SUB_BITS ns get a bucket each, and every power of two above that is
+// split into 2^HIST_SUB_BITS linear sub-buckets (~3% relative error).
+enum status_slot
+{
+    SLOT_200,
+    SLOT_400,
+    SLOT_403,
+    SLOT_404,
+    SLOT_500,
+    SLOT_501,
+    SLOT_503,
+    SLOT_OTHER,
+    STATUS_SLOTS
+};
+
+static const char *STATUS_LABELS[STATUS_SLOTS] = {"200", "400", "403", "404", "500", "501", "503", "other"};
+
+struct histogram
+{
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+};
+
+struct metrics
+{
+    _Atomic uint64_t requests[STATUS_SLOTS];
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t conns_opened;
+    _Atomic uint64_t conns_closed;
+    _Atomic uint64_t pagecache_inline;    // page cache probe had the whole file
+    _Atomic uint64_t pagecache_offloaded; // rest of the file read by an I/O thread
+    _Atomic uint64_t log_dropped;         // access log records lost to a full ring
+    _Atomic uint64_t log_written;         // access log records written (writer thread)
+    _Atomic uint64_t capture_dropped;     // captured chunks lost to a full ring (-r)
+    _Atomic uint64_t capture_written;     // captured chunks written (writer thread)
+    _Atomic uint64_t cache_hits;          // served from the content cache (-m)
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t cache_prefetched;    // assets loaded because a document preloads them (-p)
+    _Atomic uint64_t early_hints;         // 103 Early Hints sent (-e)
+    _Atomic uint64_t alloc_requests;      // requests whose allocations were counted (ALLOC_TRACKING)
+    _Atomic uint64_t allocs;              // heap allocations those requests made
+    _Atomic uint64_t tls_handshakes;      // completed, full or resumed (-C/-K)
+    _Atomic uint64_t tls_resumed;         // of those, resumed from a session ticket or the cache
+    _Atomic uint64_t tls_failed;          // handshakes that failed
+    _Atomic uint64_t tls_ktls_send;       // connections whose sends the kernel encrypts
+    _Atomic uint64_t tls_ktls_recv;       // connections whose receives the kernel decrypts
+    _Atomic uint64_t h2_connections;      // connections that spoke HTTP/2
+    _Atomic uint64_t h2_refused;          // of those, ones turned away: every HTTP/2 thread busy
+    _Atomic uint64_t h2_streams;          // requests answered on them
+    _Atomic uint64_t h2_streams_refused;  // streams the concurrency limiter refused
+    _Atomic uint64_t tcp_sampled;         // connections whose TCP_INFO was read at close (-T)
+    _Atomic uint64_t tcp_retrans;         // segments they retransmitted
+    _Atomic uint64_t tcp_retrans_conns;   // of those connections, ones that retransmitted at all
+    _Atomic uint64_t tcp_sndbuf_raised;   // large responses that got a bigger send buffer (-T bulk)
+    _Atomic uint64_t zerocopy_sends;      // MSG_ZEROCOPY bodies (-z) the kernel sent without copying
+    _Atomic uint64_t zerocopy_copied;     // MSG_ZEROCOPY bodies the kernel copied after all
+    _Atomic uint64_t zerocopy_timeouts;   // MSG_ZEROCOPY bodies whose connection was reset first
+    _Atomic uint64_t send_timeouts;       // connections reset after SEND_TIMEOUT_MS without progress
+    struct histogram latency;             // accept to response sent
+    struct histogram tcp_rtt;             // smoothed RTT of each sampled connection at close
+    struct histogram phases[PHASES];      // time spent in each phase
+    _Atomic uint64_t perf[PHASES][PERF_COUNTERS]; // counter deltas summed per phase (-c)
+    _Atomic uint64_t perf_samples[PHASES];        // phases those sums cover
+} __attribute__((aligned(64)));
+
+static struct metrics metrics_slots[MAX_METRICS_THREADS];
+static _Atomic int metrics_count;
+static _Thread_local struct metrics *thread_metrics;
+
+// This thread's slot, claimed on first use
+struct metrics *metrics_self(void)
+{
+    if (!thread_metrics)
+    {
+        int slot = atomic_fetch_add(&metrics_count, 1);
+        if (slot >= MAX_METRICS_THREADS)
+        {
+            fprintf(stderr, "Too many threads recording metrics\n");
+            exit(1);
+        }
+        thread_metrics = &metrics_slots[slot];
+    }
+    return thread_metrics;
+}
+
+int status_slot(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return SLOT_200;
+    case 400:
+        return SLOT_400;
+    case 403:
+        return SLOT_403;
+    case 404:
+        return SLOT_404;
+    case 500:
+        return SLOT_500;
+    case 501:
+        return SLOT_501;
+    case 503:
+        return SLOT_503;
+    default:
+        return SLOT_OTHER;
+    }
+}
+
+int histogram_bucket(uint64_t value)
+{
+    if (value >= (1ULL << HIST_MAX_EXP))
+        value = (1ULL << HIST_MAX_EXP) - 1;
+    if (value < (1ULL << HIST_SUB_BITS))
+        return (int)value;
+
+    int exp = 63 - __builtin_clzll(value);
+    int sub = (int)(value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Largest value that lands in a bucket
+uint64_t histogram_bucket_upper(int bucket)
+{
+    int block = bucket >> HIST_SUB_BITS;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    if (block == 0)
+        return sub;
+    return (((1ULL << HIST_SUB_BITS) + sub + 1) << (block - 1)) - 1;
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+    counter_add(&h->buckets[histogram_bucket(value)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum, value);
+    if (value > counter_read(&h->max))
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+void metrics_conn_opened(void)
+{
+    counter_add(&metrics_self()->conns_opened, 1);
+}
+
+void metrics_conn_closed(void)
+{
+    counter_add(&metrics_self()->conns_closed, 1);
+}
+
+// One finished request: status, bytes written, latency since accept (0 = not timed)
+void metrics_record_request(int status, long bytes, uint64_t latency_ns)
+{
+    struct metrics *m = metrics_self();
+    counter_add(&m->requests[status_slot(status)], 1);
+    if (bytes > 0)
+        counter_add(&m->bytes_sent, bytes);
+    if (latency_ns)
+        histogram_record(&m->latency, latency_ns);
+}
+
+void histogram_merge(struct histogram *out, const struct histogram *h)
+{
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        counter_add(&out->buckets[b], counter_read(&h->buckets[b]));
+    counter_add(&out->count, counter_read(&h->count));
+    counter_add(&out->sum, counter_read(&h->sum));
+    if (counter_read(&h->max) > counter_read(&out->max))
+        atomic_store_explicit(&out->max, counter_read(&h->max), memory_order_relaxed);
+}
+
+// Sum every thread's slot into out (a private struct, not a registered slot)
+void metrics_merge(struct metrics *out)
+{
+    memset(out, 0, sizeof(*out));
+    int n = atomic_load(&metrics_count);
+    if (n > MAX_METRICS_THREADS)
+        n = MAX_METRICS_THREADS;
+
+    for (int i = 0; i < n; i++)
+    {
+        struct metrics *m = &metrics_slots[i];
+        for (int s = 0; s < STATUS_SLOTS; s++)
+            counter_add(&out->requests[s], counter_read(&m->requests[s]));
+        counter_add(&out->bytes_sent, counter_read(&m->bytes_sent));
+        counter_add(&out->conns_opened, counter_read(&m->conns_opened));
+        counter_add(&out->conns_closed, counter_read(&m->conns_closed));
+        counter_add(&out->pagecache_inline, counter_read(&m->pagecache_inline));
+        counter_add(&out->pagecache_offloaded, counter_read(&m->pagecache_offloaded));
+        counter_add(&out->log_dropped, counter_read(&m->log_dropped));
+        counter_add(&out->log_written, counter_read(&m->log_written));
+        counter_add(&out->capture_dropped, counter_read(&m->capture_dropped));
+        counter_add(&out->capture_written, counter_read(&m->capture_written));
+        counter_add(&out->alloc_requests, counter_read(&m->alloc_requests));
+        counter_add(&out->allocs, counter_read(&m->allocs));
+        counter_add(&out->tls_handshakes, counter_read(&m->tls_handshakes));
+        counter_add(&out->tls_resumed, counter_read(&m->tls_resumed));
+        counter_add(&out->tls_failed, counter_read(&m->tls_failed));
+        counter_add(&out->tls_ktls_send, counter_read(&m->tls_ktls_send));
+        counter_add(&out->tls_ktls_recv, counter_read(&m->tls_ktls_recv));
+        counter_add(&out->h2_connections, counter_read(&m->h2_connections));
+        counter_add(&out->h2_refused, counter_read(&m->h2_refused));
+        counter_add(&out->h2_streams, counter_read(&m->h2_streams));
+        counter_add(&out->h2_streams_refused, counter_read(&m->h2_streams_refused));
+        counter_add(&out->tcp_sampled, counter_read(&m->tcp_sampled));
+        counter_add(&out->tcp_retrans, counter_read(&m->tcp_retrans));
+        counter_add(&out->tcp_retrans_conns, counter_read(&m->tcp_retrans_conns));
+        counter_add(&out->tcp_sndbuf_raised, counter_read(&m->tcp_sndbuf_raised));
+        counter_add(&out->zerocopy_sends, counter_read(&m->zerocopy_sends));
+        counter_add(&out->zerocopy_copied, counter_read(&m->zerocopy_copied));
+        counter_add(&out->zerocopy_timeouts, counter_read(&m->zerocopy_timeouts));
+        counter_add(&out->send_timeouts, counter_read(&m->send_timeouts));
+        counter_add(&out->cache_hits, counter_read(&m->cache_hits));
+        counter_add(&out->cache_misses, counter_read(&m->cache_misses));
+        counter_add(&out->cache_prefetched, counter_read(&m->cache_prefetched));
+        counter_add(&out->early_hints, counter_read(&m->early_hints));
+        histogram_merge(&out->latency, &m->latency);
+        histogram_merge(&out->tcp_rtt, &m->tcp_rtt);
+        for (int p = 0; p < PHASES; p++)
+        {
+            histogram_merge(&out->phases[p], &m->phases[p]);
+            for (int e = 0; e < PERF_COUNTERS; e++)
+                counter_add(&out->perf[p][e], counter_read(&m->perf[p][e]));
+            counter_add(&out->perf_samples[p], counter_read(&m->perf_samples[p]));
+        }
+    }
+}
+
+// Value at quantile q (0..1) of a merged histogram, as a bucket upper bound
+uint64_t histogram_quantile(const struct histogram *h, double q)
+{
+    uint64_t count = counter_read(&h->count);
+    if (count == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * count);
+    if (rank >= count)
+        rank = count - 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += counter_read(&h->buckets[b]);
+        if (seen > rank)
+        {
+            uint64_t upper = histogram_bucket_upper(b);
+            uint64_t max = counter_read(&h->max);
+            return upper < max ? upper : max;
+        }
+    }
+    return counter_read(&h->max);
+}
+
+// -------------------------------------------
+// Socket tuning profiles (-T)
+// -------------------------------------------
+// Options set once on the listening socket; accepted sockets inherit them,
+// so they cost no syscalls per connection. Without -T every socket keeps
+// the kernel defaults and nothing is sampled.
+//
+//   web   many small responses: no Nagle delay, accept() only once the
+//         request has arrived, Fast Open so a returning client's request
+//         rides in its SYN, and little unsent data queued in the kernel
+//         so what is queued goes out fresh
+//   bulk  large downloads: no Nagle delay, and before a large body the
+//         send buffer is sized from the connection's RTT
+//
+// With either profile, TCP_INFO is read as each connection closes, for
+// its RTT and retransmits (one getsockopt() per connection).
+struct socket_profile
+{
+    const char *name;
+    int nodelay;       // TCP_NODELAY
+    int defer_accept;  // TCP_DEFER_ACCEPT, seconds to wait for the request; 0 = unset
+    int fastopen;      // TCP_FASTOPEN queue length; 0 = unset
+    int notsent_lowat; // TCP_NOTSENT_LOWAT, bytes; 0 = unset
+    long sndbuf_min;   // bodies at least this large get a send buffer sized from TCP_INFO; 0 = never
+};
+
+static const struct socket_profile SOCKET_PROFILES[] = {
+    {"web", 1, 1, 256, 16384, 0},
+    {"bulk", 1, 0, 0, 0, 1 << 20},
+};
+
+static const struct socket_profile *socket_profile; // NULL: kernel defaults (no -T)
+static long tcp_wmem_max;  // largest send buffer autotuning grows to (net.ipv4.tcp_wmem)
+static long sndbuf_limit;  // largest SO_SNDBUF the kernel accepts (net.core.wmem_max)
+
+const struct socket_profile *socket_profile_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(SOCKET_PROFILES) / sizeof(SOCKET_PROFILES[0]); i++)
+    {
+        if (strcmp(SOCKET_PROFILES[i].name, name) == 0)
+            return &SOCKET_PROFILES[i];
+    }
+    return NULL;
+}
+
+// Applies the profile to the listening socket, before listen() so Fast
+// Open takes effect. Failures are reported but not fatal: the server still
+// works with the kernel's defaults.
+void socket_profile_listen(int sockfd)
+{
+    const struct socket_profile *sp = socket_profile;
+    if (!sp)
+        return;
+    if (sp->nodelay && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &sp->nodelay, sizeof(int)) == -1)
+        perror("setsockopt TCP_NODELAY");
+    if (sp->defer_accept &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &sp->defer_accept, sizeof(int)) == -1)
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    if (sp->fastopen && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &sp->fastopen, sizeof(int)) == -1)
+        perror("setsockopt TCP_FASTOPEN");
+    if (sp->notsent_lowat &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &sp->notsent_lowat, sizeof(int)) == -1)
+        perror("setsockopt TCP_NOTSENT_LOWAT");
+
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_wmem", "r");
+    if (f)
+    {
+        if (fscanf(f, "%*d %*d %ld", &tcp_wmem_max) != 1)
+            tcp_wmem_max = 0;
+        fclose(f);
+    }
+    f = fopen("/proc/sys/net/core/wmem_max", "r");
+    if (f)
+    {
+        if (fscanf(f, "%ld", &sndbuf_limit) != 1)
+            sndbuf_limit = 0;
+        fclose(f);
+    }
+}
+
+// Before a large body (bulk profile): the send buffer has to hold about
+// one bandwidth-delay product for the connection to reach the link rate.
+// That is estimated as the handshake RTT times SNDBUF_TARGET_MBPS, or twice
+// the current congestion window if that is more, and never more than the
+// body. Setting SO_SNDBUF switches the kernel's autotuning off for the
+// socket, so it is only done when autotuning could not get there
+// (net.ipv4.tcp_wmem) and SO_SNDBUF can (net.core.wmem_max).
+void socket_tune_send(int fd, long size)
+{
+    if (!socket_profile || !socket_profile->sndbuf_min || size < socket_profile->sndbuf_min)
+        return;
+
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+        return;
+    long want = (long)ti.tcpi_rtt * (SNDBUF_TARGET_MBPS / 8);
+    long cwnd_bytes = 2L * ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+    if (want < cwnd_bytes)
+        want = cwnd_bytes;
+    if (want > size)
+        want = size;
+    if (want > sndbuf_limit)
+        want = sndbuf_limit;
+    if (want <= tcp_wmem_max)
+        return;
+
+    // The kernel doubles the value for its bookkeeping overhead
+    int value = want;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value)) == 0)
+        counter_add(&metrics_self()->tcp_sndbuf_raised, 1);
+}
+
+// As a connection closes: its smoothed RTT and retransmitted segments
+void socket_sample(int fd)
+{
+    if (!socket_profile)
+        return;
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+        return;
+    struct metrics *m = metrics_self();
+    counter_add(&m->tcp_sampled, 1);
+    counter_add(&m->tcp_retrans, ti.tcpi_total_retrans);
+    counter_add(&m->tcp_retrans_conns, ti.tcpi_total_retrans > 0);
+    histogram_record(&m->tcp_rtt, (uint64_t)ti.tcpi_rtt * 1000);
+}
+
+// -------------------------------------------
+// TLS termination (-C cert -K key; builds with -DWITH_TLS)
+// -------------------------------------------
+// One SSL_CTX serves every connection: TLS 1.2 and up, a server-side
+// session cache plus TLS 1.3 session tickets, so returning clients resume
+// without a full handshake. SSL_OP_ENABLE_KTLS makes OpenSSL hand the
+// symmetric keys to the kernel once the handshake is done. When that works
+// (kernel with CONFIG_TLS, a cipher it supports), the socket takes and
+// gives plaintext again: recv(), send() and sendfile() work as for HTTP
+// and the kernel does the crypto. Otherwise records go through SSL_read()
+// and SSL_write().
+//
+// Sessions are found by fd, so the helpers that only get an fd
+// (send_response(), send_error(), ...) work unchanged; io_recv(),
+// io_send() and io_sendfile() below pick the path.
+int tls_enabled; // set by tls_init()
+
+#ifdef WITH_TLS
+struct tls_conn
+{
+    SSL *ssl; // NULL: no TLS session on this fd
+    int ktls_send;
+    int ktls_recv;
+};
+
+static SSL_CTX *tls_ctx;
+static struct tls_conn *tls_conns; // indexed by fd
+static int tls_conns_size;
+
+struct tls_conn *tls_conn_of(int fd)
+{
+    if (!tls_ctx || fd < 0 || fd >= tls_conns_size || !tls_conns[fd].ssl)
+        return NULL;
+    return &tls_conns[fd];
+}
+
+// ALPN: h2 when the client offers it, else HTTP/1.1
+int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in,
+                    unsigned int in_len, void *arg)
+{
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, out_len, protocols, sizeof(protocols) - 1, in, in_len) !=
+        OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+void tls_init(const char *cert_file, const char *key_file)
+{
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx || SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        fprintf(stderr, "TLS: cannot load %s / %s\n", cert_file, key_file);
+        exit(1);
+    }
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(tls_ctx, (const unsigned char *)"httpd", 5);
+    SSL_CTX_set_num_tickets(tls_ctx, 1); // a client resumes with the latest ticket; one is enough
+    SSL_CTX_set_alpn_select_cb(tls_ctx, tls_alpn_select, NULL);
+
+    // Any fd the process can open may carry a session
+    struct rlimit rl;
+    rlim_t limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 ? rl.rlim_max : 1024;
+    if (limit > (1 << 20))
+        limit = 1 << 20;
+    tls_conns_size = limit;
+    tls_conns = calloc(limit, sizeof(struct tls_conn));
+    if (!tls_conns)
+    {
+        perror("tls_init");
+        exit(1);
+    }
+    tls_enabled = 1;
+    printf("🔒 TLS enabled (%s)\n", cert_file);
+}
+
+// One step of the server side of the handshake. Returns 1 when it is done,
+// 0 when it has to wait for the socket to become readable (*want_write = 0)
+// or writable (*want_write = 1), and -1 when it failed. A blocking socket
+// never gets 0.
+int tls_handshake(int fd, int *want_write)
+{
+    if (fd >= tls_conns_size)
+        return -1;
+    struct tls_conn *t = &tls_conns[fd];
+    if (!t->ssl)
+    {
+        t->ssl = SSL_new(tls_ctx);
+        if (!t->ssl || SSL_set_fd(t->ssl, fd) != 1)
+            return -1;
+    }
+
+    int r = SSL_accept(t->ssl);
+    if (r != 1)
+    {
+        int err = SSL_get_error(t->ssl, r);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        {
+            *want_write = err == SSL_ERROR_WANT_WRITE;
+            return 0;
+        }
+        ERR_clear_error();
+        counter_add(&metrics_self()->tls_failed, 1);
+        return -1;
+    }
+
+    struct metrics *m = metrics_self();
+    counter_add(&m->tls_handshakes, 1);
+    if (SSL_session_reused(t->ssl))
+        counter_add(&m->tls_resumed, 1);
+    t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    t->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+    counter_add(&m->tls_ktls_send, t->ktls_send);
+    counter_add(&m->tls_ktls_recv, t->ktls_recv);
+    return 1;
+}
+#endif
+
+// Whether HTTP can be spoken on fd yet: always for plaintext, only after
+// the handshake with TLS
+int tls_ready(int fd)
+{
+#ifdef WITH_TLS
+    if (tls_enabled)
+    {
+        struct tls_conn *t = tls_conn_of(fd);
+        return t && SSL_is_init_finished(t->ssl);
+    }
+#endif
+    (void)fd;
+    return 1;
+}
+
+// -------------------------------------------
+// Helper: Socket I/O, through TLS when the connection has it
+// -------------------------------------------
+// Responses are written with blocking calls. Client sockets inherit
+// SO_SNDTIMEO (SEND_TIMEOUT_MS) from the listener, so a write to a client
+// that stopped reading gives up instead of holding its thread forever. A
+// write that made progress is simply continued; one that timed out with
+// nothing taken resets the connection (send_stalled()).
+
+// Called when a write failed with EAGAIN. On a blocking socket that means
+// SO_SNDTIMEO ran out: disconnecting (connect() to AF_UNSPEC) resets the
+// connection and frees what is still queued. Returns 1 if it did.
+int send_stalled(int fd)
+{
+    if (fcntl(fd, F_GETFL, 0) & O_NONBLOCK)
+        return 0;
+    struct sockaddr sa = {.sa_family = AF_UNSPEC};
+    connect(fd, &sa, sizeof(sa));
+    counter_add(&metrics_self()->send_timeouts, 1);
+    return 1;
+}
+
+ssize_t io_recv(int fd, void *buf, size_t len, int flags)
+{
+#ifdef WITH_TLS
+    struct tls_conn *t = tls_conn_of(fd);
+    if (t && !t->ktls_recv)
+    {
+        // Records OpenSSL has already read are invisible to epoll: take
+        // them all now. Only the first read may block (serial mode).
+        size_t total = 0;
+        while (total < len && (total == 0 || SSL_has_pending(t->ssl)))
+        {
+            int n = SSL_read(t->ssl, (char *)buf + total, len - total);
+            if (n > 0)
+            {
+                total += n;
+                continue;
+            }
+            int err = SSL_get_error(t->ssl, n);
+            ERR_clear_error();
+            if (total > 0)
+                break;
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            if (err == SSL_ERROR_ZERO_RETURN)
+                return 0;
+            errno = ECONNRESET;
+            return -1;
+        }
+        return total;
+    }
+#endif
+    return recv(fd, buf, len, flags);
+}
+
+ssize_t io_send(int fd, const void *buf, size_t len, int flags)
+{
+#ifdef WITH_TLS
+    struct tls_conn *t = tls_conn_of(fd);
+    if (t && !t->ktls_send)
+    {
+        size_t written;
+        if (SSL_write_ex(t->ssl, buf, len, &written) == 1)
+            return written;
+        if (SSL_get_error(t->ssl, 0) == SSL_ERROR_WANT_WRITE)
+            send_stalled(fd);
+        ERR_clear_error();
+        errno = EPIPE;
+        return -1;
+    }
+#endif
+    if (flags & MSG_DONTWAIT)
+        return send(fd, buf, len, flags);
+
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, (const char *)buf + sent, len - sent, flags);
+        if (n > 0)
+            sent += n;
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else
+        {
+            if (n == -1 && errno == EAGAIN)
+                send_stalled(fd);
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+    }
+    return sent;
+}
+
+// Sends `size` bytes of file_fd from `offset`; returns the bytes sent.
+// Plaintext and kTLS connections use sendfile(), so the body goes from the
+// page cache to the socket without a copy through user space. User-space
+// TLS has to encrypt, so it reads and writes one record at a time.
+long io_sendfile(int fd, int file_fd, off_t offset, long size)
+{
+#ifdef WITH_TLS
+    struct tls_conn *t = tls_conn_of(fd);
+    if (t && !t->ktls_send)
+    {
+        char chunk[TLS_CHUNK];
+        long total = 0;
+        while (total < size)
+        {
+            ssize_t n = pread(file_fd, chunk, size - total < TLS_CHUNK ? size - total : TLS_CHUNK, offset + total);
+            if (n <= 0 || io_send(fd, chunk, n, 0) != n)
+                break;
+            total += n;
+        }
+        return total;
+    }
+#endif
+    off_t end = offset + size;
+    while (offset < end)
+    {
+        ssize_t n = sendfile(fd, file_fd, &offset, end - offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            send_stalled(fd);
+        if (n <= 0)
+            break;
+    }
+    return size - (end - offset);
+}
+
+// Gathers iov into one writev(); user-space TLS writes a record per piece
+ssize_t io_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+#ifdef WITH_TLS
+    struct tls_conn *t = tls_conn_of(fd);
+    if (t && !t->ktls_send)
+    {
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            if (iov[i].iov_len == 0)
+                continue;
+            if (io_send(fd, iov[i].iov_base, iov[i].iov_len, 0) == -1)
+                return -1;
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+#endif
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n == -1 && errno == EAGAIN)
+        send_stalled(fd);
+    if (n == -1)
+        return -1;
+
+    // Short only if SO_SNDTIMEO ran out partway: send the rest piece by piece
+    ssize_t total = n;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if ((size_t)n >= iov[i].iov_len)
+        {
+            n -= iov[i].iov_len;
+            continue;
+        }
+        size_t rest = iov[i].iov_len - n;
+        if (io_send(fd, (const char *)iov[i].iov_base + n, rest, 0) != (ssize_t)rest)
+            return -1;
+        total += rest;
+        n = 0;
+    }
+    return total;
+}
+
+// Whether io_recv() has data without reading the socket: records OpenSSL
+// already decrypted, which poll() cannot see
+int io_pending(int fd)
+{
+#ifdef WITH_TLS
+    struct tls_conn *t = tls_conn_of(fd);
+    if (t && !t->ktls_recv)
+        return SSL_has_pending(t->ssl);
+#endif
+    (void)fd;
+    return 0;
+}
+
+// Closes a client connection, ending its TLS session first (close_notify,
+// best effort)
+void close_client(int fd)
+{
+#ifdef WITH_TLS
+    struct tls_conn *t = tls_conn_of(fd);
+    if (t)
+    {
+        if (SSL_is_init_finished(t->ssl))
+            SSL_shutdown(t->ssl);
+        ERR_clear_error();
+        SSL_free(t->ssl);
+        memset(t, 0, sizeof(*t));
+    }
+#endif
+    socket_sample(fd);
+    close(fd);
+}
+
+// -------------------------------------------
+// Helper: MSG_ZEROCOPY sends for large in-memory bodies (-z)
+// -------------------------------------------
+// A body that is in memory rather than in a file (a content cache entry, a
+// buffer read by the pool's page cache probe) normally gets copied into
+// the socket buffer. With MSG_ZEROCOPY the kernel pins the pages and sends
+// from them, so the buffer must stay untouched until the kernel reports on
+// the socket's error queue that it is done, which for TCP is when the data
+// has been acknowledged. send_zerocopy() hands the body and a dup of the
+// socket to the zerocopy thread, which reads those reports and only then
+// drops the body (see "Zerocopy completions"); the serving thread moves on
+// right away. The pinning and notification cost more than a copy for small
+// bodies, hence the threshold and its floor (ZEROCOPY_MIN_KB). Plaintext
+// only: TLS encrypts into its own buffers.
+static long zerocopy_min; // -z: bodies at least this large use MSG_ZEROCOPY; 0 = never
+
+// Sends buf with MSG_ZEROCOPY. Returns the bytes sent, or -1 if none were,
+// and sets *calls to the number of zerocopy send calls made: each posts
+// one completion.
+long zerocopy_send(int fd, const char *buf, long len, uint32_t *calls)
+{
+    long sent = 0;
+    *calls = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_ZEROCOPY);
+        if (n >= 0)
+            (*calls)++;
+        else if (errno == ENOBUFS) // no option memory left for the notification: copy the rest
+            n = send(fd, buf + sent, len - sent, 0);
+        else if (errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            send_stalled(fd);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    return sent > 0 ? sent : -1;
+}
+
+// Reads the completions waiting on the error queue, without blocking: adds
+// the send calls they account for to *done, and sets *copied if the kernel
+// copied the data after all (loopback, or a device without scatter-gather)
+void zerocopy_drain(int fd, uint32_t *done, int *copied)
+{
+    while (1)
+    {
+        char control[128];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            *done += ee->ee_data - ee->ee_info + 1; // a range of send calls
+            *copied |= (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+        }
+    }
+}
+
+// -------------------------------------------
+// Helper: Send a complete HTTP response (returns bytes sent)
+// -------------------------------------------
+long send_response(int fd, int status_code, const char *status_text,
+                   const char *content_type, const char *body)
+{
+    char header[512];
+    int body_len = body ? strlen(body) : 0;
+
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 %d %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %d\r\n"
+                              "\r\n",
+                              status_code, status_text, content_type, body_len);
+
+    HTTPD_PROBE3(response_start, fd, status_code, body_len);
+    long total = 0;
+    ssize_t sent = io_send(fd, header, header_len, 0);
+    if (sent > 0)
+        total += sent;
+
+    if (body && body_len > 0)
+    {
+        sent = io_send(fd, body, body_len, 0);
+        if (sent > 0)
+            total += sent;
+    }
+    return total;
+}
+
+// -------------------------------------------
+// Helper: Send an error response (JSON body, returns bytes sent)
+// -------------------------------------------
+long send_error(int fd, int code, const char *message)
+{
+    char body[256];
+    snprintf(body, sizeof(body), "{\"error\": \"%s\"}", message);
+
+    switch (code)
+    {
+    case 400:
+        return send_response(fd, 400, "Bad Request", "application/json", body);
+    case 403:
+        return send_response(fd, 403, "Forbidden", "application/json", body);
+    case 404:
+        return send_response(fd, 404, "Not Found", "application/json", body);
+    case 500:
+        return send_response(fd, 500, "Internal Server Error", "application/json", body);
+    case 503:
+        return send_response(fd, 503, "Service Unavailable", "application/json", body);
+    default:
+        return send_response(fd, code, "Error", "application/json", body);
+    }
+}
+
+// -------------------------------------------
+// Helper: Read file content into memory
+// -------------------------------------------
+// open()/fstat()/read() rather than stdio: the body buffer is the only
+// allocation (fopen() would add a FILE and its buffer).
+char *read_file(const char *file_path, long *out_size)
+{
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+    long size = st.st_size;
+
+    char *buffer = malloc(size + 1);
+    if (!buffer)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    long bytes_read = 0;
+    while (bytes_read < size)
+    {
+        ssize_t n = read(fd, buffer + bytes_read, size - bytes_read);
+        if (n <= 0)
+            break;
+        bytes_read += n;
+    }
+    close(fd);
+
+    if (bytes_read != size)
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    buffer[size] = '\0';
+    *out_size = size;
+    return buffer;
+}
+
+// -------------------------------------------
+// Helper: Detect Content-Type from file extension
+// -------------------------------------------
+const char *get_content_type(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (!ext)
+        return "text/plain";
+    if (strcmp(ext, ".html") == 0)
+        return "text/html";
+    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
+        return "image/jpeg";
+    if (strcmp(ext, ".png") == 0)
+        return "image/png";
+    if (strcmp(ext, ".css") == 0)
+        return "text/css";
+    if (strcmp(ext, ".js") == 0)
+        return "application/javascript";
+    return "application/octet-stream";
+}
+
+// -------------------------------------------
+// Parse the request line into a request
+// -------------------------------------------
+// Returns 0 on success, or the HTTP error status to answer with
+// (and sets *error to its message).
+struct request
+{
+    char method[8];
+    char path[256];
+    char protocol[16];
+};
+
+// The checks every request goes through, whichever protocol it came in
+// on: strips the query string, rejects traversal and anything but GET
+int check_request(struct request *req, const char **error)
+{
+    // Remove query string and fragments
+    char *qmark = strchr(req->path, '?');
+    if (qmark)
+        *qmark = '\0';
+    char *hash = strchr(req->path, '#');
+    if (hash)
+        *hash = '\0';
+
+    // Basic security: block path traversal
+    if (strstr(req->path, ".."))
+    {
+        *error = "Forbidden path traversal";
+        return 403;
+    }
+
+    // Only support GET requests
+    if (strcmp(req->method, "GET") != 0)
+    {
+        *error = "Only GET is supported";
+        return 501;
+    }
+
+    return 0;
+}
+
+int parse_request(const char *buf, struct request *req, const char **error)
+{
+    if (sscanf(buf, "%7s %255s %15s", req->method, req->path, req->protocol) != 3)
+    {
+        *error = "Malformed request";
+        return 400;
+    }
+    return check_request(req, error);
+}
+
+// -------------------------------------------
+// Phase timing: sampled traces for /__trace
+// -------------------------------------------
+// One request in trace_every (-t) copies its phase times into the
+// recording thread's trace ring, overwriting the oldest sample. Each entry
+// is guarded by a sequence number (odd while being written) so readers can
+// copy it without a lock and skip entries torn by a concurrent write.
+struct trace_sample
+{
+    _Atomic uint32_t seq;
+    uint16_t status;
+    struct phase_times times;
+    char path[64];
+};
+
+struct trace_ring
+{
+    struct trace_sample samples[TRACE_RING_SIZE];
+    uint64_t next;      // producer only
+    uint64_t countdown; // requests until the next sample
+};
+
+static unsigned trace_every; // 0 = no sampling
+static struct trace_ring *trace_rings[MAX_METRICS_THREADS];
+
+int metrics_slot_id(void)
+{
+    return (int)(metrics_self() - metrics_slots);
+}
+
+// -------------------------------------------
+// Phase timing: hardware counters (-c)
+// -------------------------------------------
+// Each thread opens one perf_event_open() group (cycles, instructions,
+// cache misses, branch misses) counting only itself, and reads the whole
+// group with one read() at the start and end of the parse, resolve and send
+// phases. The deltas are summed into the thread's metrics. Costs two
+// syscalls per counted phase, so it is off by default.
+struct perf_group
+{
+    int fd; // group leader, -1 if not open
+    int state; // 0 = not tried yet, 1 = open, -1 = unavailable
+    int started[PHASES];
+    uint64_t start[PHASES][PERF_COUNTERS];
+};
+
+static int perf_enabled;
+static _Thread_local struct perf_group thread_perf = {.fd = -1};
+
+// Opens the calling thread's counter group. Counts kernel time too when
+// perf_event_paranoid allows it (send and realpath are mostly syscalls),
+// user space only otherwise. Returns the leader fd or -1 with errno set.
+int perf_group_open(void)
+{
+    for (int exclude_kernel = 0; exclude_kernel <= 1; exclude_kernel++)
+    {
+        int fds[PERF_COUNTERS];
+        int e;
+        for (e = 0; e < PERF_COUNTERS; e++)
+        {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNTER_CONFIGS[e];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = exclude_kernel;
+            attr.exclude_hv = 1;
+
+            fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, e ? fds[0] : -1, PERF_FLAG_FD_CLOEXEC);
+            if (fds[e] == -1)
+                break;
+        }
+        if (e == PERF_COUNTERS)
+            return fds[0]; // members stay open, read through the leader
+
+        int saved = errno;
+        while (e-- > 0)
+            close(fds[e]);
+        errno = saved;
+        if (errno != EACCES && errno != EPERM)
+            break;
+    }
+    return -1;
+}
+
+int perf_read(struct perf_group *g, uint64_t values[PERF_COUNTERS])
+{
+    if (g->state == 0)
+    {
+        g->fd = perf_group_open();
+        g->state = g->fd == -1 ? -1 : 1;
+    }
+    if (g->state != 1)
+        return -1;
+
+    uint64_t buf[1 + PERF_COUNTERS]; // nr, then one value per member
+    if (read(g->fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != PERF_COUNTERS)
+        return -1;
+    memcpy(values, buf + 1, sizeof(buf) - sizeof(buf[0]));
+    return 0;
+}
+
+void perf_phase_begin(enum phase p)
+{
+    struct perf_group *g = &thread_perf;
+    g->started[p] = perf_read(g, g->start[p]) == 0;
+}
+
+void perf_phase_end(enum phase p)
+{
+    struct perf_group *g = &thread_perf;
+    uint64_t now[PERF_COUNTERS];
+    if (!g->started[p] || perf_read(g, now) == -1)
+        return;
+    g->started[p] = 0;
+
+    struct metrics *m = metrics_self();
+    for (int e = 0; e < PERF_COUNTERS; e++)
+        counter_add(&m->perf[p][e], now[e] - g->start[p][e]);
+    counter_add(&m->perf_samples[p], 1);
+}
+
+void phase_begin(struct phase_times *t, enum phase p)
+{
+    if (!t)
+        return;
+    if (perf_enabled && (PERF_PHASE_MASK >> p & 1))
+        perf_phase_begin(p);
+    t->begin[p] = ticks_now();
+    t->thread[p] = metrics_slot_id();
+}
+
+void phase_end(struct phase_times *t, enum phase p)
+{
+    if (!t)
+        return;
+    t->end[p] = ticks_now();
+    if (perf_enabled && (PERF_PHASE_MASK >> p & 1))
+        perf_phase_end(p);
+}
+
+// Gives the calling thread its trace ring. Serving threads call it when
+// they start, so sampling never allocates on the request path; a thread
+// without a ring (-t off, or out of memory) records no samples.
+void trace_ring_init(void)
+{
+    int slot = metrics_slot_id();
+    if (!trace_every || trace_rings[slot])
+        return;
+    struct trace_ring *r = calloc(1, sizeof(*r));
+    // Readers only look at published rings
+    if (r)
+        atomic_store_explicit((_Atomic(struct trace_ring *) *)&trace_rings[slot], r, memory_order_release);
+}
+
+void trace_sample(const struct request *req, int status, const struct phase_times *times)
+{
+    struct trace_ring *r = trace_rings[metrics_slot_id()];
+    if (!r)
+        return;
+
+    if (r->countdown > 0)
+    {
+        r->countdown--;
+        return;
+    }
+    r->countdown = trace_every - 1;
+
+    struct trace_sample *s = &r->samples[r->next++ % TRACE_RING_SIZE];
+    uint32_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    s->status = status;
+    s->times = *times;
+    snprintf(s->path, sizeof(s->path), "%.63s", req ? req->path : "-");
+
+    atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
+}
+
+// Per-phase histograms, plus a trace sample when sampling is on
+void record_phases(const struct request *req, int status, const struct phase_times *times)
+{
+    if (!times)
+        return;
+
+    struct metrics *m = metrics_self();
+    for (int p = 0; p < PHASES; p++)
+        if (times->begin[p] && times->end[p] >= times->begin[p])
+            histogram_record(&m->phases[p], ticks_to_ns(times->end[p] - times->begin[p]));
+
+    if (trace_every)
+        trace_sample(req, status, times);
+}
+
+// -------------------------------------------
+// Access log: per-thread rings drained by a writer thread
+// -------------------------------------------
+// Serving threads never touch the log file. Each one owns a single-producer
+// single-consumer ring of fixed-size binary records; the writer thread
+// drains every ring into a large buffer and writes it out in big chunks.
+// A full ring drops the record and counts the drop instead of waiting.
+//
+// File format: a struct access_log_header, then struct access_record
+// entries back to back, in host byte order. tools/logdecode.c prints it
+// as text.
+struct access_log_header
+{
+    char magic[8]; // ACCESS_LOG_MAGIC
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct access_record
+{
+    uint64_t time_ns;    // wall clock (CLOCK_REALTIME) when the response finished
+    uint64_t latency_ns; // accept to response sent, 0 if not timed
+    uint64_t bytes;      // bytes written to the client
+    uint16_t status;
+    uint16_t path_len; // full length; the stored path may be truncated
+    char method[8];    // NUL-padded, "-" when the request was not parsed
+    char path[ACCESS_LOG_PATH_MAX];
+};
+
+_Static_assert(sizeof(struct access_record) == 128, "access log records are 128 bytes");
+
+struct log_ring
+{
+    _Atomic uint64_t head __attribute__((aligned(64))); // next record the writer reads
+    _Atomic uint64_t tail __attribute__((aligned(64))); // next slot the producer fills
+    uint64_t head_cache;                                // producer's last view of head
+    struct access_record records[ACCESS_LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+static int access_log_fd = -1;
+static pthread_t access_log_thread;
+static _Atomic int writers_stopping; // producers are done: drain once more and exit (log and capture)
+static struct log_ring *log_rings[MAX_METRICS_THREADS];
+static _Atomic int log_ring_count;
+static _Thread_local struct log_ring *thread_log_ring;
+
+struct log_ring *log_ring_self(void)
+{
+    if (!thread_log_ring)
+    {
+        struct log_ring *r = aligned_alloc(64, sizeof(struct log_ring));
+        if (!r)
+            return NULL;
+        memset(r, 0, sizeof(*r));
+
+        int slot = atomic_fetch_add(&log_ring_count, 1);
+        if (slot >= MAX_METRICS_THREADS)
+        {
+            free(r);
+            return NULL;
+        }
+        thread_log_ring = r;
+        // Release: the writer must see an initialised ring
+        atomic_store_explicit((_Atomic(struct log_ring *) *)&log_rings[slot], r, memory_order_release);
+    }
+    return thread_log_ring;
+}
+
+void access_log(const struct request *req, int status, long bytes, uint64_t latency_ns)
+{
+    struct log_ring *r = log_ring_self();
+    if (!r)
+        return;
+
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - r->head_cache == ACCESS_LOG_RING_SIZE)
+    {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->head_cache == ACCESS_LOG_RING_SIZE)
+        {
+            counter_add(&metrics_self()->log_dropped, 1);
+            return;
+        }
+    }
+
+    struct access_record *rec = &r->records[tail & (ACCESS_LOG_RING_SIZE - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    rec->latency_ns = latency_ns;
+    rec->bytes = bytes > 0 ? bytes : 0;
+    rec->status = status;
+
+    const char *method = req ? req->method : "-";
+    const char *path = req ? req->path : "-";
+    size_t path_len = strlen(path);
+    strncpy(rec->method, method, sizeof(rec->method));
+    rec->path_len = path_len;
+    memcpy(rec->path, path, path_len < ACCESS_LOG_PATH_MAX ? path_len : ACCESS_LOG_PATH_MAX);
+
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+// -------------------------------------------
+// Traffic capture: raw request bytes for replay
+// -------------------------------------------
+// With -r, every recv() on a client connection is recorded with the time
+// since capture start, so bench/replay.c can re-drive the same traffic
+// (same bytes, same segmentation, same pacing) against another build. It
+// uses the access log's scheme: per-thread rings of fixed-size slots,
+// drained by a background thread, and a full ring drops the chunk.
+//
+// File format: a struct capture_header, then for every chunk a struct
+// capture_record followed by its `len` bytes, in host byte order.
+struct capture_header
+{
+    char magic[8]; // CAPTURE_MAGIC
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t start_ns; // wall clock (CLOCK_REALTIME) when the capture started
+};
+
+#define CAPTURE_FIRST 1 // first chunk of its connection (the client connected just before)
+
+struct capture_record
+{
+    uint64_t offset_ns; // since the capture started
+    uint32_t conn_id;   // chunks of one connection share it
+    uint16_t len;
+    uint16_t flags; // CAPTURE_FIRST
+};
+
+struct capture_slot
+{
+    struct capture_record rec;
+    char data[MAXDATASIZE];
+};
+
+struct capture_ring
+{
+    _Atomic uint64_t head __attribute__((aligned(64)));
+    _Atomic uint64_t tail __attribute__((aligned(64)));
+    uint64_t head_cache;
+    struct capture_slot slots[CAPTURE_RING_SIZE] __attribute__((aligned(64)));
+};
+
+static int capture_fd = -1;
+static pthread_t capture_thread;
+static uint64_t capture_start_ns; // now_ns() at startup
+static _Atomic uint32_t capture_next_conn;
+static struct capture_ring *capture_rings[MAX_METRICS_THREADS];
+static _Atomic int capture_ring_count;
+static _Thread_local struct capture_ring *thread_capture_ring;
+
+struct capture_ring *capture_ring_self(void)
+{
+    if (!thread_capture_ring)
+    {
+        struct capture_ring *r = aligned_alloc(64, sizeof(struct capture_ring));
+        if (!r)
+            return NULL;
+        memset(r, 0, sizeof(*r));
+
+        int slot = atomic_fetch_add(&capture_ring_count, 1);
+        if (slot >= MAX_METRICS_THREADS)
+        {
+            free(r);
+            return NULL;
+        }
+        thread_capture_ring = r;
+        atomic_store_explicit((_Atomic(struct capture_ring *) *)&capture_rings[slot], r, memory_order_release);
+    }
+    return thread_capture_ring;
+}
+
+// Ids start at 1; 0 means "not captured yet"
+uint32_t capture_conn_id(void)
+{
+    return atomic_fetch_add(&capture_next_conn, 1) + 1;
+}
+
+void capture_chunk(uint32_t conn_id, int first, const char *data, size_t len)
+{
+    struct capture_ring *r = capture_ring_self();
+    if (!r)
+        return;
+
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - r->head_cache == CAPTURE_RING_SIZE)
+    {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->head_cache == CAPTURE_RING_SIZE)
+        {
+            counter_add(&metrics_self()->capture_dropped, 1);
+            return;
+        }
+    }
+
+    struct capture_slot *slot = &r->slots[tail & (CAPTURE_RING_SIZE - 1)];
+    if (len > sizeof(slot->data))
+        len = sizeof(slot->data);
+    slot->rec.offset_ns = now_ns() - capture_start_ns;
+    slot->rec.conn_id = conn_id;
+    slot->rec.len = len;
+    slot->rec.flags = first ? CAPTURE_FIRST : 0;
+    memcpy(slot->data, data, len);
+
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+// -------------------------------------------
+// Hot paths: Count-Min sketch + top-K table
+// -------------------------------------------
+// Finds the URLs that dominate traffic in fixed memory, however many files
+// are served. Every successful request bumps CM_DEPTH counters of a
+// Count-Min sketch (relaxed atomics shared by all threads); the smallest of
+// them bounds from above how often the path was seen. A path whose estimate
+// beats the smallest entry of the HOT_K table takes its place, Space-Saving
+// style. The table lock is only ever tried on the request path: if another
+// thread holds it, the update is skipped (the next request for a hot path
+// will make it).
+//
+// Everything else runs on the hot paths thread. Every HOT_PUBLISH_NS it
+// halves all counts once HOT_DECAY_EVERY more requests were seen, so the
+// table follows current traffic rather than all-time totals, and publishes
+// a sorted copy of a changed table. Readers (the content cache, stats) pin
+// the published copy with a reference count instead of taking the lock.
+// The thread only rewrites a copy that is neither current nor pinned, and a
+// reader that pinned a copy just as it was replaced sees the current index
+// move and tries again.
+struct hot_path
+{
+    uint64_t hash;
+    uint64_t count; // sketch estimate at the last update
+    char path[256];
+};
+
+struct hot_snapshot
+{
+    _Atomic int refs; // readers holding this copy
+    int n;
+    struct hot_path top[HOT_K]; // hottest first
+};
+
+struct hot_paths
+{
+    _Atomic uint32_t sketch[CM_DEPTH][CM_WIDTH];
+    _Atomic uint64_t seen;
+    _Atomic uint64_t min_count; // smallest count once the table is full
+    pthread_mutex_t lock;       // guards top and n
+    struct hot_path top[HOT_K];
+    int n;
+    _Atomic int dirty; // table changed since the last publish
+    struct hot_snapshot snapshots[HOT_SNAPSHOTS];
+    _Atomic int current;   // published snapshot
+    uint64_t decays;       // seen / HOT_DECAY_EVERY at the last decay (hot paths thread)
+    const char *save_path; // -k: saved every HOT_SAVE_INTERVAL_NS, read at startup
+};
+
+static struct hot_paths hot = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// FNV-1a
+uint64_t hash_path(const char *path)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *path; path++)
+    {
+        h ^= (unsigned char)*path;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Adds n to the path's counters and returns its new estimate. Rows use
+// double hashing (h1 + row * h2) over the one 64-bit hash.
+uint32_t sketch_add(uint64_t hash, uint32_t n)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    uint32_t estimate = UINT32_MAX;
+
+    for (int row = 0; row < CM_DEPTH; row++)
+    {
+        _Atomic uint32_t *counter = &hot.sketch[row][(h1 + row * h2) % CM_WIDTH];
+        uint32_t v = atomic_fetch_add_explicit(counter, n, memory_order_relaxed) + n;
+        if (v < estimate)
+            estimate = v;
+    }
+    return estimate;
+}
+
+// Caller holds hot.lock
+void hot_paths_update(uint64_t hash, const char *path, uint64_t count)
+{
+    int slot = -1;
+    for (int i = 0; i < hot.n && slot == -1; i++)
+        if (hot.top[i].hash == hash && strcmp(hot.top[i].path, path) == 0)
+            slot = i;
+
+    if (slot == -1)
+    {
+        if (hot.n < HOT_K)
+            slot = hot.n++;
+        else
+        {
+            // Full: evict the smallest entry if this path now beats it
+            slot = 0;
+            for (int i = 1; i < HOT_K; i++)
+                if (hot.top[i].count < hot.top[slot].count)
+                    slot = i;
+            if (count <= hot.top[slot].count)
+                return;
+        }
+        hot.top[slot].hash = hash;
+        snprintf(hot.top[slot].path, sizeof(hot.top[slot].path), "%s", path);
+    }
+    hot.top[slot].count = count;
+
+    uint64_t min = 0;
+    if (hot.n == HOT_K)
+    {
+        min = UINT64_MAX;
+        for (int i = 0; i < HOT_K; i++)
+            if (hot.top[i].count < min)
+                min = hot.top[i].count;
+    }
+    atomic_store_explicit(&hot.min_count, min, memory_order_relaxed);
+    atomic_store_explicit(&hot.dirty, 1, memory_order_relaxed);
+}
+
+// Hot paths thread. Racy against concurrent increments, which only makes
+// the halving approximate.
+void hot_paths_decay(void)
+{
+    for (int row = 0; row < CM_DEPTH; row++)
+        for (int i = 0; i < CM_WIDTH; i++)
+            atomic_store_explicit(&hot.sketch[row][i],
+                                  atomic_load_explicit(&hot.sketch[row][i], memory_order_relaxed) / 2,
+                                  memory_order_relaxed);
+
+    pthread_mutex_lock(&hot.lock);
+    for (int i = 0; i < hot.n; i++)
+        hot.top[i].count /= 2;
+    atomic_store_explicit(&hot.min_count, atomic_load_explicit(&hot.min_count, memory_order_relaxed) / 2,
+                          memory_order_relaxed);
+    atomic_store_explicit(&hot.dirty, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&hot.lock);
+}
+
+int hot_path_cmp(const void *a, const void *b)
+{
+    const struct hot_path *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+// Hot paths thread (and startup, before it runs): sorts a changed table
+// into a free copy and makes it current. If every other copy is still
+// pinned, the table stays dirty and goes out on the next turn.
+void hot_paths_publish(void)
+{
+    if (!atomic_exchange(&hot.dirty, 0))
+        return;
+
+    int current = atomic_load(&hot.current);
+    for (int i = 0; i < HOT_SNAPSHOTS; i++)
+    {
+        struct hot_snapshot *s = &hot.snapshots[i];
+        if (i == current || atomic_load(&s->refs) != 0)
+            continue;
+        pthread_mutex_lock(&hot.lock);
+        s->n = hot.n;
+        memcpy(s->top, hot.top, s->n * sizeof(s->top[0]));
+        pthread_mutex_unlock(&hot.lock);
+        qsort(s->top, s->n, sizeof(s->top[0]), hot_path_cmp);
+        atomic_store(&hot.current, i);
+        return;
+    }
+    atomic_store(&hot.dirty, 1);
+}
+
+// The published table, hottest first; hand it back with hot_paths_unpin()
+struct hot_snapshot *hot_paths_pin(void)
+{
+    while (1)
+    {
+        int i = atomic_load(&hot.current);
+        atomic_fetch_add(&hot.snapshots[i].refs, 1);
+        if (atomic_load(&hot.current) == i)
+            return &hot.snapshots[i];
+        atomic_fetch_sub(&hot.snapshots[i].refs, 1);
+    }
+}
+
+void hot_paths_unpin(struct hot_snapshot *s)
+{
+    atomic_fetch_sub(&s->refs, 1);
+}
+
+// Copies the published table into out (HOT_K entries), hottest first;
+// returns the count
+int hot_paths_snapshot(struct hot_path *out)
+{
+    struct hot_snapshot *s = hot_paths_pin();
+    int n = s->n;
+    memcpy(out, s->top, n * sizeof(*out));
+    hot_paths_unpin(s);
+    return n;
+}
+
+int hot_paths_find(const struct hot_path *top, int n, uint64_t hash, const char *path)
+{
+    for (int i = 0; i < n; i++)
+        if (top[i].hash == hash && strcmp(top[i].path, path) == 0)
+            return 1;
+    return 0;
+}
+
+// Written to a temporary file and renamed, so a crash never leaves half a list
+void hot_paths_save(void)
+{
+    static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER; // saver thread vs. shutdown
+    struct hot_path top[HOT_K];
+    int n = hot_paths_snapshot(top);
+    pthread_mutex_lock(&save_lock);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", hot.save_path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        perror("hot paths: fopen");
+    else
+    {
+        for (int i = 0; i < n; i++)
+            fprintf(f, "%llu %s\n", (unsigned long long)top[i].count, top[i].path);
+        if (fclose(f) != 0 || rename(tmp, hot.save_path) == -1)
+            perror("hot paths: save");
+    }
+    pthread_mutex_unlock(&save_lock);
+}
+
+// Decays, publishes and (with -k) saves the table, so none of it holds up
+// a request
+void *hot_paths_main(void *arg)
+{
+    (void)arg;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = HOT_PUBLISH_NS};
+    uint64_t saved_ns = now_ns();
+    while (1)
+    {
+        nanosleep(&pause, NULL);
+        uint64_t decays = atomic_load_explicit(&hot.seen, memory_order_relaxed) / HOT_DECAY_EVERY;
+        if (decays != hot.decays)
+        {
+            hot.decays = decays;
+            hot_paths_decay();
+        }
+        hot_paths_publish();
+
+        if (hot.save_path && now_ns() - saved_ns >= HOT_SAVE_INTERVAL_NS)
+        {
+            hot_paths_save();
+            saved_ns = now_ns();
+        }
+    }
+    return NULL;
+}
+
+// file: the -k list to save to, or NULL
+void hot_paths_start(const char *file)
+{
+    hot.save_path = file;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, hot_paths_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+// Seeds the sketch and table from a list saved by a previous run, so a
+// restarted server knows its hot set before traffic rebuilds it. A missing
+// file is not an error (first start).
+void hot_paths_load(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    if (!f)
+        return;
+
+    char line[300];
+    char path[256];
+    unsigned long long count;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%llu %255s", &count, path) != 2 || path[0] != '/')
+            continue;
+        uint64_t hash = hash_path(path);
+        uint32_t estimate = sketch_add(hash, count > UINT32_MAX / 2 ? UINT32_MAX / 2 : count);
+        pthread_mutex_lock(&hot.lock);
+        hot_paths_update(hash, path, estimate);
+        pthread_mutex_unlock(&hot.lock);
+    }
+    fclose(f);
+    hot_paths_publish();
+}
+
+void hot_paths_record(const char *path)
+{
+    uint64_t hash = hash_path(path);
+    uint64_t count = sketch_add(hash, 1);
+
+    if (count > atomic_load_explicit(&hot.min_count, memory_order_relaxed) &&
+        pthread_mutex_trylock(&hot.lock) == 0)
+    {
+        hot_paths_update(hash, path, count);
+        pthread_mutex_unlock(&hot.lock);
+    }
+    atomic_fetch_add_explicit(&hot.seen, 1, memory_order_relaxed);
+}
+
+// One finished request on fd (already closed): metrics, phase timings
+// (times may be NULL), the hot path sketch (files served, not internal
+// endpoints), the response_done probe and, when enabled, the access log
+void record_request(int fd, const struct request *req, int status, long bytes, uint64_t latency_ns,
+                    const struct phase_times *times)
+{
+    ALLOC_SINK(NULL); // the bookkeeping below is not the request's
+#ifdef ALLOC_TRACKING
+    // The stats endpoints allocate by design; they are not what is guarded
+    if (times && !(req && strncmp(req->path, "/__", 3) == 0))
+    {
+        counter_add(&metrics_self()->alloc_requests, 1);
+        counter_add(&metrics_self()->allocs, times->allocs);
+    }
+#endif
+
+    HTTPD_PROBE4(response_done, fd, status, bytes, latency_ns);
+    metrics_record_request(status, bytes, latency_ns);
+    record_phases(req, status, times);
+    if (status == 200 && req && strncmp(req->path, "/__", 3) != 0)
+        hot_paths_record(req->path);
+    if (access_log_fd != -1)
+        access_log(req, status, bytes, latency_ns);
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void *access_log_writer_main(void *arg)
+{
+    (void)arg;
+    static char buf[ACCESS_LOG_WRITE_BUF];
+    size_t len = 0;
+    struct metrics *m = metrics_self();
+
+    while (1)
+    {
+        // Read before draining: once it is set, this pass sees every record
+        int last = atomic_load(&writers_stopping);
+        int n = atomic_load(&log_ring_count);
+        if (n > MAX_METRICS_THREADS)
+            n = MAX_METRICS_THREADS;
+
+        uint64_t drained = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct log_ring *r = atomic_load_explicit((_Atomic(struct log_ring *) *)&log_rings[i],
+                                                      memory_order_acquire);
+            if (!r)
+                continue; // registered but not published yet
+
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+            for (; head != tail; head++)
+            {
+                if (len + sizeof(struct access_record) > sizeof(buf))
+                {
+                    if (write_all(access_log_fd, buf, len) == -1)
+                        perror("access log write");
+                    len = 0;
+                }
+                memcpy(buf + len, &r->records[head & (ACCESS_LOG_RING_SIZE - 1)], sizeof(struct access_record));
+                len += sizeof(struct access_record);
+                drained++;
+            }
+            atomic_store_explicit(&r->head, head, memory_order_release);
+        }
+
+        if (len > 0)
+        {
+            if (write_all(access_log_fd, buf, len) == -1)
+                perror("access log write");
+            len = 0;
+        }
+        counter_add(&m->log_written, drained);
+        if (last)
+            break;
+
+        // Idle: let records accumulate so the next write is a big one
+        if (drained < ACCESS_LOG_RING_SIZE / 2)
+        {
+            struct timespec pause = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_FLUSH_NS};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+void access_log_start(const char *path)
+{
+    access_log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (access_log_fd == -1)
+    {
+        perror("access log open");
+        exit(1);
+    }
+
+    // New file: write the header once
+    struct stat st;
+    if (fstat(access_log_fd, &st) == 0 && st.st_size == 0)
+    {
+        struct access_log_header header = {.version = 1, .record_size = sizeof(struct access_record)};
+        memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+        write_all(access_log_fd, (const char *)&header, sizeof(header));
+    }
+
+    if (pthread_create(&access_log_thread, NULL, access_log_writer_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+// Chunks from different threads reach the file slightly out of time
+// order; bench/replay.c sorts them
+void *capture_writer_main(void *arg)
+{
+    (void)arg;
+    static char buf[ACCESS_LOG_WRITE_BUF];
+    size_t len = 0;
+    struct metrics *m = metrics_self();
+
+    while (1)
+    {
+        int last = atomic_load(&writers_stopping);
+        int n = atomic_load(&capture_ring_count);
+        if (n > MAX_METRICS_THREADS)
+            n = MAX_METRICS_THREADS;
+
+        uint64_t drained = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct capture_ring *r = atomic_load_explicit(
+                (_Atomic(struct capture_ring *) *)&capture_rings[i], memory_order_acquire);
+            if (!r)
+                continue;
+
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+            for (; head != tail; head++)
+            {
+                struct capture_slot *slot = &r->slots[head & (CAPTURE_RING_SIZE - 1)];
+                size_t size = sizeof(slot->rec) + slot->rec.len;
+                if (len + size > sizeof(buf))
+                {
+                    if (write_all(capture_fd, buf, len) == -1)
+                        perror("capture write");
+                    len = 0;
+                }
+                memcpy(buf + len, slot, size);
+                len += size;
+                drained++;
+            }
+            atomic_store_explicit(&r->head, head, memory_order_release);
+        }
+
+        if (len > 0)
+        {
+            if (write_all(capture_fd, buf, len) == -1)
+                perror("capture write");
+            len = 0;
+        }
+        counter_add(&m->capture_written, drained);
+        if (last)
+            break;
+
+        if (drained < CAPTURE_RING_SIZE / 2)
+        {
+            struct timespec pause = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_FLUSH_NS};
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+// A capture is one session: the file is truncated, since offsets are
+// relative to this start
+void capture_start(const char *path)
+{
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture_fd == -1)
+    {
+        perror("capture open");
+        exit(1);
+    }
+
+    struct capture_header header = {.version = 1, .record_size = sizeof(struct capture_record)};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    capture_start_ns = now_ns();
+    write_all(capture_fd, (const char *)&header, sizeof(header));
+
+    if (pthread_create(&capture_thread, NULL, capture_writer_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+// Last step of a shutdown, once requests are answered (or given up on):
+// the writers drain their rings one final time and stop, and the hot path
+// list is saved as it stands
+void background_stop(void)
+{
+    atomic_store(&writers_stopping, 1);
+    if (access_log_fd != -1)
+        pthread_join(access_log_thread, NULL);
+    if (capture_fd != -1)
+        pthread_join(capture_thread, NULL);
+    if (hot.save_path)
+        hot_paths_save();
+}
+
+// -------------------------------------------
+// Load the file a request asks for (blocking filesystem work)
+// -------------------------------------------
+// Everything that can stall on the disk (path resolution, open, read) lives
+// here, so it can run either inline or on an I/O thread (see -i).
+struct response
+{
+    int status; // 200, or the error status to answer with
+    const char *error;
+    char path[PATH_MAX];
+    char *body;
+    long size;
+    long loaded; // bytes of body read so far (page cache probe)
+    int fd;      // file still open for the rest of the body, or -1
+    struct cache_entry *cached; // body belongs to this cache entry (not malloc'd)
+    const char *links;          // Link header for a 103 Early Hints response (in cached), or NULL
+    struct phase_times *times; // set by the caller, may be NULL
+};
+
+// Resolve the request to a real path under root_dir. Returns 0, or -1 with
+// the error status set on the response.
+int resolve_path(const struct request *req, const char *root_dir, struct response *res)
+{
+    // Default file (index.html)
+    char requested_path[PATH_MAX];
+    if (strcmp(req->path, "/") == 0)
+        snprintf(requested_path, sizeof(requested_path), "%s/index.html", root_dir);
+    else
+        snprintf(requested_path, sizeof(requested_path), "%s%s", root_dir, req->path);
+
+    // Resolve absolute path
+    if (!realpath(requested_path, res->path))
+    {
+        res->status = 404;
+        res->error = "File not found";
+        HTTPD_PROBE3(file_resolved, req->path, requested_path, 404);
+        return -1;
+    }
+
+    // Resolve absolute root directory
+    char real_root[PATH_MAX];
+    realpath(root_dir, real_root);
+
+    // Check if requested file is inside root_dir (prevent traversal)
+    if (strncmp(res->path, real_root, strlen(real_root)) != 0)
+    {
+        res->status = 403;
+        res->error = "Forbidden path";
+        HTTPD_PROBE3(file_resolved, req->path, res->path, 403);
+        return -1;
+    }
+
+    HTTPD_PROBE3(file_resolved, req->path, res->path, 200);
+    return 0;
+}
+
+// -------------------------------------------
+// Content cache: hot files pinned in memory (-m)
+// -------------------------------------------
+// Holds file bodies for paths in the hot table, up to cache_max_bytes. An
+// entry is only added while its path is hot and only evicted (to make room)
+// once it no longer is, so the hot set stays pinned. A hit skips realpath(),
+// open() and read(). Entries are refcounted: a response keeps its entry
+// alive while it is being sent, even if the entry is dropped from the
+// table meanwhile.
+//
+// Request threads never touch the disk for the cache. A miss on a hot path
+// queues a fill, and a hit whose file was last stat()ed more than
+// CACHE_REVALIDATE_NS ago queues a re-check; the cache thread does the
+// stat(), malloc() and read. Until the re-check finds an edit or deletion,
+// hits keep serving the old body.
+//
+// An HTML document is scanned once, when it is added, for the stylesheets,
+// scripts and images it references on this server. Those become the Link
+// header of the 103 Early Hints sent ahead of it (-e), and with -p they
+// are loaded into the cache too.
+struct cache_entry
+{
+    struct cache_entry *next; // hash chain
+    _Atomic int refs;         // one for the table, one per response using it
+    _Atomic uint64_t checked_ns;
+    uint64_t hash;
+    struct timespec mtime;
+    char url[256];
+    char path[PATH_MAX];
+    char links[EARLY_HINTS_LINKS]; // preload Link header value, or "" (not HTML, nothing found)
+    long size;
+    char body[];
+};
+
+struct content_cache
+{
+    pthread_rwlock_t lock;
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    size_t bytes;
+    int entries;
+};
+
+static struct content_cache cache = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+static size_t cache_max_bytes; // 0 = no cache
+static int early_hints;        // -e: send 103 Early Hints for cached HTML documents
+static int preload_prefetch;   // -p: load the assets they preload into the cache
+
+void cache_release(struct cache_entry *e)
+{
+    if (atomic_fetch_sub(&e->refs, 1) == 1)
+        free(e);
+}
+
+// Caller holds the write lock. Returns 1 if e was still in the table.
+int cache_unlink(struct cache_entry *e)
+{
+    for (struct cache_entry **pp = &cache.buckets[e->hash % CACHE_BUCKETS]; *pp; pp = &(*pp)->next)
+    {
+        if (*pp != e)
+            continue;
+        *pp = e->next;
+        cache.bytes -= e->size;
+        cache.entries--;
+        cache_release(e);
+        return 1;
+    }
+    return 0;
+}
+
+int cache_contains(const char *url)
+{
+    uint64_t hash = hash_path(url);
+    int found = 0;
+    pthread_rwlock_rdlock(&cache.lock);
+    for (struct cache_entry *e = cache.buckets[hash % CACHE_BUCKETS]; e && !found; e = e->next)
+        found = e->hash == hash && strcmp(e->url, url) == 0;
+    pthread_rwlock_unlock(&cache.lock);
+    return found;
+}
+
+// Work for the cache thread, handed over by the request threads. A full
+// queue drops the job: the next miss on the path queues its fill again,
+// and a dropped re-check comes round after another CACHE_REVALIDATE_NS.
+enum cache_job_kind
+{
+    CACHE_FILL,       // load a hot path into the cache
+    CACHE_REVALIDATE, // stat() a cached path's file, drop the entry if it changed
+};
+
+struct cache_job
+{
+    enum cache_job_kind kind;
+    char url[256];
+};
+
+struct cache_queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct cache_job jobs[CACHE_QUEUE];
+    int head;
+    int count;
+    const char *root_dir;
+};
+
+static struct cache_queue cache_jobs = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+void cache_enqueue(enum cache_job_kind kind, const char *url)
+{
+    pthread_mutex_lock(&cache_jobs.lock);
+    if (cache_jobs.count < CACHE_QUEUE)
+    {
+        struct cache_job *job = &cache_jobs.jobs[(cache_jobs.head + cache_jobs.count) % CACHE_QUEUE];
+        job->kind = kind;
+        snprintf(job->url, sizeof(job->url), "%s", url);
+        cache_jobs.count++;
+        pthread_cond_signal(&cache_jobs.ready);
+    }
+    pthread_mutex_unlock(&cache_jobs.lock);
+}
+
+// Fills res from the cache. Returns 1 on a hit, 0 on a miss.
+int cache_lookup(const struct request *req, struct response *res)
+{
+    uint64_t hash = hash_path(req->path);
+    struct cache_entry *e;
+
+    pthread_rwlock_rdlock(&cache.lock);
+    for (e = cache.buckets[hash % CACHE_BUCKETS]; e; e = e->next)
+    {
+        if (e->hash == hash && strcmp(e->url, req->path) == 0)
+        {
+            atomic_fetch_add(&e->refs, 1);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache.lock);
+
+    if (e)
+    {
+        // One request per interval queues the re-check
+        uint64_t now = now_ns();
+        uint64_t checked = atomic_load_explicit(&e->checked_ns, memory_order_relaxed);
+        if (now - checked > CACHE_REVALIDATE_NS &&
+            atomic_compare_exchange_strong_explicit(&e->checked_ns, &checked, now, memory_order_relaxed,
+                                                    memory_order_relaxed))
+            cache_enqueue(CACHE_REVALIDATE, e->url);
+    }
+
+    if (!e)
+    {
+        counter_add(&metrics_self()->cache_misses, 1);
+        return 0;
+    }
+
+    counter_add(&metrics_self()->cache_hits, 1);
+    snprintf(res->path, sizeof(res->path), "%s", e->path);
+    res->cached = e;
+    // 1xx responses exist from HTTP/1.1 on; h2 sends them as HEADERS frames
+    res->links = early_hints && e->links[0] &&
+                         (strcmp(req->protocol, "HTTP/1.1") == 0 || strcmp(req->protocol, "HTTP/2.0") == 0)
+                     ? e->links
+                     : NULL;
+    res->body = e->body;
+    res->size = e->size;
+    res->loaded = e->size;
+    res->status = 200;
+    return 1;
+}
+
+// Value of attribute `name` in the tag [p, end), quoted or not; NULL if
+// the tag does not have it
+const char *html_attr(const char *p, const char *end, const char *name, size_t *len)
+{
+    size_t name_len = strlen(name);
+    for (; p + name_len + 1 < end; p++)
+    {
+        if (!isspace((unsigned char)p[0]) || strncasecmp(p + 1, name, name_len) != 0 || p[1 + name_len] != '=')
+            continue;
+        const char *v = p + name_len + 2;
+        char quote = v < end && (*v == '"' || *v == '\'') ? *v++ : 0;
+        const char *e = v;
+        while (e < end && (quote ? *e != quote : !isspace((unsigned char)*e)))
+            e++;
+        *len = e - v;
+        return v;
+    }
+    return NULL;
+}
+
+// Turns a reference found in the document at `url` into a path on this
+// server. Returns 0, or -1 for other origins (scheme or "//"), traversal
+// and anything that would not survive inside a Link header.
+int preload_target(const char *url, const char *ref, size_t ref_len, char *out, size_t cap)
+{
+    while (ref_len >= 2 && memcmp(ref, "./", 2) == 0)
+    {
+        ref += 2;
+        ref_len -= 2;
+    }
+    const char *hash = memchr(ref, '#', ref_len);
+    if (hash)
+        ref_len = hash - ref;
+    if (ref_len == 0 || (ref_len >= 2 && ref[0] == '/' && ref[1] == '/'))
+        return -1;
+    for (size_t i = 0; i < ref_len; i++)
+    {
+        if (ref[i] == ':' || ref[i] == '<' || ref[i] == '>' || ref[i] == ',' || ref[i] == ';' || ref[i] == '"' ||
+            isspace((unsigned char)ref[i]))
+            return -1;
+    }
+
+    // Relative references resolve against the document's directory
+    int dir_len = ref[0] == '/' ? 0 : (int)(strrchr(url, '/') - url) + 1;
+    if ((size_t)snprintf(out, cap, "%.*s%.*s", dir_len, url, (int)ref_len, ref) >= cap || strstr(out, ".."))
+        return -1;
+    return 0;
+}
+
+// Formats the assets the HTML document at `url` references as a Link
+// header value for 103 Early Hints, e.g.
+// "</site.css>; rel=preload; as=style, </logo.png>; rel=preload; as=image".
+// Only stylesheets, scripts and images on this server count, each once,
+// up to EARLY_HINTS_MAX. Returns how many were found.
+int scan_preload_links(const char *url, const char *html, long size, char *out, size_t cap)
+{
+    static const struct
+    {
+        const char *tag, *attr, *as;
+    } ASSETS[] = {{"link", "href", "style"}, {"script", "src", "script"}, {"img", "src", "image"}};
+
+    const char *end = html + size;
+    size_t len = 0;
+    int n = 0;
+    out[0] = '\0';
+    for (const char *p = html; n < EARLY_HINTS_MAX && p < end && (p = memchr(p, '<', end - p)); p++)
+    {
+        const char *tag_end = memchr(p, '>', end - p);
+        if (!tag_end)
+            break;
+        for (size_t i = 0; i < sizeof(ASSETS) / sizeof(ASSETS[0]); i++)
+        {
+            size_t tag_len = strlen(ASSETS[i].tag), rel_len, ref_len;
+            if (tag_end - p < (long)tag_len + 2 || strncasecmp(p + 1, ASSETS[i].tag, tag_len) != 0 ||
+                !isspace((unsigned char)p[1 + tag_len]))
+                continue;
+
+            // A <link> counts only as a stylesheet
+            const char *rel = html_attr(p, tag_end, "rel", &rel_len);
+            const char *ref = html_attr(p, tag_end, ASSETS[i].attr, &ref_len);
+            char target[256], quoted[260];
+            if (ref && (i != 0 || (rel && rel_len == 10 && strncasecmp(rel, "stylesheet", 10) == 0)) &&
+                preload_target(url, ref, ref_len, target, sizeof(target)) == 0 && strcmp(target, url) != 0)
+            {
+                snprintf(quoted, sizeof(quoted), "<%s>", target);
+                int added = strstr(out, quoted) ? 0
+                                                 : snprintf(out + len, cap - len, "%s%s; rel=preload; as=%s",
+                                                            n ? ", " : "", quoted, ASSETS[i].as);
+                if (added && len + added >= cap)
+                {
+                    out[len] = '\0'; // did not fit; keep the ones before it
+                    return n;
+                }
+                len += added;
+                n += added > 0;
+            }
+            break;
+        }
+        p = tag_end;
+    }
+    return n;
+}
+
+// Adds a copy of a freshly loaded 200 response to the table if there is
+// room, making room by dropping entries whose paths are not in top. Copies
+// the body (or reads it, if the response is to be sent from its file), so
+// the response keeps its own buffer or file either way. Returns the entry
+// with a reference for the caller, or NULL if it was not added.
+struct cache_entry *cache_add(const struct request *req, const struct response *res, const struct hot_path *top,
+                              int n)
+{
+    uint64_t hash = hash_path(req->path);
+    struct stat st;
+    struct cache_entry *e;
+    if (stat(res->path, &st) == -1 || st.st_size != res->size || !(e = malloc(sizeof(*e) + res->size)))
+        return NULL;
+    e->refs = 1;
+    e->checked_ns = now_ns();
+    e->hash = hash;
+    e->mtime = st.st_mtim;
+    snprintf(e->url, sizeof(e->url), "%s", req->path);
+    snprintf(e->path, sizeof(e->path), "%s", res->path);
+    e->size = res->size;
+    if (res->body)
+        memcpy(e->body, res->body, res->size);
+    else if (pread(res->fd, e->body, res->size, 0) != res->size)
+    {
+        free(e);
+        return NULL;
+    }
+    e->links[0] = '\0';
+    if ((early_hints || preload_prefetch) && strcmp(get_content_type(e->path), "text/html") == 0)
+        scan_preload_links(e->url, e->body, e->size, e->links, sizeof(e->links));
+
+    pthread_rwlock_wrlock(&cache.lock);
+    struct cache_entry **bucket = &cache.buckets[hash % CACHE_BUCKETS];
+    int present = 0;
+    for (struct cache_entry *c = *bucket; c && !present; c = c->next)
+        present = c->hash == hash && strcmp(c->url, e->url) == 0;
+
+    // Make room by dropping entries that are no longer hot
+    for (int b = 0; !present && b < CACHE_BUCKETS && cache.bytes + e->size > cache_max_bytes; b++)
+    {
+        struct cache_entry *c = cache.buckets[b];
+        while (c && cache.bytes + e->size > cache_max_bytes)
+        {
+            struct cache_entry *next = c->next;
+            if (!hot_paths_find(top, n, c->hash, c->url))
+                cache_unlink(c);
+            c = next;
+        }
+    }
+
+    struct cache_entry *added = NULL;
+    if (!present && cache.bytes + e->size <= cache_max_bytes)
+    {
+        e->next = *bucket;
+        *bucket = e;
+        cache.bytes += e->size;
+        cache.entries++;
+        atomic_fetch_add(&e->refs, 1);
+        added = e;
+        e = NULL;
+    }
+    pthread_rwlock_unlock(&cache.lock);
+    free(e);
+    return added;
+}
+
+// Cache thread (and cache_warm()): loads the file behind url into the
+// cache, making room among paths not in top. Returns the entry with a
+// reference for the caller, or NULL if it was not added (already cached,
+// not a regular file, too large, no room).
+struct cache_entry *cache_load(const char *url, const char *root_dir, const struct hot_path *top, int n)
+{
+    struct request req = {.method = "GET", .protocol = "HTTP/1.0"};
+    snprintf(req.path, sizeof(req.path), "%s", url);
+    const char *error;
+    if (check_request(&req, &error) != 0 || cache_contains(req.path))
+        return NULL;
+
+    struct response res = {.fd = -1};
+    struct stat st;
+    struct cache_entry *e = NULL;
+    if (resolve_path(&req, root_dir, &res) == 0 && (res.fd = open(res.path, O_RDONLY | O_CLOEXEC)) != -1 &&
+        fstat(res.fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size <= cache_max_bytes)
+    {
+        res.size = st.st_size;
+        res.status = 200;
+        e = cache_add(&req, &res, top, n);
+    }
+    if (res.fd != -1)
+        close(res.fd);
+    return e;
+}
+
+// Loads the assets named in a preload Link header value into the cache
+// (-p), so the requests the Early Hints trigger are hits. They are not hot
+// (yet), so they are the first to go when a hot file needs the room.
+void cache_prefetch(const char *links, const char *root_dir, const struct hot_path *top, int n)
+{
+    for (const char *p = links; (p = strchr(p, '<')); p++)
+    {
+        const char *gt = strchr(p, '>');
+        char url[256];
+        snprintf(url, sizeof(url), "%.*s", (int)(gt - p - 1), p + 1);
+        p = gt;
+
+        struct cache_entry *e = cache_load(url, root_dir, top, n);
+        if (e)
+        {
+            counter_add(&metrics_self()->cache_prefetched, 1);
+            cache_release(e);
+        }
+    }
+}
+
+// Drops the entry for url if its file changed or is gone since it was read
+void cache_revalidate(const char *url)
+{
+    uint64_t hash = hash_path(url);
+    struct cache_entry *e;
+
+    pthread_rwlock_rdlock(&cache.lock);
+    for (e = cache.buckets[hash % CACHE_BUCKETS]; e; e = e->next)
+    {
+        if (e->hash == hash && strcmp(e->url, url) == 0)
+        {
+            atomic_fetch_add(&e->refs, 1);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache.lock);
+    if (!e)
+        return;
+
+    struct stat st;
+    if (stat(e->path, &st) == -1 || st.st_size != e->size || st.st_mtim.tv_sec != e->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != e->mtime.tv_nsec)
+    {
+        pthread_rwlock_wrlock(&cache.lock);
+        cache_unlink(e);
+        pthread_rwlock_unlock(&cache.lock);
+    }
+    cache_release(e);
+}
+
+void *cache_main(void *arg)
+{
+    (void)arg;
+    struct cache_job job;
+
+    while (1)
+    {
+        pthread_mutex_lock(&cache_jobs.lock);
+        while (cache_jobs.count == 0)
+            pthread_cond_wait(&cache_jobs.ready, &cache_jobs.lock);
+        job = cache_jobs.jobs[cache_jobs.head];
+        cache_jobs.head = (cache_jobs.head + 1) % CACHE_QUEUE;
+        cache_jobs.count--;
+        pthread_mutex_unlock(&cache_jobs.lock);
+
+        if (job.kind == CACHE_REVALIDATE)
+        {
+            cache_revalidate(job.url);
+            continue;
+        }
+
+        struct hot_snapshot *hot_now = hot_paths_pin();
+        struct cache_entry *e = cache_load(job.url, cache_jobs.root_dir, hot_now->top, hot_now->n);
+        if (e && preload_prefetch && e->links[0])
+            cache_prefetch(e->links, cache_jobs.root_dir, hot_now->top, hot_now->n);
+        hot_paths_unpin(hot_now);
+        if (e)
+            cache_release(e);
+    }
+
+    return NULL;
+}
+
+void cache_start(const char *root_dir)
+{
+    cache_jobs.root_dir = root_dir;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cache_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+// A freshly loaded response whose path is hot gets its file loaded into
+// the cache by the cache thread; this response keeps its own body or file
+void cache_insert(const struct request *req, const struct response *res)
+{
+    if (!cache_max_bytes || res->status != 200 || res->cached || (size_t)res->size > cache_max_bytes)
+        return;
+
+    struct hot_snapshot *hot_now = hot_paths_pin();
+    int hot_path = hot_paths_find(hot_now->top, hot_now->n, hash_path(req->path), req->path);
+    hot_paths_unpin(hot_now);
+    if (hot_path)
+        cache_enqueue(CACHE_FILL, req->path);
+}
+
+void load_response(const struct request *req, const char *root_dir, struct response *res)
+{
+    res->body = NULL;
+    res->size = 0;
+    res->fd = -1;
+    res->cached = NULL;
+    res->links = NULL;
+    if (cache_max_bytes && cache_lookup(req, res))
+        return;
+
+    phase_begin(res->times, PHASE_RESOLVE);
+    int resolved = resolve_path(req, root_dir, res);
+    phase_end(res->times, PHASE_RESOLVE);
+    if (resolved == -1)
+        return;
+
+    // Open the file; send_loaded_response() sends it with sendfile(), so
+    // the body is never read into this process
+    phase_begin(res->times, PHASE_READ);
+    struct stat st;
+    res->fd = open(res->path, O_RDONLY | O_CLOEXEC);
+    if (res->fd != -1 && (fstat(res->fd, &st) == -1 || !S_ISREG(st.st_mode)))
+    {
+        close(res->fd);
+        res->fd = -1;
+    }
+    phase_end(res->times, PHASE_READ);
+    if (res->fd == -1)
+    {
+        res->status = 404;
+        res->error = "File not found";
+        return;
+    }
+
+    res->size = st.st_size;
+    res->status = 200;
+    cache_insert(req, res);
+}
+
+// -------------------------------------------
+// Probe the page cache before offloading a read
+// -------------------------------------------
+// Reads the file with RWF_NOWAIT, which returns only what is already in the
+// page cache instead of waiting for the disk. Returns 1 when the response is
+// complete (whole file cached, or an error), 0 when the rest of the body
+// still has to be read with finish_load() on an I/O thread. A file over
+// PROBE_MAX_BYTES is not read into memory: it keeps its fd for sendfile(),
+// and only its first PROBE_PREFIX bytes are probed. If they are resident
+// it is served inline (sendfile() may still wait for a later page),
+// otherwise an I/O thread reads it into the page cache first.
+int probe_response(const struct request *req, const char *root_dir, struct response *res)
+{
+    res->body = NULL;
+    res->size = 0;
+    res->loaded = 0;
+    res->fd = -1;
+    res->cached = NULL;
+    res->links = NULL;
+    if (cache_max_bytes && cache_lookup(req, res))
+        return 1;
+
+    phase_begin(res->times, PHASE_RESOLVE);
+    int resolved = resolve_path(req, root_dir, res);
+    phase_end(res->times, PHASE_RESOLVE);
+    if (resolved == -1)
+        return 1;
+
+    // The read phase stays open if the rest goes to an I/O thread
+    phase_begin(res->times, PHASE_READ);
+    struct stat st;
+    int fd = open(res->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        if (fd != -1)
+            close(fd);
+        phase_end(res->times, PHASE_READ);
+        res->status = 404;
+        res->error = "File not found";
+        return 1;
+    }
+
+    res->size = st.st_size;
+    if (res->size > PROBE_MAX_BYTES)
+    {
+        char prefix[PROBE_PREFIX];
+        struct iovec iov = {.iov_base = prefix, .iov_len = sizeof(prefix)};
+        res->fd = fd;
+        if (preadv2(fd, &iov, 1, 0, RWF_NOWAIT) != (ssize_t)sizeof(prefix))
+            return 0;
+        phase_end(res->times, PHASE_READ);
+        res->status = 200;
+        cache_insert(req, res);
+        return 1;
+    }
+
+    if (!(res->body = malloc(res->size + 1)))
+    {
+        close(fd);
+        phase_end(res->times, PHASE_READ);
+        res->status = 500;
+        res->error = "Out of memory";
+        return 1;
+    }
+
+    struct iovec iov = {.iov_base = res->body, .iov_len = res->size};
+    ssize_t n = res->size > 0 ? preadv2(fd, &iov, 1, 0, RWF_NOWAIT) : 0;
+    if (n == res->size)
+    {
+        close(fd);
+        phase_end(res->times, PHASE_READ);
+        res->status = 200;
+        cache_insert(req, res);
+        return 1;
+    }
+
+    // Not (fully) resident, or RWF_NOWAIT unsupported: the rest goes to I/O
+    res->loaded = n > 0 ? n : 0;
+    res->fd = fd;
+    return 0;
+}
+
+// Blocking: read whatever probe_response() could not get from the page cache
+void finish_load(struct response *res)
+{
+    if (!res->body)
+    {
+        // A large file stays a file: bring it into the page cache so the
+        // worker's sendfile() does not wait for the disk
+        readahead(res->fd, 0, res->size);
+        phase_end(res->times, PHASE_READ);
+        res->status = 200;
+        return;
+    }
+
+    while (res->loaded < res->size)
+    {
+        ssize_t n = pread(res->fd, res->body + res->loaded, res->size - res->loaded, res->loaded);
+        if (n <= 0)
+            break;
+        res->loaded += n;
+    }
+
+    close(res->fd);
+    res->fd = -1;
+    phase_end(res->times, PHASE_READ);
+
+    if (res->loaded != res->size)
+    {
+        free(res->body);
+        res->body = NULL;
+        res->status = 404;
+        res->error = "File not found";
+        return;
+    }
+
+    res->status = 200;
+}
+
+// Drops the body: a cache reference, a malloc'd buffer or an open file
+void release_response_body(struct response *res)
+{
+    if (res->cached)
+        cache_release(res->cached);
+    else
+        free(res->body);
+    if (res->fd != -1)
+        close(res->fd);
+    res->cached = NULL;
+    res->body = NULL;
+    res->fd = -1;
+}
+
+// -------------------------------------------
+// Zerocopy completions (-z)
+// -------------------------------------------
+// A body sent with MSG_ZEROCOPY stays pinned until the peer acknowledges
+// it. Rather than have the serving thread wait for that, send_zerocopy()
+// moves the body's reference into a pending entry together with a dup of
+// the socket, and the zerocopy thread reads the completions as they
+// arrive: its epoll set reports a socket when its error queue fills
+// (EPOLLERR needs no subscription). Once every send call is accounted for
+// it releases the body and closes the dup, which is when the connection
+// really closes. An entry still open after ZEROCOPY_WAIT_MS is reset.
+struct zerocopy_pending
+{
+    int fd;                     // dup of the connection, ours until the body is done
+    uint32_t calls;             // zerocopy send calls made
+    uint32_t done;              // of those, completions read
+    int copied;                 // the kernel copied at least one of them
+    uint64_t deadline_ns;
+    struct cache_entry *cached; // the body's cache reference, or NULL
+    char *body;                 // the malloc'd body when not cached
+    struct zerocopy_pending *next;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    struct zerocopy_pending *pending;
+    int epoll_fd;
+} zerocopy = {.lock = PTHREAD_MUTEX_INITIALIZER, .epoll_fd = -1};
+
+// Resets a connection whose zerocopy body the kernel still holds.
+// Disconnecting (connect() to AF_UNSPEC) purges what is still queued, and
+// with it the hold on the pages.
+void zerocopy_reset(int fd)
+{
+    struct sockaddr sa = {.sa_family = AF_UNSPEC};
+    connect(fd, &sa, sizeof(sa));
+    counter_add(&metrics_self()->zerocopy_timeouts, 1);
+}
+
+// Sends the response body with MSG_ZEROCOPY and hands it to the zerocopy
+// thread, which drops it once the kernel is done; returns the bytes sent,
+// or -1 if none were
+long send_zerocopy(int fd, struct response *res)
+{
+    uint32_t calls;
+    long sent = zerocopy_send(fd, res->body, res->size, &calls);
+    if (calls == 0) // nothing pinned: it all went out as a copy, or not at all
+    {
+        counter_add(&metrics_self()->zerocopy_copied, sent > 0);
+        return sent;
+    }
+
+    struct zerocopy_pending *p = malloc(sizeof(*p));
+    int dup_fd = p ? dup(fd) : -1;
+    if (dup_fd == -1)
+    {
+        // Nowhere to park the body: reset rather than free pinned pages
+        free(p);
+        zerocopy_reset(fd);
+        return sent;
+    }
+    *p = (struct zerocopy_pending){
+        .fd = dup_fd,
+        .calls = calls,
+        .deadline_ns = now_ns() + ZEROCOPY_WAIT_MS * 1000000ULL,
+        .cached = res->cached,
+        .body = res->cached ? NULL : res->body,
+    };
+    res->cached = NULL;
+    res->body = NULL;
+    // The caller's close() leaves the dup open: end the stream now so the
+    // client is not kept waiting for the completions
+    shutdown(fd, SHUT_WR);
+
+    struct epoll_event ev = {.events = EPOLLET, .data.ptr = p};
+    pthread_mutex_lock(&zerocopy.lock);
+    p->next = zerocopy.pending;
+    zerocopy.pending = p;
+    epoll_ctl(zerocopy.epoll_fd, EPOLL_CTL_ADD, dup_fd, &ev);
+    pthread_mutex_unlock(&zerocopy.lock);
+    return sent;
+}
+
+void *zerocopy_main(void *arg)
+{
+    (void)arg;
+    struct epoll_event events[64];
+    struct metrics *m = metrics_self();
+
+    while (1)
+    {
+        int n = epoll_wait(zerocopy.epoll_fd, events, 64, 100);
+        pthread_mutex_lock(&zerocopy.lock);
+        for (int i = 0; i < n; i++)
+        {
+            struct zerocopy_pending *p = events[i].data.ptr;
+            zerocopy_drain(p->fd, &p->done, &p->copied);
+        }
+
+        // Finish what is complete or overdue
+        uint64_t now = now_ns();
+        struct zerocopy_pending **link = &zerocopy.pending;
+        while (*link)
+        {
+            struct zerocopy_pending *p = *link;
+            if (p->done < p->calls && now < p->deadline_ns)
+            {
+                link = &p->next;
+                continue;
+            }
+            *link = p->next;
+            epoll_ctl(zerocopy.epoll_fd, EPOLL_CTL_DEL, p->fd, NULL);
+            if (p->done < p->calls)
+                zerocopy_reset(p->fd);
+            else if (p->copied)
+                counter_add(&m->zerocopy_copied, 1);
+            else
+                counter_add(&m->zerocopy_sends, 1);
+            if (p->cached)
+                cache_release(p->cached);
+            else
+                free(p->body);
+            close(p->fd);
+            free(p);
+        }
+        pthread_mutex_unlock(&zerocopy.lock);
+    }
+
+    return NULL;
+}
+
+void zerocopy_start(void)
+{
+    zerocopy.epoll_fd = epoll_create1(0);
+    if (zerocopy.epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, zerocopy_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+// -------------------------------------------
+// Send a loaded response (frees its body, returns bytes sent)
+// -------------------------------------------
+long send_loaded_response(int new_fd, struct response *res)
+{
+    long total = 0;
+    phase_begin(res->times, PHASE_SEND);
+
+    if (res->status != 200)
+    {
+        total = send_error(new_fd, res->status, res->error);
+        phase_end(res->times, PHASE_SEND);
+        return total;
+    }
+
+    // Send the file with correct Content-Type
+    const char *content_type = get_content_type(res->path);
+    char header[512];
+    ssize_t sent;
+    // After a 103 the final response must carry the same version; it still
+    // closes the connection, which HTTP/1.1 has to be told
+    int header_len = snprintf(header, sizeof(header),
+                              "%s 200 OK\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %ld\r\n"
+                              "%s"
+                              "\r\n",
+                              res->links ? "HTTP/1.1" : "HTTP/1.0", content_type, res->size,
+                              res->links ? "Connection: close\r\n" : "");
+
+    HTTPD_PROBE3(response_start, new_fd, 200, res->size);
+    socket_tune_send(new_fd, res->size);
+
+    // A cached HTML document first names the assets it needs, so the client
+    // can fetch them while it receives this one
+    if (res->links)
+    {
+        char hints[EARLY_HINTS_LINKS + 64];
+        int hints_len = snprintf(hints, sizeof(hints), "HTTP/1.1 103 Early Hints\r\nLink: %s\r\n\r\n", res->links);
+        if ((sent = io_send(new_fd, hints, hints_len, 0)) > 0)
+        {
+            total += sent;
+            counter_add(&metrics_self()->early_hints, 1);
+        }
+    }
+
+    // Send header + body; a body still in its file goes out with sendfile()
+    sent = io_send(new_fd, header, header_len, 0);
+    if (sent > 0)
+        total += sent;
+    if (res->times)
+        res->times->headers_ns = now_ns();
+
+    if (!res->body)
+        total += io_sendfile(new_fd, res->fd, 0, res->size);
+    else if ((sent = zerocopy_min && res->size >= zerocopy_min && !tls_enabled
+                         ? send_zerocopy(new_fd, res)
+                         : io_send(new_fd, res->body, res->size, 0)) == -1)
+        total += send_error(new_fd, 500, "Failed to send response body");
+    else
+        total += sent;
+
+    release_response_body(res);
+    phase_end(res->times, PHASE_SEND);
+    return total;
+}
+
+// -------------------------------------------
+// Serve a parsed request (does not close the connection)
+// -------------------------------------------
+// Returns bytes sent and sets *status to the status answered with.
+long serve_request(int new_fd, const struct request *req, const char *root_dir, int *status,
+                   struct phase_times *times)
+{
+    struct response res;
+    res.times = times;
+    load_response(req, root_dir, &res);
+    *status = res.status;
+    return send_loaded_response(new_fd, &res);
+}
+
+// Loads the hot paths read by hot_paths_load() into the content cache, so a
+// restarted server serves them from memory from the first request
+void cache_warm(const char *root_dir)
+{
+    struct hot_path top[HOT_K];
+    int n = hot_paths_snapshot(top);
+    int warmed = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        struct cache_entry *e = cache_load(top[i].path, root_dir, top, n);
+        if (!e)
+            continue;
+        warmed++;
+        if (preload_prefetch && e->links[0])
+            cache_prefetch(e->links, root_dir, top, n);
+        cache_release(e);
+    }
+    printf("🔥 Warmed %d of %d hot paths into the cache (%zu bytes)\n", warmed, n, cache.bytes);
+}
+
+// -------------------------------------------
+// Internal endpoints: /__stats (JSON), /__stats/prometheus, /__trace
+// -------------------------------------------
+// Merges every thread's metrics at read time. Only answered for loopback
+// peers; anyone else falls through to normal file lookup.
+struct strbuf
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+void sb_printf(struct strbuf *sb, const char *fmt, ...)
+{
+    while (1)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0)
+            return;
+        if (sb->len + n < sb->cap)
+        {
+            sb->len += n;
+            return;
+        }
+
+        size_t cap = sb->cap ? sb->cap * 2 : 4096;
+        while (cap <= sb->len + n)
+            cap *= 2;
+        char *data = realloc(sb->data, cap);
+        if (!data)
+            return;
+        sb->data = data;
+        sb->cap = cap;
+    }
+}
+
+int is_loopback_peer(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) == -1)
+        return 0;
+
+    if (addr.ss_family == AF_INET)
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    if (addr.ss_family == AF_INET6)
+    {
+        struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+void sb_json_string(struct strbuf *sb, const char *str)
+{
+    sb_printf(sb, "\"");
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            sb_printf(sb, "\\%c", *c);
+        else if (*c < 0x20)
+            sb_printf(sb, "\\u%04x", *c);
+        else
+            sb_printf(sb, "%c", *c);
+    }
+    sb_printf(sb, "\"");
+}
+
+void render_stats_json(struct strbuf *sb, struct metrics *m)
+{
+    uint64_t total = 0;
+    sb_printf(sb, "{\n  \"requests\": {");
+    for (int s = 0; s < STATUS_SLOTS; s++)
+    {
+        total += counter_read(&m->requests[s]);
+        sb_printf(sb, "%s\"%s\": %llu", s ? ", " : "", STATUS_LABELS[s],
+                  (unsigned long long)counter_read(&m->requests[s]));
+    }
+    sb_printf(sb, "},\n");
+    sb_printf(sb, "  \"requests_total\": %llu,\n", (unsigned long long)total);
+    sb_printf(sb, "  \"bytes_sent\": %llu,\n", (unsigned long long)counter_read(&m->bytes_sent));
+    sb_printf(sb, "  \"open_connections\": %lld,\n",
+              (long long)(counter_read(&m->conns_opened) - counter_read(&m->conns_closed)));
+    sb_printf(sb, "  \"page_cache\": {\"inline\": %llu, \"offloaded\": %llu},\n",
+              (unsigned long long)counter_read(&m->pagecache_inline),
+              (unsigned long long)counter_read(&m->pagecache_offloaded));
+
+    sb_printf(sb, "  \"access_log\": {\"written\": %llu, \"dropped\": %llu},\n",
+              (unsigned long long)counter_read(&m->log_written),
+              (unsigned long long)counter_read(&m->log_dropped));
+    sb_printf(sb,
+              "  \"http2\": {\"connections\": %llu, \"connections_refused\": %llu, \"streams\": %llu,"
+              " \"streams_refused\": %llu},\n",
+              (unsigned long long)counter_read(&m->h2_connections),
+              (unsigned long long)counter_read(&m->h2_refused),
+              (unsigned long long)counter_read(&m->h2_streams),
+              (unsigned long long)counter_read(&m->h2_streams_refused));
+    sb_printf(sb, "  \"zerocopy\": {\"sends\": %llu, \"copied\": %llu, \"timeouts\": %llu},\n",
+              (unsigned long long)counter_read(&m->zerocopy_sends),
+              (unsigned long long)counter_read(&m->zerocopy_copied),
+              (unsigned long long)counter_read(&m->zerocopy_timeouts));
+    sb_printf(sb, "  \"send_timeouts\": %llu,\n", (unsigned long long)counter_read(&m->send_timeouts));
+    if (socket_profile)
+    {
+        struct histogram *rtt = &m->tcp_rtt;
+        sb_printf(sb, "  \"tcp\": {\"profile\": \"%s\", \"sampled\": %llu, \"retransmitted_segments\": %llu, "
+                      "\"retransmitting_conns\": %llu, \"sndbuf_raised\": %llu, "
+                      "\"rtt_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}},\n",
+                  socket_profile->name, (unsigned long long)counter_read(&m->tcp_sampled),
+                  (unsigned long long)counter_read(&m->tcp_retrans),
+                  (unsigned long long)counter_read(&m->tcp_retrans_conns),
+                  (unsigned long long)counter_read(&m->tcp_sndbuf_raised), histogram_quantile(rtt, 0.50) / 1e3,
+                  histogram_quantile(rtt, 0.99) / 1e3, counter_read(&rtt->max) / 1e3);
+    }
+    sb_printf(sb, "  \"capture\": {\"written\": %llu, \"dropped\": %llu},\n",
+              (unsigned long long)counter_read(&m->capture_written),
+              (unsigned long long)counter_read(&m->capture_dropped));
+#ifdef ALLOC_TRACKING
+    sb_printf(sb, "  \"allocations\": {\"requests\": %llu, \"allocs\": %llu},\n",
+              (unsigned long long)counter_read(&m->alloc_requests),
+              (unsigned long long)counter_read(&m->allocs));
+#endif
+#ifdef WITH_TLS
+    sb_printf(sb, "  \"tls\": {\"handshakes\": %llu, \"resumed\": %llu, \"failed\": %llu, "
+                  "\"ktls_send\": %llu, \"ktls_recv\": %llu},\n",
+              (unsigned long long)counter_read(&m->tls_handshakes),
+              (unsigned long long)counter_read(&m->tls_resumed),
+              (unsigned long long)counter_read(&m->tls_failed),
+              (unsigned long long)counter_read(&m->tls_ktls_send),
+              (unsigned long long)counter_read(&m->tls_ktls_recv));
+#endif
+
+    pthread_rwlock_rdlock(&cache.lock);
+    int cache_entries = cache.entries;
+    size_t cache_bytes = cache.bytes;
+    pthread_rwlock_unlock(&cache.lock);
+    sb_printf(sb, "  \"content_cache\": {\"entries\": %d, \"bytes\": %zu, \"max_bytes\": %zu, "
+                  "\"hits\": %llu, \"misses\": %llu, \"prefetched\": %llu},\n",
+              cache_entries, cache_bytes, cache_max_bytes, (unsigned long long)counter_read(&m->cache_hits),
+              (unsigned long long)counter_read(&m->cache_misses),
+              (unsigned long long)counter_read(&m->cache_prefetched));
+    sb_printf(sb, "  \"early_hints\": %llu,\n", (unsigned long long)counter_read(&m->early_hints));
+
+    // Estimated recent requests per hot path (decayed, never under-counted)
+    struct hot_path top[HOT_K];
+    int n = hot_paths_snapshot(top);
+    sb_printf(sb, "  \"hot_paths\": [");
+    for (int i = 0; i < n; i++)
+    {
+        sb_printf(sb, "%s\n    {\"path\": ", i ? "," : "");
+        sb_json_string(sb, top[i].path);
+        sb_printf(sb, ", \"count\": %llu}", (unsigned long long)top[i].count);
+    }
+    sb_printf(sb, "%s],\n", n ? "\n  " : "");
+
+    struct histogram *h = &m->latency;
+    uint64_t count = counter_read(&h->count);
+    sb_printf(sb, "  \"latency_us\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, "
+                  "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n",
+              (unsigned long long)count, count ? counter_read(&h->sum) / 1e3 / count : 0.0,
+              histogram_quantile(h, 0.50) / 1e3, histogram_quantile(h, 0.90) / 1e3,
+              histogram_quantile(h, 0.99) / 1e3, histogram_quantile(h, 0.999) / 1e3,
+              counter_read(&h->max) / 1e3);
+
+    sb_printf(sb, "  \"phases_us\": {\n");
+    for (int p = 0; p < PHASES; p++)
+    {
+        h = &m->phases[p];
+        sb_printf(sb, "    \"%s\": {\"count\": %llu, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}%s\n",
+                  PHASE_NAMES[p], (unsigned long long)counter_read(&h->count),
+                  histogram_quantile(h, 0.50) / 1e3, histogram_quantile(h, 0.99) / 1e3,
+                  counter_read(&h->max) / 1e3, p == PHASES - 1 ? "" : ",");
+    }
+    sb_printf(sb, "  },\n");
+
+    // Hardware counters: averages per counted phase, and their sum as the
+    // cost of a whole request
+    if (perf_enabled)
+    {
+        double request[PERF_COUNTERS] = {0};
+        sb_printf(sb, "  \"hw_counters\": {\n");
+        for (int p = 0; p < PHASES; p++)
+        {
+            uint64_t samples = counter_read(&m->perf_samples[p]);
+            if (!(PERF_PHASE_MASK >> p & 1))
+                continue;
+
+            double avg[PERF_COUNTERS];
+            for (int e = 0; e < PERF_COUNTERS; e++)
+            {
+                avg[e] = samples ? (double)counter_read(&m->perf[p][e]) / samples : 0.0;
+                request[e] += avg[e];
+            }
+            sb_printf(sb, "    \"%s\": {\"samples\": %llu, ", PHASE_NAMES[p], (unsigned long long)samples);
+            for (int e = 0; e < PERF_COUNTERS; e++)
+                sb_printf(sb, "\"%s\": %.0f, ", PERF_COUNTER_NAMES[e], avg[e]);
+            sb_printf(sb, "\"ipc\": %.2f},\n",
+                      avg[PERF_CYCLES] ? avg[PERF_INSTRUCTIONS] / avg[PERF_CYCLES] : 0.0);
+        }
+        sb_printf(sb, "    \"request\": {");
+        for (int e = 0; e < PERF_COUNTERS; e++)
+            sb_printf(sb, "\"%s\": %.0f, ", PERF_COUNTER_NAMES[e], request[e]);
+        sb_printf(sb, "\"ipc\": %.2f}\n  },\n",
+                  request[PERF_CYCLES] ? request[PERF_INSTRUCTIONS] / request[PERF_CYCLES] : 0.0);
+    }
+    sb_printf(sb, "  \"threads\": %d\n}\n", atomic_load(&metrics_count));
+}
+
+// Power-of-two bucket bounds from 1 us up: each is exact, since the
+// histogram's sub-buckets never straddle a power of two
+void render_prometheus_histogram(struct strbuf *sb, const char *name, const char *labels,
+                                 struct histogram *h)
+{
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+    int b = 0;
+    for (int exp = 10; exp <= HIST_MAX_EXP; exp++)
+    {
+        int end = exp == HIST_MAX_EXP ? HIST_BUCKETS : histogram_bucket(1ULL << exp);
+        for (; b < end; b++)
+            cumulative += counter_read(&h->buckets[b]);
+        sb_printf(sb, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep,
+                  (double)(1ULL << exp) / 1e9, (unsigned long long)cumulative);
+    }
+    sb_printf(sb, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+              (unsigned long long)counter_read(&h->count));
+    sb_printf(sb, "%s_sum%s%s%s %.9f\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "",
+              counter_read(&h->sum) / 1e9);
+    sb_printf(sb, "%s_count%s%s%s %llu\n", name, sep[0] ? "{" : "", labels, sep[0] ? "}" : "",
+              (unsigned long long)counter_read(&h->count));
+}
+
+void render_stats_prometheus(struct strbuf *sb, struct metrics *m)
+{
+    sb_printf(sb, "# HELP http_requests_total Requests answered, by status code.\n"
+                  "# TYPE http_requests_total counter\n");
+    for (int s = 0; s < STATUS_SLOTS; s++)
+        sb_printf(sb, "http_requests_total{code=\"%s\"} %llu\n", STATUS_LABELS[s],
+                  (unsigned long long)counter_read(&m->requests[s]));
+
+    sb_printf(sb, "# HELP http_response_bytes_total Bytes written to clients.\n"
+                  "# TYPE http_response_bytes_total counter\n"
+                  "http_response_bytes_total %llu\n",
+              (unsigned long long)counter_read(&m->bytes_sent));
+    sb_printf(sb, "# HELP http_open_connections Connections accepted and not yet closed.\n"
+                  "# TYPE http_open_connections gauge\n"
+                  "http_open_connections %lld\n",
+              (long long)(counter_read(&m->conns_opened) - counter_read(&m->conns_closed)));
+    sb_printf(sb, "# HELP http_file_reads_total File reads, by where the data came from.\n"
+                  "# TYPE http_file_reads_total counter\n"
+                  "http_file_reads_total{source=\"page_cache\"} %llu\n"
+                  "http_file_reads_total{source=\"io_thread\"} %llu\n",
+              (unsigned long long)counter_read(&m->pagecache_inline),
+              (unsigned long long)counter_read(&m->pagecache_offloaded));
+    sb_printf(sb, "# HELP http_access_log_records_total Access log records, by outcome.\n"
+                  "# TYPE http_access_log_records_total counter\n"
+                  "http_access_log_records_total{outcome=\"written\"} %llu\n"
+                  "http_access_log_records_total{outcome=\"dropped\"} %llu\n",
+              (unsigned long long)counter_read(&m->log_written),
+              (unsigned long long)counter_read(&m->log_dropped));
+    sb_printf(sb, "# HELP http2_connections_total Connections that spoke HTTP/2.\n"
+                  "# TYPE http2_connections_total counter\n"
+                  "http2_connections_total %llu\n"
+                  "# HELP http2_connections_refused_total HTTP/2 connections turned away, every HTTP/2 thread busy.\n"
+                  "# TYPE http2_connections_refused_total counter\n"
+                  "http2_connections_refused_total %llu\n"
+                  "# HELP http2_streams_total Requests answered over HTTP/2.\n"
+                  "# TYPE http2_streams_total counter\n"
+                  "http2_streams_total %llu\n"
+                  "# HELP http2_streams_refused_total HTTP/2 streams refused by the concurrency limiter.\n"
+                  "# TYPE http2_streams_refused_total counter\n"
+                  "http2_streams_refused_total %llu\n",
+              (unsigned long long)counter_read(&m->h2_connections),
+              (unsigned long long)counter_read(&m->h2_refused),
+              (unsigned long long)counter_read(&m->h2_streams),
+              (unsigned long long)counter_read(&m->h2_streams_refused));
+    sb_printf(sb, "# HELP http_zerocopy_sends_total Bodies sent with MSG_ZEROCOPY (-z), by outcome.\n"
+                  "# TYPE http_zerocopy_sends_total counter\n"
+                  "http_zerocopy_sends_total{outcome=\"zerocopy\"} %llu\n"
+                  "http_zerocopy_sends_total{outcome=\"copied\"} %llu\n"
+                  "http_zerocopy_sends_total{outcome=\"timeout\"} %llu\n",
+              (unsigned long long)counter_read(&m->zerocopy_sends),
+              (unsigned long long)counter_read(&m->zerocopy_copied),
+              (unsigned long long)counter_read(&m->zerocopy_timeouts));
+    sb_printf(sb, "# HELP http_send_timeouts_total Connections reset after a client took no response bytes for %d s.\n"
+                  "# TYPE http_send_timeouts_total counter\n"
+                  "http_send_timeouts_total %llu\n",
+              SEND_TIMEOUT_MS / 1000, (unsigned long long)counter_read(&m->send_timeouts));
+    if (socket_profile)
+    {
+        sb_printf(sb, "# HELP http_tcp_sampled_connections_total Connections whose TCP_INFO was read at close.\n"
+                      "# TYPE http_tcp_sampled_connections_total counter\n"
+                      "http_tcp_sampled_connections_total %llu\n"
+                      "# HELP http_tcp_retransmitted_segments_total Segments those connections retransmitted.\n"
+                      "# TYPE http_tcp_retransmitted_segments_total counter\n"
+                      "http_tcp_retransmitted_segments_total %llu\n"
+                      "# HELP http_tcp_retransmitting_connections_total Sampled connections that retransmitted.\n"
+                      "# TYPE http_tcp_retransmitting_connections_total counter\n"
+                      "http_tcp_retransmitting_connections_total %llu\n"
+                      "# HELP http_tcp_sndbuf_raised_total Large responses whose send buffer was sized from TCP_INFO.\n"
+                      "# TYPE http_tcp_sndbuf_raised_total counter\n"
+                      "http_tcp_sndbuf_raised_total %llu\n"
+                      "# HELP http_tcp_rtt_seconds Smoothed RTT of each sampled connection at close.\n"
+                      "# TYPE http_tcp_rtt_seconds histogram\n",
+                  (unsigned long long)counter_read(&m->tcp_sampled),
+                  (unsigned long long)counter_read(&m->tcp_retrans),
+                  (unsigned long long)counter_read(&m->tcp_retrans_conns),
+                  (unsigned long long)counter_read(&m->tcp_sndbuf_raised));
+        render_prometheus_histogram(sb, "http_tcp_rtt_seconds", "", &m->tcp_rtt);
+    }
+    sb_printf(sb, "# HELP http_capture_chunks_total Captured request chunks (-r), by outcome.\n"
+                  "# TYPE http_capture_chunks_total counter\n"
+                  "http_capture_chunks_total{outcome=\"written\"} %llu\n"
+                  "http_capture_chunks_total{outcome=\"dropped\"} %llu\n",
+              (unsigned long long)counter_read(&m->capture_written),
+              (unsigned long long)counter_read(&m->capture_dropped));
+#ifdef ALLOC_TRACKING
+    sb_printf(sb, "# HELP http_request_allocations_total Heap allocations made while serving requests.\n"
+                  "# TYPE http_request_allocations_total counter\n"
+                  "http_request_allocations_total %llu\n"
+                  "# HELP http_allocation_tracked_requests_total Requests those allocations belong to.\n"
+                  "# TYPE http_allocation_tracked_requests_total counter\n"
+                  "http_allocation_tracked_requests_total %llu\n",
+              (unsigned long long)counter_read(&m->allocs),
+              (unsigned long long)counter_read(&m->alloc_requests));
+#endif
+#ifdef WITH_TLS
+    uint64_t resumed = counter_read(&m->tls_resumed);
+    sb_printf(sb, "# HELP http_tls_handshakes_total TLS handshakes, by result.\n"
+                  "# TYPE http_tls_handshakes_total counter\n"
+                  "http_tls_handshakes_total{result=\"full\"} %llu\n"
+                  "http_tls_handshakes_total{result=\"resumed\"} %llu\n"
+                  "http_tls_handshakes_total{result=\"failed\"} %llu\n"
+                  "# HELP http_tls_ktls_connections_total TLS connections offloaded to kernel TLS, by direction.\n"
+                  "# TYPE http_tls_ktls_connections_total counter\n"
+                  "http_tls_ktls_connections_total{direction=\"send\"} %llu\n"
+                  "http_tls_ktls_connections_total{direction=\"recv\"} %llu\n",
+              (unsigned long long)(counter_read(&m->tls_handshakes) - resumed), (unsigned long long)resumed,
+              (unsigned long long)counter_read(&m->tls_failed),
+              (unsigned long long)counter_read(&m->tls_ktls_send),
+              (unsigned long long)counter_read(&m->tls_ktls_recv));
+#endif
+    sb_printf(sb, "# HELP http_content_cache_requests_total Content cache lookups, by result.\n"
+                  "# TYPE http_content_cache_requests_total counter\n"
+                  "http_content_cache_requests_total{result=\"hit\"} %llu\n"
+                  "http_content_cache_requests_total{result=\"miss\"} %llu\n",
+              (unsigned long long)counter_read(&m->cache_hits),
+              (unsigned long long)counter_read(&m->cache_misses));
+    sb_printf(sb, "# HELP http_content_cache_prefetched_total Assets loaded into the cache because a document preloads them.\n"
+                  "# TYPE http_content_cache_prefetched_total counter\n"
+                  "http_content_cache_prefetched_total %llu\n"
+                  "# HELP http_early_hints_total 103 Early Hints responses sent.\n"
+                  "# TYPE http_early_hints_total counter\n"
+                  "http_early_hints_total %llu\n",
+              (unsigned long long)counter_read(&m->cache_prefetched),
+              (unsigned long long)counter_read(&m->early_hints));
+    pthread_rwlock_rdlock(&cache.lock);
+    size_t cache_bytes = cache.bytes;
+    pthread_rwlock_unlock(&cache.lock);
+    sb_printf(sb, "# HELP http_content_cache_bytes Bytes of file content pinned in memory.\n"
+                  "# TYPE http_content_cache_bytes gauge\n"
+                  "http_content_cache_bytes %zu\n",
+              cache_bytes);
+
+    struct hot_path top[HOT_K];
+    int n = hot_paths_snapshot(top);
+    sb_printf(sb, "# HELP http_hot_path_requests Estimated recent requests for the hottest paths (decayed).\n"
+                  "# TYPE http_hot_path_requests gauge\n");
+    for (int i = 0; i < n; i++)
+    {
+        sb_printf(sb, "http_hot_path_requests{path=\"");
+        for (const char *c = top[i].path; *c; c++)
+            sb_printf(sb, *c == '"' || *c == '\\' ? "\\%c" : *c == '\n' ? "\\n" : "%c", *c);
+        sb_printf(sb, "\"} %llu\n", (unsigned long long)top[i].count);
+    }
+
+    sb_printf(sb, "# HELP http_request_duration_seconds Time from accept to response sent.\n"
+                  "# TYPE http_request_duration_seconds histogram\n");
+    render_prometheus_histogram(sb, "http_request_duration_seconds", "", &m->latency);
+
+    sb_printf(sb, "# HELP http_request_phase_seconds Time spent in each phase of a request.\n"
+                  "# TYPE http_request_phase_seconds histogram\n");
+    for (int p = 0; p < PHASES; p++)
+    {
+        char label[32];
+        snprintf(label, sizeof(label), "phase=\"%s\"", PHASE_NAMES[p]);
+        render_prometheus_histogram(sb, "http_request_phase_seconds", label, &m->phases[p]);
+    }
+
+    if (!perf_enabled)
+        return;
+    sb_printf(sb, "# HELP http_request_phase_hw_events_total Hardware counter totals, by phase and event.\n"
+                  "# TYPE http_request_phase_hw_events_total counter\n");
+    for (int p = 0; p < PHASES; p++)
+        for (int e = 0; PERF_PHASE_MASK >> p & 1 && e < PERF_COUNTERS; e++)
+            sb_printf(sb, "http_request_phase_hw_events_total{phase=\"%s\",event=\"%s\"} %llu\n",
+                      PHASE_NAMES[p], PERF_COUNTER_NAMES[e], (unsigned long long)counter_read(&m->perf[p][e]));
+    sb_printf(sb, "# HELP http_request_phase_hw_samples_total Phases covered by the hardware counter totals.\n"
+                  "# TYPE http_request_phase_hw_samples_total counter\n");
+    for (int p = 0; p < PHASES; p++)
+        if (PERF_PHASE_MASK >> p & 1)
+            sb_printf(sb, "http_request_phase_hw_samples_total{phase=\"%s\"} %llu\n", PHASE_NAMES[p],
+                      (unsigned long long)counter_read(&m->perf_samples[p]));
+}
+
+// Sampled requests as Chrome Trace Event JSON (load in chrome://tracing or
+// Perfetto): one complete event per phase, on the thread that ran it
+void render_trace(struct strbuf *sb)
+{
+    int first = 1;
+    int n = atomic_load(&metrics_count);
+    if (n > MAX_METRICS_THREADS)
+        n = MAX_METRICS_THREADS;
+
+    sb_printf(sb, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    for (int t = 0; t < n; t++)
+    {
+        struct trace_ring *r = atomic_load_explicit((_Atomic(struct trace_ring *) *)&trace_rings[t],
+                                                    memory_order_acquire);
+        if (!r)
+            continue;
+
+        for (int i = 0; i < TRACE_RING_SIZE; i++)
+        {
+            struct trace_sample *s = &r->samples[i];
+            uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+            if (seq == 0 || (seq & 1))
+                continue;
+
+            struct trace_sample copy;
+            memcpy(&copy.times, &s->times, sizeof(copy.times));
+            memcpy(copy.path, s->path, sizeof(copy.path));
+            copy.status = s->status;
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq)
+                continue; // overwritten while we copied it
+            copy.path[sizeof(copy.path) - 1] = '\0';
+
+            for (int p = 0; p < PHASES; p++)
+            {
+                if (!copy.times.begin[p] || copy.times.end[p] < copy.times.begin[p])
+                    continue;
+                sb_printf(sb, "%s\n{\"name\": \"%s\", \"cat\": \"http\", \"ph\": \"X\", \"pid\": 1, "
+                              "\"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"status\": %u, \"path\": ",
+                          first ? "" : ",", PHASE_NAMES[p], copy.times.thread[p],
+                          ticks_to_ns(copy.times.begin[p] - ticks_epoch) / 1e3,
+                          ticks_to_ns(copy.times.end[p] - copy.times.begin[p]) / 1e3, copy.status);
+                sb_json_string(sb, copy.path);
+                sb_printf(sb, "}}");
+                first = 0;
+            }
+        }
+    }
+    sb_printf(sb, "\n]}\n");
+}
+
+// Renders the stats endpoint req asks for into sb and sets its content
+// type. Returns 200, 500 if out of memory, or -1 when req is not for a
+// stats endpoint (or the peer is not on loopback) and is served as a file.
+int render_stats(int fd, const struct request *req, struct strbuf *sb, const char **content_type)
+{
+    enum
+    {
+        STATS_JSON,
+        STATS_PROMETHEUS,
+        STATS_TRACE
+    } kind;
+
+    if (strcmp(req->path, "/__stats") == 0)
+        kind = STATS_JSON;
+    else if (strcmp(req->path, "/__stats/prometheus") == 0)
+        kind = STATS_PROMETHEUS;
+    else if (strcmp(req->path, "/__trace") == 0)
+        kind = STATS_TRACE;
+    else
+        return -1;
+
+    if (!is_loopback_peer(fd))
+        return -1;
+
+    *content_type = kind == STATS_PROMETHEUS ? "text/plain; version=0.0.4" : "application/json";
+    if (kind == STATS_TRACE)
+    {
+        render_trace(sb);
+    }
+    else
+    {
+        struct metrics *merged = malloc(sizeof(*merged));
+        if (!merged)
+            return 500;
+
+        metrics_merge(merged);
+        if (kind == STATS_PROMETHEUS)
+            render_stats_prometheus(sb, merged);
+        else
+            render_stats_json(sb, merged);
+        free(merged);
+    }
+    return 200;
+}
+
+// Returns bytes sent, or -1 if this is not an internal request we answer
+long serve_stats(int fd, const struct request *req)
+{
+    struct strbuf sb = {0};
+    const char *content_type;
+    int status = render_stats(fd, req, &sb, &content_type);
+    if (status == -1)
+        return -1;
+    if (status != 200)
+        return send_error(fd, 500, "Out of memory");
+
+    long sent = send_response(fd, 200, "OK", content_type, sb.data ? sb.data : "");
+    free(sb.data);
+    return sent;
+}
+
+// -------------------------------------------
+// Overload control: bounded accept queue
+// -------------------------------------------
+struct pending_conn
+{
+    int fd;
+    uint64_t accepted_ns; // when the connection left the kernel backlog
+};
+
+struct accept_queue
+{
+    struct pending_conn items[ACCEPT_QUEUE_MAX];
+    unsigned head;
+    unsigned count;
+    unsigned capacity;
+};
+
+int accept_queue_push(struct accept_queue *q, int fd, uint64_t accepted_ns)
+{
+    if (q->count == q->capacity)
+        return -1;
+
+    struct pending_conn *slot = &q->items[(q->head + q->count) % ACCEPT_QUEUE_MAX];
+    slot->fd = fd;
+    slot->accepted_ns = accepted_ns;
+    q->count++;
+    return 0;
+}
+
+int accept_queue_pop(struct accept_queue *q, struct pending_conn *out)
+{
+    if (q->count == 0)
+        return -1;
+
+    *out = q->items[q->head];
+    q->head = (q->head + 1) % ACCEPT_QUEUE_MAX;
+    q->count--;
+    return 0;
+}
+
+// -------------------------------------------
+// Overload control: AIMD concurrency limiter
+// -------------------------------------------
+// The limit caps how many connections may be in the system (queued or
+// being served). Every completed request feeds back its latency: below
+// target the limit grows by ~1 per window, above target it backs off.
+struct limiter
+{
+    _Atomic double limit; // updated by every worker in pool mode
+    double max_limit;
+    uint64_t target_ns;
+};
+
+void limiter_init(struct limiter *l, unsigned max_limit)
+{
+    atomic_init(&l->limit, max_limit);
+    l->max_limit = max_limit;
+    l->target_ns = LIMITER_TARGET_NS;
+}
+
+int limiter_admit(struct limiter *l, unsigned in_flight)
+{
+    return in_flight < (unsigned)atomic_load_explicit(&l->limit, memory_order_relaxed);
+}
+
+void limiter_on_sample(struct limiter *l, uint64_t latency_ns)
+{
+    double old = atomic_load_explicit(&l->limit, memory_order_relaxed);
+    double limit;
+
+    do
+    {
+        if (latency_ns <= l->target_ns)
+            limit = old + 1.0 / old;
+        else
+            limit = old * LIMITER_BACKOFF;
+
+        if (limit < LIMITER_MIN)
+            limit = LIMITER_MIN;
+        if (limit > l->max_limit)
+            limit = l->max_limit;
+    } while (!atomic_compare_exchange_weak_explicit(&l->limit, &old, limit,
+                                                    memory_order_relaxed, memory_order_relaxed));
+}
+
+// The latency a request feeds back: from when it was ready to be served
+// until its response headers were written. Draining a large body to a slow
+// reader, or waiting in the accept queue, is not time this server spent.
+// Responses that do not stamp the headers (errors, stats) are small, so
+// they count whole.
+uint64_t limiter_latency(const struct phase_times *t, uint64_t ready_ns)
+{
+    return (t->headers_ns ? t->headers_ns : now_ns()) - ready_ns;
+}
+
+// -------------------------------------------
+// Overload control: CoDel queue management
+// -------------------------------------------
+// Decides at dequeue time whether the head of the queue waited too long.
+// Follows the control law from "Controlling Queue Delay" (Nichols/Jacobson):
+// once in the dropping state, drops are spaced by INTERVAL / sqrt(count).
+struct codel
+{
+    uint64_t first_above_ns; // 0 while sojourn time is below target
+    uint64_t drop_next_ns;
+    uint32_t drop_count;
+    int dropping;
+};
+
+uint32_t isqrt32(uint32_t n)
+{
+    uint32_t x = n, y = (n + 1) / 2;
+    while (y < x)
+    {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+uint64_t codel_control_law(uint64_t t, uint32_t count)
+{
+    return t + CODEL_INTERVAL_NS / isqrt32(count ? count : 1);
+}
+
+int codel_should_drop(struct codel *c, uint64_t sojourn_ns, uint64_t now)
+{
+    int above = 0;
+
+    if (sojourn_ns < CODEL_TARGET_NS)
+        c->first_above_ns = 0;
+    else if (c->first_above_ns == 0)
+        c->first_above_ns = now + CODEL_INTERVAL_NS;
+    else if (now >= c->first_above_ns)
+        above = 1;
+
+    if (c->dropping)
+    {
+        if (!above)
+        {
+            c->dropping = 0;
+            return 0;
+        }
+        if (now >= c->drop_next_ns)
+        {
+            c->drop_count++;
+            c->drop_next_ns = codel_control_law(c->drop_next_ns, c->drop_count);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (above)
+    {
+        c->dropping = 1;
+        // Resume near the previous drop rate if we were dropping recently
+        // (the next drop may still be scheduled ahead of now: check before
+        // subtracting, the clock is unsigned)
+        if (c->drop_count > 2 && (now < c->drop_next_ns || now - c->drop_next_ns < 16 * CODEL_INTERVAL_NS))
+            c->drop_count -= 2;
+        else
+            c->drop_count = 1;
+        c->drop_next_ns = codel_control_law(now, c->drop_count);
+        return 1;
+    }
+
+    return 0;
+}
+
+// -------------------------------------------
+// Helper: Shed a connection with the prebuilt 503
+// -------------------------------------------
+// A TLS connection that has not finished its handshake cannot be answered
+// (that would take the handshake the 503 is meant to save): it is closed.
+void shed_connection(int fd)
+{
+    // Drain whatever request bytes already arrived so close() does not
+    // turn into a RST that discards the 503 before the client reads it
+    char discard[MAXDATASIZE];
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+        ;
+
+    ssize_t sent = 0;
+    if (tls_ready(fd))
+    {
+        HTTPD_PROBE3(response_start, fd, 503, 33);
+        sent = io_send(fd, RESPONSE_503, sizeof(RESPONSE_503) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close_client(fd);
+    metrics_conn_closed();
+    record_request(fd, NULL, 503, sent, 0, NULL);
+}
+
+// -------------------------------------------
+// HPACK: header compression for HTTP/2 (RFC 7541)
+// -------------------------------------------
+// Each direction has its own dynamic table: the decoder's mirrors what the
+// client inserts, the encoder's what we insert for our responses. A table
+// is a FIFO of entries whose names and values live back to back in one
+// fixed buffer (the table's byte limit bounds them), so inserting and
+// evicting never allocate. The buffer is compacted when an insert would
+// run past its end.
+//
+// The encoder never Huffman-codes (the savings on a status, a type and a
+// length are a few bytes); the decoder handles whatever the client sends.
+static const char *const HPACK_STATIC[][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+#define HPACK_STATIC_COUNT (int)(sizeof(HPACK_STATIC) / sizeof(HPACK_STATIC[0]))
+
+// Huffman code lengths of symbols 0..255 and EOS (256). The code is
+// canonical, so the codes themselves follow from the lengths.
+static const uint8_t HPACK_HUFFMAN_LEN[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// Canonical decoding tables, built by hpack_init(): the codes of length L
+// are first_code[L] .. first_code[L] + count[L] - 1, for the symbols
+// sorted[first_index[L]] onwards
+static struct
+{
+    uint32_t first_code[HPACK_HUFFMAN_MAX_BITS + 1];
+    uint16_t first_index[HPACK_HUFFMAN_MAX_BITS + 1];
+    uint16_t count[HPACK_HUFFMAN_MAX_BITS + 1];
+    uint16_t sorted[257];
+} huffman;
+
+void hpack_init(void)
+{
+    for (int s = 0; s < 257; s++)
+        huffman.count[HPACK_HUFFMAN_LEN[s]]++;
+
+    uint32_t code = 0;
+    uint16_t index = 0;
+    for (int bits = 1; bits <= HPACK_HUFFMAN_MAX_BITS; bits++)
+    {
+        code = (code + huffman.count[bits - 1]) << 1;
+        huffman.first_code[bits] = code;
+        huffman.first_index[bits] = index;
+        index += huffman.count[bits];
+    }
+
+    // Symbols by code length, then by value: the canonical order
+    uint16_t next[HPACK_HUFFMAN_MAX_BITS + 1];
+    memcpy(next, huffman.first_index, sizeof(next));
+    for (int s = 0; s < 257; s++)
+        huffman.sorted[next[HPACK_HUFFMAN_LEN[s]]++] = s;
+}
+
+// Returns the decoded length, or -1 for an invalid string (EOS, a code
+// longer than any symbol, padding that is not a prefix of EOS) or one that
+// does not fit
+int hpack_huffman_decode(const uint8_t *in, size_t len, char *out, size_t cap)
+{
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            code = code << 1 | (in[i] >> b & 1);
+            if (++bits > HPACK_HUFFMAN_MAX_BITS)
+                return -1;
+            uint32_t offset = code - huffman.first_code[bits];
+            if (code < huffman.first_code[bits] || offset >= huffman.count[bits])
+                continue;
+            int symbol = huffman.sorted[huffman.first_index[bits] + offset];
+            if (symbol == 256 || n == cap)
+                return -1;
+            out[n++] = symbol;
+            code = 0;
+            bits = 0;
+        }
+    }
+
+    // At most 7 bits of padding, all ones (the start of EOS)
+    if (bits > 7 || code != (1u << bits) - 1)
+        return -1;
+    return n;
+}
+
+struct hpack_entry
+{
+    uint32_t offset; // name, then value, in the table's data
+    uint16_t name_len;
+    uint16_t value_len;
+};
+
+struct hpack_table
+{
+    struct hpack_entry entries[HPACK_MAX_ENTRIES]; // ring, oldest at first
+    unsigned first;
+    unsigned count;
+    size_t size;     // RFC 7541 size: name + value + 32 per entry
+    size_t max_size; // current limit, at most HPACK_TABLE_SIZE
+    size_t data_start;
+    size_t data_end;
+    char data[HPACK_TABLE_SIZE];
+};
+
+void hpack_table_evict(struct hpack_table *t, size_t limit)
+{
+    while (t->count > 0 && t->size > limit)
+    {
+        struct hpack_entry *e = &t->entries[t->first];
+        t->size -= e->name_len + e->value_len + 32;
+        t->first = (t->first + 1) % HPACK_MAX_ENTRIES;
+        t->count--;
+        t->data_start = t->entries[t->first].offset;
+    }
+    if (t->count == 0)
+        t->data_start = t->data_end = 0;
+}
+
+void hpack_table_add(struct hpack_table *t, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t entry_size = name_len + value_len + 32;
+    if (entry_size > t->max_size)
+    {
+        // Too big for the table: it empties it (RFC 7541, 4.4)
+        hpack_table_evict(t, 0);
+        return;
+    }
+    hpack_table_evict(t, t->max_size - entry_size);
+
+    // The live bytes plus the new entry fit in max_size, so compacting
+    // always makes room
+    if (t->data_end + name_len + value_len > sizeof(t->data))
+    {
+        memmove(t->data, t->data + t->data_start, t->data_end - t->data_start);
+        for (unsigned i = 0; i < t->count; i++)
+            t->entries[(t->first + i) % HPACK_MAX_ENTRIES].offset -= t->data_start;
+        t->data_end -= t->data_start;
+        t->data_start = 0;
+    }
+
+    struct hpack_entry *e = &t->entries[(t->first + t->count) % HPACK_MAX_ENTRIES];
+    e->offset = t->data_end;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    memcpy(t->data + t->data_end, name, name_len);
+    memcpy(t->data + t->data_end + name_len, value, value_len);
+    t->data_end += name_len + value_len;
+    t->count++;
+    t->size += entry_size;
+}
+
+// Looks up index (1-based: the static table, then the dynamic table from
+// the newest entry). Returns 0, or -1 for an index out of range.
+int hpack_table_get(const struct hpack_table *t, uint32_t index, const char **name, size_t *name_len,
+                    const char **value, size_t *value_len)
+{
+    if (index >= 1 && index <= HPACK_STATIC_COUNT)
+    {
+        *name = HPACK_STATIC[index - 1][0];
+        *name_len = strlen(*name);
+        *value = HPACK_STATIC[index - 1][1];
+        *value_len = strlen(*value);
+        return 0;
+    }
+    uint32_t k = index - HPACK_STATIC_COUNT - 1;
+    if (index <= HPACK_STATIC_COUNT || k >= t->count)
+        return -1;
+    const struct hpack_entry *e = &t->entries[(t->first + t->count - 1 - k) % HPACK_MAX_ENTRIES];
+    *name = t->data + e->offset;
+    *name_len = e->name_len;
+    *value = t->data + e->offset + e->name_len;
+    *value_len = e->value_len;
+    return 0;
+}
+
+// Decodes an integer with an N-bit prefix; returns 0, or -1 if truncated
+// or too large
+int hpack_get_int(const uint8_t **p, const uint8_t *end, int prefix_bits, uint32_t *out)
+{
+    if (*p >= end)
+        return -1;
+    uint32_t max = (1u << prefix_bits) - 1;
+    uint32_t v = *(*p)++ & max;
+    if (v < max)
+    {
+        *out = v;
+        return 0;
+    }
+    for (int shift = 0; shift <= 21; shift += 7)
+    {
+        if (*p >= end)
+            return -1;
+        uint8_t b = *(*p)++;
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *out = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Decodes a string literal into out; returns its length or -1
+int hpack_get_string(const uint8_t **p, const uint8_t *end, char *out, size_t cap)
+{
+    if (*p >= end)
+        return -1;
+    int huffman_coded = **p & 0x80;
+    uint32_t len;
+    if (hpack_get_int(p, end, 7, &len) == -1 || len > (size_t)(end - *p))
+        return -1;
+
+    int n;
+    if (huffman_coded)
+        n = hpack_huffman_decode(*p, len, out, cap);
+    else if (len <= cap)
+        memcpy(out, *p, n = len);
+    else
+        n = -1;
+    *p += len;
+    return n;
+}
+
+size_t hpack_put_int(uint8_t *out, uint8_t first, int prefix_bits, uint32_t v)
+{
+    uint32_t max = (1u << prefix_bits) - 1;
+    if (v < max)
+    {
+        out[0] = first | v;
+        return 1;
+    }
+    size_t n = 0;
+    out[n++] = first | max;
+    for (v -= max; v >= 0x80; v >>= 7)
+        out[n++] = (v & 0x7f) | 0x80;
+    out[n++] = v;
+    return n;
+}
+
+// Encodes one header field into out (which has room for it); returns the
+// bytes written. A field in either table goes out as its index. Otherwise
+// it is a literal, with its name indexed when possible, and is added to
+// the dynamic table when `index` is set (values that repeat across
+// responses; not lengths).
+size_t hpack_encode(struct hpack_table *t, uint8_t *out, const char *name, const char *value, int index)
+{
+    size_t name_len = strlen(name), value_len = strlen(value);
+    uint32_t name_index = 0;
+    for (uint32_t i = 1; i <= HPACK_STATIC_COUNT + t->count; i++)
+    {
+        const char *n, *v;
+        size_t nl, vl;
+        if (hpack_table_get(t, i, &n, &nl, &v, &vl) == -1 || nl != name_len || memcmp(n, name, nl) != 0)
+            continue;
+        if (vl == value_len && memcmp(v, value, vl) == 0)
+            return hpack_put_int(out, 0x80, 7, i);
+        if (!name_index)
+            name_index = i;
+    }
+
+    size_t len = index ? hpack_put_int(out, 0x40, 6, name_index) : hpack_put_int(out, 0x00, 4, name_index);
+    if (!name_index)
+    {
+        len += hpack_put_int(out + len, 0x00, 7, name_len);
+        memcpy(out + len, name, name_len);
+        len += name_len;
+    }
+    len += hpack_put_int(out + len, 0x00, 7, value_len);
+    memcpy(out + len, value, value_len);
+    len += value_len;
+    if (index)
+        hpack_table_add(t, name, name_len, value, value_len);
+    return len;
+}
+
+// -------------------------------------------
+// HTTP/2 (RFC 9113): h2c with prior knowledge, or h2 over TLS via ALPN
+// -------------------------------------------
+// A connection that opens with the HTTP/2 preface is handed to an HTTP/2
+// thread of its own, so the serial loop or the pool's event loop and
+// workers go on with HTTP/1. The thread keeps it until the client closes
+// it or sends GOAWAY, or no request or body data has come or gone for
+// H2_IDLE_TIMEOUT_MS (PING and SETTINGS do not count). After
+// H2_MAX_LIFETIME_MS the server sends GOAWAY itself and closes once the
+// open streams are done. The thread runs one loop: read and handle
+// whatever frames have arrived, then send one DATA frame for each stream
+// that has body left and flow-control window to send it, round robin, so
+// a large file does not hold back the small ones requested after it. It
+// only blocks in poll() when nothing can be sent.
+//
+// Every stream counts as a request in flight against the server's
+// concurrency limiter, like an HTTP/1 request; one the limiter turns down
+// is refused with RST_STREAM, which the client may retry. Streams do not
+// wait in a queue, so CoDel has nothing to judge.
+//
+// Requests go through the same check_request(), stats endpoints,
+// load_response() (resolution, content cache, open file) and
+// record_request() as HTTP/1. DATA frames come straight from the cache
+// entry's memory (writev() of frame header + slice) or from the open
+// file (sendfile() of the slice after the header).
+enum h2_frame_type
+{
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum h2_error
+{
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_COMPRESSION_ERROR = 0x9
+};
+
+struct h2_stream
+{
+    uint32_t id; // 0: free slot
+    int64_t window;
+    int status;
+    const char *body; // in-memory body, or NULL to send res.fd
+    long size;
+    long sent; // body bytes sent
+    long bytes; // everything written for this stream
+    struct request req;
+    struct response res;    // file responses: cache entry, buffer or open file
+    struct strbuf stats;    // stats endpoint responses
+    char error_body[128];   // error responses
+    uint64_t start_ns;
+    struct phase_times times;
+};
+
+// What HTTP/2 threads share with the mode that handed them the connection
+struct h2_server
+{
+    const char *root_dir;
+    struct limiter *limiter;
+    _Atomic unsigned *in_flight;  // requests being served, open streams included
+    _Atomic unsigned *open_conns; // pool: the connection counts until closed; NULL in serial mode
+};
+
+struct h2_conn
+{
+    int fd;
+    struct h2_server *server;
+    uint32_t capture_id;
+    int preface_seen;
+    int goaway; // no new streams: either side sent GOAWAY
+    uint64_t active_ns; // last request or body data, either way
+    uint32_t last_stream_id;    // last stream accepted for processing (named in GOAWAY)
+    uint32_t highest_stream_id; // highest stream the client opened, refused ones included
+    int64_t window; // connection send window
+    uint32_t peer_initial_window;
+    struct hpack_table decoder;
+    struct hpack_table encoder;
+    int encoder_resized; // announce the encoder's new size in the next header block
+
+    // Header block being collected from HEADERS + CONTINUATION
+    uint32_t header_stream; // 0 if none
+    int header_end_stream;
+    size_t header_len;
+    uint8_t header_block[H2_HEADER_BLOCK_MAX];
+
+    struct h2_stream streams[H2_MAX_STREAMS];
+    int open_streams;
+    int next_stream; // round robin position
+
+    uint8_t in[2 * (9 + H2_FRAME_MAX)];
+    size_t in_len;
+    uint8_t out[H2_OUT_BUF]; // control frames and headers, flushed before blocking
+    size_t out_len;
+    char name[2 * H2_HEADER_BLOCK_MAX]; // decoded header name and value
+    char value[2 * H2_HEADER_BLOCK_MAX];
+};
+
+// Whether a connection's first bytes are the HTTP/2 client preface
+int h2_is_preface(const char *buf, size_t len)
+{
+    return len >= 16 && memcmp(buf, H2_PREFACE, 16) == 0;
+}
+
+int h2_flush(struct h2_conn *c, int more)
+{
+    if (c->out_len == 0)
+        return 0;
+    ssize_t sent = io_send(c->fd, c->out, c->out_len, more ? MSG_MORE : 0);
+    c->out_len = 0;
+    return sent == -1 ? -1 : 0;
+}
+
+// Appends a frame header to the output buffer; the payload follows with
+// h2_put()
+int h2_frame(struct h2_conn *c, int type, int flags, uint32_t stream, uint32_t len)
+{
+    if (c->out_len + 9 + len > sizeof(c->out) && h2_flush(c, 1) == -1)
+        return -1;
+    uint8_t *p = c->out + c->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = stream >> 24 & 0x7f;
+    p[6] = stream >> 16;
+    p[7] = stream >> 8;
+    p[8] = stream;
+    c->out_len += 9;
+    return 0;
+}
+
+void h2_put(struct h2_conn *c, const void *data, size_t len)
+{
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+void h2_put32(struct h2_conn *c, uint32_t v)
+{
+    uint8_t b[4] = {v >> 24, v >> 16, v >> 8, v};
+    h2_put(c, b, 4);
+}
+
+// Ends the connection with GOAWAY; returns -1 for the caller to pass up
+int h2_goaway(struct h2_conn *c, enum h2_error error)
+{
+    h2_frame(c, H2_GOAWAY, 0, 0, 8);
+    h2_put32(c, c->last_stream_id);
+    h2_put32(c, error);
+    h2_flush(c, 0);
+    return -1;
+}
+
+void h2_rst_stream(struct h2_conn *c, uint32_t stream, enum h2_error error)
+{
+    h2_frame(c, H2_RST_STREAM, 0, stream, 4);
+    h2_put32(c, error);
+}
+
+struct h2_stream *h2_stream_find(struct h2_conn *c, uint32_t id)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (c->streams[i].id == id)
+            return &c->streams[i];
+    return NULL;
+}
+
+// Frees the stream's slot; a completed response is recorded like any
+// HTTP/1 request
+void h2_stream_close(struct h2_conn *c, struct h2_stream *s, int completed)
+{
+    if (completed)
+    {
+        phase_end(&s->times, PHASE_SEND);
+        counter_add(&metrics_self()->h2_streams, 1);
+        record_request(c->fd, s->status == 400 ? NULL : &s->req, s->status, s->bytes, now_ns() - s->start_ns,
+                       &s->times);
+    }
+    release_response_body(&s->res);
+    free(s->stats.data);
+    s->stats.data = NULL;
+    s->id = 0;
+    c->open_streams--;
+    atomic_fetch_sub(c->server->in_flight, 1);
+    if (completed)
+        limiter_on_sample(c->server->limiter, limiter_latency(&s->times, s->start_ns));
+}
+
+// Decodes a complete header block into req. Every field goes through the
+// decoder so its dynamic table stays in step with the client's, even for
+// a request that is then refused. Returns 0, or -1 on a compression error.
+int h2_decode_headers(struct h2_conn *c, struct request *req, int *malformed)
+{
+    const uint8_t *p = c->header_block, *end = c->header_block + c->header_len;
+    int fields = 0; // decoded so far; table size updates must come first
+    req->method[0] = req->path[0] = '\0';
+    snprintf(req->protocol, sizeof(req->protocol), "HTTP/2.0");
+
+    while (p < end)
+    {
+        uint8_t b = *p;
+        uint32_t index;
+        int name_len = 0, value_len;
+
+        if (b & 0x80)
+        {
+            // Indexed field
+            const char *name, *value;
+            size_t nl, vl;
+            if (hpack_get_int(&p, end, 7, &index) == -1 ||
+                hpack_table_get(&c->decoder, index, &name, &nl, &value, &vl) == -1)
+                return -1;
+            memcpy(c->name, name, name_len = nl);
+            memcpy(c->value, value, value_len = vl);
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // Dynamic table size update, up to what our SETTINGS allow, and
+            // only at the start of a header block (RFC 7541, 4.2)
+            if (fields || hpack_get_int(&p, end, 5, &index) == -1 || index > HPACK_TABLE_SIZE)
+                return -1;
+            c->decoder.max_size = index;
+            hpack_table_evict(&c->decoder, index);
+            continue;
+        }
+        else
+        {
+            // Literal: with incremental indexing (01), without (0000) or
+            // never indexed (0001), with an indexed or literal name
+            int incremental = (b & 0xc0) == 0x40;
+            if (hpack_get_int(&p, end, incremental ? 6 : 4, &index) == -1)
+                return -1;
+            if (index)
+            {
+                const char *name, *value;
+                size_t nl, vl;
+                if (hpack_table_get(&c->decoder, index, &name, &nl, &value, &vl) == -1)
+                    return -1;
+                memcpy(c->name, name, name_len = nl);
+            }
+            else if ((name_len = hpack_get_string(&p, end, c->name, sizeof(c->name))) == -1)
+                return -1;
+            if ((value_len = hpack_get_string(&p, end, c->value, sizeof(c->value))) == -1)
+                return -1;
+            if (incremental)
+                hpack_table_add(&c->decoder, c->name, name_len, c->value, value_len);
+        }
+        fields++;
+
+        if (name_len == 7 && memcmp(c->name, ":method", 7) == 0)
+        {
+            if (value_len >= (int)sizeof(req->method))
+                *malformed = 1;
+            else
+                snprintf(req->method, sizeof(req->method), "%.*s", value_len, c->value);
+        }
+        else if (name_len == 5 && memcmp(c->name, ":path", 5) == 0)
+        {
+            if (value_len >= (int)sizeof(req->path))
+                *malformed = 1;
+            else
+                snprintf(req->path, sizeof(req->path), "%.*s", value_len, c->value);
+        }
+    }
+
+    if (!req->method[0] || !req->path[0])
+        *malformed = 1;
+    return 0;
+}
+
+// Writes the response HEADERS frame: :status, content-type and
+// content-length
+int h2_send_headers(struct h2_conn *c, struct h2_stream *s, const char *content_type)
+{
+    uint8_t block[512];
+    size_t len = 0;
+    char status[4], length[24];
+    snprintf(status, sizeof(status), "%d", s->status);
+    snprintf(length, sizeof(length), "%ld", s->size);
+
+    if (c->encoder_resized)
+    {
+        len += hpack_put_int(block, 0x20, 5, c->encoder.max_size);
+        c->encoder_resized = 0;
+    }
+    len += hpack_encode(&c->encoder, block + len, ":status", status, 1);
+    len += hpack_encode(&c->encoder, block + len, "content-type", content_type, 1);
+    len += hpack_encode(&c->encoder, block + len, "content-length", length, 0);
+
+    HTTPD_PROBE3(response_start, c->fd, s->status, s->size);
+    if (h2_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS | (s->size == 0 ? H2_FLAG_END_STREAM : 0), s->id, len) == -1)
+        return -1;
+    h2_put(c, block, len);
+    s->bytes += 9 + len;
+    return 0;
+}
+
+// Sends a 103 Early Hints HEADERS frame with the preload Link header
+// ahead of the response headers
+int h2_send_early_hints(struct h2_conn *c, struct h2_stream *s, const char *links)
+{
+    uint8_t block[EARLY_HINTS_LINKS + 64];
+    size_t len = 0;
+    if (c->encoder_resized)
+    {
+        len += hpack_put_int(block, 0x20, 5, c->encoder.max_size);
+        c->encoder_resized = 0;
+    }
+    len += hpack_encode(&c->encoder, block + len, ":status", "103", 1);
+    len += hpack_encode(&c->encoder, block + len, "link", links, 1);
+
+    if (h2_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS, s->id, len) == -1)
+        return -1;
+    h2_put(c, block, len);
+    s->bytes += 9 + len;
+    counter_add(&metrics_self()->early_hints, 1);
+    return 0;
+}
+
+// A complete request: decode it, answer it like HTTP/1 would, and send the
+// response headers. The body goes out from h2_send_round().
+int h2_on_request(struct h2_conn *c, uint32_t id)
+{
+    struct request req;
+    int malformed = 0;
+    uint64_t start_ns = now_ns();
+    struct phase_times times = {0};
+
+    phase_begin(&times, PHASE_PARSE);
+    int decoded = h2_decode_headers(c, &req, &malformed);
+    phase_end(&times, PHASE_PARSE);
+    if (decoded == -1)
+        return h2_goaway(c, H2_COMPRESSION_ERROR);
+
+    struct h2_stream *s = c->open_streams < H2_MAX_STREAMS ? h2_stream_find(c, 0) : NULL;
+    if (!s || c->goaway)
+    {
+        h2_rst_stream(c, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    if (!limiter_admit(c->server->limiter, atomic_load(c->server->in_flight)))
+    {
+        counter_add(&metrics_self()->h2_streams_refused, 1);
+        h2_rst_stream(c, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    atomic_fetch_add(c->server->in_flight, 1);
+    // Refused streams are safe to retry, so GOAWAY must not claim them
+    c->last_stream_id = id;
+
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->window = c->peer_initial_window;
+    s->req = req;
+    s->res.fd = -1;
+    s->res.times = &s->times;
+    s->start_ns = start_ns;
+    s->times = times;
+    c->open_streams++;
+    ALLOC_SINK(&s->times.allocs);
+
+    const char *error = "Malformed request";
+    const char *content_type = "application/json";
+    s->status = malformed ? 400 : check_request(&s->req, &error);
+    if (s->status == 0)
+    {
+        HTTPD_PROBE3(request_parsed, c->fd, s->req.method, s->req.path);
+        int stats = render_stats(c->fd, &s->req, &s->stats, &content_type);
+        if (stats == 200)
+        {
+            s->status = 200;
+            s->body = s->stats.data ? s->stats.data : "";
+            s->size = s->stats.len;
+        }
+        else if (stats != -1)
+        {
+            s->status = 500;
+            error = "Out of memory";
+        }
+        else
+        {
+            load_response(&s->req, c->server->root_dir, &s->res);
+            s->status = s->res.status;
+            error = s->res.error;
+            if (s->status == 200)
+            {
+                content_type = get_content_type(s->res.path);
+                s->body = s->res.body;
+                s->size = s->res.size;
+                socket_tune_send(c->fd, s->size);
+            }
+        }
+    }
+    if (s->status != 200)
+    {
+        content_type = "application/json";
+        s->size = snprintf(s->error_body, sizeof(s->error_body), "{\"error\": \"%s\"}", error);
+        s->body = s->error_body;
+    }
+
+    phase_begin(&s->times, PHASE_SEND);
+    int sent = 0;
+    if (s->status == 200 && s->res.links)
+        sent = h2_send_early_hints(c, s, s->res.links);
+    if (sent == 0)
+        sent = h2_send_headers(c, s, content_type);
+    s->times.headers_ns = now_ns();
+    ALLOC_SINK(NULL);
+    if (sent == -1)
+        return -1;
+    if (s->size == 0)
+        h2_stream_close(c, s, 1);
+    return 0;
+}
+
+int h2_on_settings(struct h2_conn *c, int flags, const uint8_t *p, uint32_t len)
+{
+    if (flags & H2_FLAG_ACK)
+        return len == 0 ? 0 : h2_goaway(c, H2_FRAME_SIZE_ERROR);
+    if (len % 6 != 0)
+        return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+
+    for (uint32_t i = 0; i < len; i += 6)
+    {
+        uint16_t id = p[i] << 8 | p[i + 1];
+        uint32_t v = (uint32_t)p[i + 2] << 24 | p[i + 3] << 16 | p[i + 4] << 8 | p[i + 5];
+        switch (id)
+        {
+        case 0x1: // HEADER_TABLE_SIZE: the most our encoder may use
+            v = v < HPACK_TABLE_SIZE ? v : HPACK_TABLE_SIZE;
+            if (v != c->encoder.max_size)
+            {
+                c->encoder.max_size = v;
+                hpack_table_evict(&c->encoder, v);
+                c->encoder_resized = 1;
+            }
+            break;
+        case 0x4: // INITIAL_WINDOW_SIZE: applies to open streams too
+            if (v > 0x7fffffff)
+                return h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+            for (int k = 0; k < H2_MAX_STREAMS; k++)
+                if (c->streams[k].id)
+                    c->streams[k].window += (int64_t)v - c->peer_initial_window;
+            c->peer_initial_window = v;
+            break;
+        case 0x5: // MAX_FRAME_SIZE: we send at most the 16384 every peer accepts
+            if (v < H2_FRAME_MAX || v > 0xffffff)
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            break;
+        }
+    }
+    return h2_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+}
+
+int h2_on_frame(struct h2_conn *c, int type, int flags, uint32_t stream, const uint8_t *p, uint32_t len)
+{
+    // A header block is only ever followed by its own CONTINUATIONs
+    if (c->header_stream && (type != H2_CONTINUATION || stream != c->header_stream))
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+    // Requests and their bodies keep the connection alive; PING, SETTINGS
+    // and the rest do not
+    if (type == H2_HEADERS || type == H2_CONTINUATION || type == H2_DATA)
+        c->active_ns = now_ns();
+
+    switch (type)
+    {
+    case H2_HEADERS:
+    case H2_CONTINUATION:
+        if (type == H2_HEADERS)
+        {
+            if (stream == 0 || !(stream & 1) || stream <= c->highest_stream_id)
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            c->highest_stream_id = stream;
+            uint32_t pad = 0;
+            if (flags & H2_FLAG_PADDED)
+            {
+                if (len < 1)
+                    return h2_goaway(c, H2_PROTOCOL_ERROR);
+                pad = *p++;
+                len--;
+            }
+            if (flags & H2_FLAG_PRIORITY)
+            {
+                if (len < 5)
+                    return h2_goaway(c, H2_PROTOCOL_ERROR);
+                p += 5;
+                len -= 5;
+            }
+            if (pad > len)
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            len -= pad;
+            c->header_stream = stream;
+            c->header_end_stream = flags & H2_FLAG_END_STREAM;
+            c->header_len = 0;
+        }
+        else if (!c->header_stream)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+        if (c->header_len + len > sizeof(c->header_block))
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        memcpy(c->header_block + c->header_len, p, len);
+        c->header_len += len;
+        if (!(flags & H2_FLAG_END_HEADERS))
+            return 0;
+        c->header_stream = 0;
+        // A request with a body (not END_STREAM) is answered all the same;
+        // its DATA is discarded
+        return h2_on_request(c, stream);
+
+    case H2_DATA:
+        if (stream == 0)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        // Discarded; give the connection window back
+        if (len > 0)
+        {
+            if (h2_frame(c, H2_WINDOW_UPDATE, 0, 0, 4) == -1)
+                return -1;
+            h2_put32(c, len);
+        }
+        return 0;
+
+    case H2_SETTINGS:
+        if (stream != 0)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        return h2_on_settings(c, flags, p, len);
+
+    case H2_PING:
+        if (stream != 0 || len != 8)
+            return h2_goaway(c, len != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        if (flags & H2_FLAG_ACK)
+            return 0;
+        if (h2_frame(c, H2_PING, H2_FLAG_ACK, 0, 8) == -1)
+            return -1;
+        h2_put(c, p, 8);
+        return 0;
+
+    case H2_WINDOW_UPDATE:
+    {
+        if (len != 4)
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        uint32_t increment = ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) & 0x7fffffff;
+        if (increment == 0)
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        int64_t *window = &c->window;
+        if (stream != 0)
+        {
+            struct h2_stream *s = h2_stream_find(c, stream);
+            if (!s)
+                return 0; // already finished
+            window = &s->window;
+        }
+        if (*window + increment > 0x7fffffff)
+            return h2_goaway(c, H2_FLOW_CONTROL_ERROR);
+        *window += increment;
+        return 0;
+    }
+
+    case H2_RST_STREAM:
+    {
+        if (len != 4)
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        struct h2_stream *s = stream ? h2_stream_find(c, stream) : NULL;
+        if (s)
+            h2_stream_close(c, s, 0);
+        return 0;
+    }
+
+    case H2_GOAWAY:
+        c->goaway = 1;
+        return 0;
+
+    case H2_PUSH_PROMISE:
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+    default: // PRIORITY (advisory) and unknown types are ignored
+        return 0;
+    }
+}
+
+// Reads what the socket has; returns 0, or -1 once the client is gone
+int h2_recv(struct h2_conn *c)
+{
+    ssize_t n = io_recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n <= 0)
+        return -1;
+    if (capture_fd != -1 && c->capture_id)
+        capture_chunk(c->capture_id, 0, (const char *)c->in + c->in_len, n);
+    c->in_len += n;
+    return 0;
+}
+
+// Handles every complete frame read so far. Returns 0, or -1 to close the
+// connection.
+int h2_process(struct h2_conn *c)
+{
+    size_t off = 0;
+    if (!c->preface_seen)
+    {
+        if (c->in_len < sizeof(H2_PREFACE) - 1)
+            return 0;
+        if (memcmp(c->in, H2_PREFACE, sizeof(H2_PREFACE) - 1) != 0)
+            return -1;
+        off = sizeof(H2_PREFACE) - 1;
+        c->preface_seen = 1;
+    }
+
+    while (c->in_len - off >= 9)
+    {
+        const uint8_t *h = c->in + off;
+        uint32_t len = h[0] << 16 | h[1] << 8 | h[2];
+        if (len > H2_FRAME_MAX)
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        if (c->in_len - off < 9 + len)
+            break;
+        uint32_t stream = ((uint32_t)h[5] << 24 | h[6] << 16 | h[7] << 8 | h[8]) & 0x7fffffff;
+        if (h2_on_frame(c, h[3], h[4], stream, h + 9, len) == -1)
+            return -1;
+        off += 9 + len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return 0;
+}
+
+// Body bytes the stream may send in its next DATA frame
+long h2_sendable(const struct h2_conn *c, const struct h2_stream *s)
+{
+    if (!s->id)
+        return 0;
+    long n = s->size - s->sent;
+    if (n > H2_FRAME_MAX)
+        n = H2_FRAME_MAX;
+    if (n > c->window)
+        n = c->window;
+    if (n > s->window)
+        n = s->window;
+    return n > 0 ? n : 0;
+}
+
+// One DATA frame for each stream that can send, round robin. Returns 1 if
+// anything was sent, 0 if every stream is waiting for window, -1 on error.
+int h2_send_round(struct h2_conn *c)
+{
+    int sent_any = 0;
+    for (int k = 0; k < H2_MAX_STREAMS; k++)
+    {
+        struct h2_stream *s = &c->streams[(c->next_stream + k) % H2_MAX_STREAMS];
+        long n = h2_sendable(c, s);
+        if (n == 0)
+            continue;
+
+        int last = s->sent + n == s->size;
+        if (h2_frame(c, H2_DATA, last ? H2_FLAG_END_STREAM : 0, s->id, n) == -1)
+            return -1;
+        long written;
+        if (s->body)
+        {
+            // Frame header (and whatever else is buffered) + the body slice,
+            // straight from the cache entry or buffer
+            struct iovec iov[2] = {{c->out, c->out_len}, {(char *)s->body + s->sent, n}};
+            written = io_writev(c->fd, iov, 2) == (ssize_t)(c->out_len + n) ? n : -1;
+            c->out_len = 0;
+        }
+        else
+            written = h2_flush(c, 1) == -1 ? -1 : io_sendfile(c->fd, s->res.fd, s->sent, n);
+        if (written != n)
+            return -1;
+
+        s->sent += n;
+        s->window -= n;
+        c->window -= n;
+        s->bytes += 9 + n;
+        sent_any = 1;
+        c->active_ns = now_ns();
+        if (last)
+            h2_stream_close(c, s, 1);
+    }
+    c->next_stream = (c->next_stream + 1) % H2_MAX_STREAMS;
+    return sent_any;
+}
+
+// Serves an HTTP/2 connection until it ends. `initial` is what was already
+// read from it (at least the start of the preface). Does not close fd.
+void h2_serve(int fd, struct h2_server *server, const char *initial, size_t initial_len, uint32_t capture_id)
+{
+    ALLOC_SINK(NULL); // connection state, not a request's
+    struct h2_conn *c = calloc(1, sizeof(*c));
+    if (!c)
+        return;
+    counter_add(&metrics_self()->h2_connections, 1);
+    c->fd = fd;
+    c->server = server;
+    c->capture_id = capture_id;
+    c->window = H2_WINDOW_DEFAULT;
+    c->peer_initial_window = H2_WINDOW_DEFAULT;
+    c->decoder.max_size = HPACK_TABLE_SIZE;
+    c->encoder.max_size = HPACK_TABLE_SIZE;
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        c->streams[i].res.fd = -1;
+    c->active_ns = now_ns();
+    uint64_t expires_ns = c->active_ns + H2_MAX_LIFETIME_MS * 1000000ULL;
+
+    // Our SETTINGS: only the stream limit differs from the defaults
+    h2_frame(c, H2_SETTINGS, 0, 0, 6);
+    h2_put(c, (uint8_t[]){0x00, 0x03}, 2);
+    h2_put32(c, H2_MAX_STREAMS);
+
+    memcpy(c->in, initial, initial_len);
+    c->in_len = initial_len;
+    int ok = h2_process(c) == 0;
+    while (ok && !(c->goaway && c->open_streams == 0))
+    {
+        int sendable = 0;
+        for (int i = 0; i < H2_MAX_STREAMS && !sendable; i++)
+            sendable = h2_sendable(c, &c->streams[i]) > 0;
+        if (!sendable && h2_flush(c, 0) == -1)
+            break;
+
+        // Past its lifetime, or once the server is stopping, the connection
+        // takes no new streams. GOAWAY names the last one that is answered;
+        // the loop ends once the open ones are done.
+        uint64_t now = now_ns();
+        if (!c->goaway && (now >= expires_ns || atomic_load(&stopping)))
+        {
+            h2_frame(c, H2_GOAWAY, 0, 0, 8);
+            h2_put32(c, c->last_stream_id);
+            h2_put32(c, H2_NO_ERROR);
+            c->goaway = 1;
+            continue;
+        }
+
+        // Block only when there is nothing to send, and give up at the idle
+        // timeout, whether the client is idle or has stopped opening its
+        // flow-control window
+        uint64_t idle_ns = c->active_ns + H2_IDLE_TIMEOUT_MS * 1000000ULL;
+        uint64_t wake_ns = c->goaway || idle_ns < expires_ns ? idle_ns : expires_ns;
+        if (!sendable && now >= idle_ns)
+            break;
+        // shutdown_fd stays readable: only watched until GOAWAY is out
+        struct pollfd pfds[2] = {{.fd = fd, .events = POLLIN}, {.fd = shutdown_fd, .events = POLLIN}};
+        int timeout_ms = sendable || now >= wake_ns ? 0 : (int)((wake_ns - now + 999999) / 1000000);
+        if (io_pending(fd) || (poll(pfds, c->goaway ? 1 : 2, timeout_ms) > 0 && pfds[0].revents))
+            ok = h2_recv(c) == 0 && h2_process(c) == 0;
+        if (ok && sendable)
+            ok = h2_send_round(c) != -1;
+    }
+    h2_flush(c, 0);
+
+    // Streams the connection ended under are not recorded
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (c->streams[i].id)
+            h2_stream_close(c, &c->streams[i], 0);
+    free(c);
+}
+
+// -------------------------------------------
+// HTTP/2 threads: one connection each
+// -------------------------------------------
+// Started on demand, up to H2_MAX_CONNECTIONS; a thread whose connection
+// ends waits for the next one. With every thread busy, a new connection is
+// turned away with GOAWAY straight after the preface, which tells the
+// client no stream was processed and it may try again.
+struct h2_job
+{
+    struct h2_job *next;
+    struct h2_server *server;
+    int fd;
+    uint32_t capture_id;
+    size_t len;
+    char initial[MAXDATASIZE]; // what was read with the preface
+};
+
+struct h2_threads
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct h2_job *head; // waiting for a thread
+    struct h2_job **tail;
+    int waiting;
+    int started;
+    int idle; // threads waiting for a job
+};
+
+static struct h2_threads h2_threads = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER, .tail = &h2_threads.head};
+
+// Empty SETTINGS, then GOAWAY: last stream 0, NO_ERROR
+static const uint8_t H2_REFUSE[] = {0, 0, 0, H2_SETTINGS, 0, 0, 0, 0, 0, 0, 0, 8, H2_GOAWAY, 0,
+                                    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+void *h2_thread_main(void *arg)
+{
+    (void)arg;
+    trace_ring_init();
+    pthread_mutex_lock(&h2_threads.lock);
+    while (1)
+    {
+        h2_threads.idle++;
+        while (!h2_threads.head)
+            pthread_cond_wait(&h2_threads.ready, &h2_threads.lock);
+        h2_threads.idle--;
+        struct h2_job *job = h2_threads.head;
+        h2_threads.head = job->next;
+        if (!h2_threads.head)
+            h2_threads.tail = &h2_threads.head;
+        h2_threads.waiting--;
+        pthread_mutex_unlock(&h2_threads.lock);
+
+        h2_serve(job->fd, job->server, job->initial, job->len, job->capture_id);
+        close_client(job->fd);
+        metrics_conn_closed();
+        if (job->server->open_conns)
+            atomic_fetch_sub(job->server->open_conns, 1);
+        free(job);
+
+        pthread_mutex_lock(&h2_threads.lock);
+    }
+    return NULL;
+}
+
+// Hands the connection (and the bytes read from it so far) to an HTTP/2
+// thread, which closes it when done. Returns -1 if it was turned away
+// instead; the caller still has to close it.
+int h2_dispatch(struct h2_server *server, int fd, const char *initial, size_t len, uint32_t capture_id)
+{
+    ALLOC_SINK(NULL); // connection state, not a request's
+    struct h2_job *job = malloc(sizeof(*job));
+    if (job)
+    {
+        job->next = NULL;
+        job->server = server;
+        job->fd = fd;
+        job->capture_id = capture_id;
+        job->len = len < sizeof(job->initial) ? len : sizeof(job->initial);
+        memcpy(job->initial, initial, job->len);
+    }
+
+    pthread_mutex_lock(&h2_threads.lock);
+    int queued = 0;
+    if (job && h2_threads.waiting < h2_threads.idle)
+        queued = 1;
+    else if (job && h2_threads.started < H2_MAX_CONNECTIONS)
+    {
+        pthread_t thread;
+        queued = pthread_create(&thread, NULL, h2_thread_main, NULL) == 0;
+        if (queued)
+        {
+            pthread_detach(thread);
+            h2_threads.started++;
+        }
+    }
+    if (queued)
+    {
+        *h2_threads.tail = job;
+        h2_threads.tail = &job->next;
+        h2_threads.waiting++;
+        pthread_cond_signal(&h2_threads.ready);
+    }
+    pthread_mutex_unlock(&h2_threads.lock);
+
+    if (!queued)
+    {
+        free(job);
+        counter_add(&metrics_self()->h2_connections, 1);
+        counter_add(&metrics_self()->h2_refused, 1);
+        io_send(fd, H2_REFUSE, sizeof(H2_REFUSE), MSG_NOSIGNAL);
+        return -1;
+    }
+    return 0;
+}
+
+// -------------------------------------------
+// Handle a single client connection
+// -------------------------------------------
+// An HTTP/2 connection is handed to h2, which admits its streams; an HTTP/1
+// request feeds its service time to the same limiter (h2->limiter)
+void handle_client(int new_fd, const char *root_dir, struct h2_server *h2, uint64_t accepted_ns)
+{
+    struct phase_times times = {0};
+    char buf[MAXDATASIZE];
+    ALLOC_SINK(&times.allocs);
+
+    // The TLS handshake counts as receive time: the request cannot be read
+    // before it is done
+    phase_begin(&times, PHASE_RECV);
+    int numbytes = -1;
+#ifdef WITH_TLS
+    int want_write;
+    if (tls_ready(new_fd) || tls_handshake(new_fd, &want_write) == 1)
+#endif
+        numbytes = io_recv(new_fd, buf, MAXDATASIZE - 1, 0);
+    phase_end(&times, PHASE_RECV);
+
+    if (numbytes <= 0)
+    {
+        ALLOC_SINK(NULL);
+        close_client(new_fd);
+        metrics_conn_closed();
+        return;
+    }
+
+    buf[numbytes] = '\0';
+    uint64_t ready_ns = now_ns();
+    uint32_t capture_id = 0;
+    if (capture_fd != -1)
+    {
+        capture_id = capture_conn_id();
+        capture_chunk(capture_id, 1, buf, numbytes);
+    }
+
+    if (h2_is_preface(buf, numbytes))
+    {
+        ALLOC_SINK(NULL);
+        if (h2_dispatch(h2, new_fd, buf, numbytes, capture_id) == -1)
+        {
+            close_client(new_fd);
+            metrics_conn_closed();
+        }
+        return;
+    }
+
+    struct request req;
+    const char *error;
+    long sent;
+    phase_begin(&times, PHASE_PARSE);
+    int status = parse_request(buf, &req, &error);
+    phase_end(&times, PHASE_PARSE);
+    if (status == 0)
+        HTTPD_PROBE3(request_parsed, new_fd, req.method, req.path);
+
+    if (status != 0)
+        sent = send_error(new_fd, status, error);
+    else if ((sent = serve_stats(new_fd, &req)) != -1)
+        status = 200;
+    else
+        sent = serve_request(new_fd, &req, root_dir, &status, &times);
+
+    close_client(new_fd);
+    metrics_conn_closed();
+    record_request(new_fd, status == 400 ? NULL : &req, status, sent, now_ns() - accepted_ns, &times);
+    // Like a pool worker, judge service time from the moment the request
+    // was read, not from accept
+    limiter_on_sample(h2->limiter, limiter_latency(&times, ready_ns));
+}
+
+// -------------------------------------------
+// Worker pool: connection state handed between threads
+// -------------------------------------------
+enum conn_state
+{
+    CONN_PARSED, // request parsed, waiting for a worker
+    CONN_LOADED  // file loaded by an I/O thread, waiting to be sent
+};
+
+struct conn
+{
+    int fd;
+    int len; // bytes of request read so far
+    uint32_t capture_id; // connection id in the capture file (-r), 0 until its first chunk
+    int h2;              // opened with the HTTP/2 preface: a worker serves the whole connection
+    enum conn_state state;
+    uint64_t accepted_ns; // left the kernel backlog
+    uint64_t ready_ns;    // request fully read and queued for a worker
+    struct request req;
+    struct response res;
+    struct phase_times times;
+    char buf[MAXDATASIZE];
+};
+
+// -------------------------------------------
+// Worker pool: Chase-Lev work-stealing deque
+// -------------------------------------------
+// The owning worker pushes and pops at the bottom; other workers steal from
+// the top. Memory orderings follow Le et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (PPoPP 2013). Fixed size: the owner
+// only refills it from the shared ring when it is empty.
+struct ws_deque
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    struct conn *_Atomic items[WS_DEQUE_SIZE];
+};
+
+int ws_push(struct ws_deque *d, struct conn *c)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= WS_DEQUE_SIZE)
+        return -1;
+
+    atomic_store_explicit(&d->items[b & (WS_DEQUE_SIZE - 1)], c, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+struct conn *ws_pop(struct ws_deque *d)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b)
+    {
+        // Empty
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct conn *c = atomic_load_explicit(&d->items[b & (WS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (t == b)
+    {
+        // Last item: race against thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            c = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return c;
+}
+
+struct conn *ws_steal(struct ws_deque *d)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t >= b)
+        return NULL;
+
+    struct conn *c = atomic_load_explicit(&d->items[t & (WS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL; // lost the race to the owner or another thief
+    return c;
+}
+
+// -------------------------------------------
+// Worker pool: bounded lock-free MPMC ring
+// -------------------------------------------
+// Dmitry Vyukov's bounded MPMC queue: every cell carries a sequence number
+// telling producers and consumers whose turn it is, so a push or pop is one
+// CAS on the shared position plus a release store on the cell. Event loops
+// push parsed requests, workers pop them, and nobody takes a lock.
+struct mpmc_cell
+{
+    _Atomic size_t seq;
+    struct conn *conn;
+};
+
+struct mpmc_ring
+{
+    struct mpmc_cell cells[MPMC_RING_SIZE];
+    _Atomic size_t enqueue_pos __attribute__((aligned(64)));
+    _Atomic size_t dequeue_pos __attribute__((aligned(64)));
+};
+
+void mpmc_init(struct mpmc_ring *r)
+{
+    for (size_t i = 0; i < MPMC_RING_SIZE; i++)
+        atomic_init(&r->cells[i].seq, i);
+    atomic_init(&r->enqueue_pos, 0);
+    atomic_init(&r->dequeue_pos, 0);
+}
+
+int mpmc_push(struct mpmc_ring *r, struct conn *c)
+{
+    size_t pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+
+    while (1)
+    {
+        cell = &r->cells[pos & (MPMC_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&r->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return -1; // full
+        else
+            pos = atomic_load_explicit(&r->enqueue_pos, memory_order_relaxed);
+    }
+
+    cell->conn = c;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+struct conn *mpmc_pop(struct mpmc_ring *r)
+{
+    size_t pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+
+    while (1)
+    {
+        cell = &r->cells[pos & (MPMC_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&r->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return NULL; // empty
+        else
+            pos = atomic_load_explicit(&r->dequeue_pos, memory_order_relaxed);
+    }
+
+    struct conn *c = cell->conn;
+    atomic_store_explicit(&cell->seq, pos + MPMC_RING_SIZE, memory_order_release);
+    return c;
+}
+
+// -------------------------------------------
+// Worker pool: task queue with eventfd wakeups
+// -------------------------------------------
+// An MPMC ring plus the bookkeeping to put consumers to sleep when it is
+// empty. Sleepers block on a semaphore-mode eventfd: each write wakes
+// exactly one of them, and producers only write when someone is asleep.
+struct task_queue
+{
+    struct mpmc_ring ring;
+    _Atomic int queued; // pushed and not yet picked up by a consumer
+    _Atomic int idle;   // consumers blocked on wake_fd
+    int wake_fd;
+};
+
+int task_queue_init(struct task_queue *q)
+{
+    mpmc_init(&q->ring);
+    q->wake_fd = eventfd(0, EFD_SEMAPHORE);
+    return q->wake_fd == -1 ? -1 : 0;
+}
+
+int task_queue_push(struct task_queue *q, struct conn *c)
+{
+    if (mpmc_push(&q->ring, c) == -1)
+        return -1;
+
+    // Publish before checking for sleepers; pairs with task_queue_sleep()
+    atomic_fetch_add(&q->queued, 1);
+    if (atomic_load(&q->idle) > 0)
+    {
+        uint64_t one = 1;
+        if (write(q->wake_fd, &one, sizeof(one)) == -1)
+            perror("eventfd write");
+    }
+    return 0;
+}
+
+void task_queue_sleep(struct task_queue *q)
+{
+    atomic_fetch_add(&q->idle, 1);
+    if (atomic_load(&q->queued) == 0)
+    {
+        uint64_t token;
+        if (read(q->wake_fd, &token, sizeof(token)) == -1 && errno != EINTR)
+            perror("eventfd read");
+    }
+    atomic_fetch_sub(&q->idle, 1);
+}
+
+// -------------------------------------------
+// Worker pool: workers
+// -------------------------------------------
+// Event loops push parsed requests into one shared task queue. A worker
+// with an empty deque refills it from the queue in small batches, and idle
+// workers steal from the others' deques, so a worker stuck on a slow disk
+// read never holds back the requests it already grabbed.
+//
+// With I/O threads (-i), workers only read what is already in the page
+// cache: anything that would wait for the disk is handed to the I/O pool,
+// which finishes the read and posts the connection back to the worker
+// pool's queue for sending.
+struct pool;
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    struct pool *pool;
+    struct ws_deque deque;
+    struct codel codel;
+} __attribute__((aligned(64)));
+
+struct event_loop
+{
+    pthread_t thread;
+    int epfd;
+    int sockfd;
+    int sigfd; // SIGUSR1 signalfd on loop 0, -1 elsewhere
+    struct pool *pool;
+};
+
+struct pool
+{
+    struct task_queue tasks; // parsed requests and loaded responses
+    struct task_queue io;    // requests waiting for an I/O thread
+    struct worker *workers;
+    int nworkers;
+    pthread_t *io_threads;
+    int nio; // I/O threads, 0 = workers do file I/O inline
+    _Atomic int done; // shutting down: workers and I/O threads exit once idle
+    const char *root_dir;
+    struct limiter limiter;
+    struct h2_server h2;         // HTTP/2 connections, handed to their own threads
+    _Atomic unsigned in_flight;  // requests parsed and not yet answered, at most MPMC_RING_SIZE
+    _Atomic unsigned open_conns; // accepted and not yet closed, idle ones included
+    unsigned max_conns;          // what the file descriptor limit leaves room for
+    struct mpmc_ring free_conns; // closed connections kept for reuse
+};
+
+// Connections are recycled instead of going through malloc()/free() each
+// time; up to MPMC_RING_SIZE are kept, the rest are freed
+struct conn *conn_new(struct pool *p)
+{
+    struct conn *c = mpmc_pop(&p->free_conns);
+    return c ? c : malloc(sizeof(struct conn));
+}
+
+void conn_free(struct pool *p, struct conn *c)
+{
+    if (mpmc_push(&p->free_conns, c) == -1)
+        free(c);
+}
+
+int pool_submit(struct pool *p, struct conn *c)
+{
+    c->state = CONN_PARSED;
+    c->ready_ns = now_ns();
+    phase_begin(&c->times, PHASE_QUEUE);
+    return task_queue_push(&p->tasks, c);
+}
+
+struct conn *worker_next_task(struct worker *w)
+{
+    struct pool *p = w->pool;
+
+    struct conn *c = ws_pop(&w->deque);
+    if (c)
+        return c;
+
+    // Deque is empty: refill it from the queue. Pushed newest-first so the
+    // owner (popping at the bottom) still serves in arrival order.
+    struct conn *batch[RING_BATCH];
+    int n = 0;
+    while (n < RING_BATCH && (batch[n] = mpmc_pop(&p->tasks.ring)) != NULL)
+        n++;
+    if (n > 0)
+    {
+        for (int i = n - 1; i > 0; i--)
+            ws_push(&w->deque, batch[i]);
+        return batch[0];
+    }
+
+    // Nothing queued: steal, starting from our neighbour
+    for (int i = 1; i < p->nworkers; i++)
+    {
+        c = ws_steal(&p->workers[(w->id + i) % p->nworkers].deque);
+        if (c)
+            return c;
+    }
+
+    return NULL;
+}
+
+void worker_finish(struct pool *p, struct conn *c, int status, long sent)
+{
+    uint64_t latency = now_ns() - c->accepted_ns;
+
+    close_client(c->fd);
+    metrics_conn_closed();
+    record_request(c->fd, &c->req, status, sent, latency, &c->times);
+    // The limiter judges service time from the moment the request was
+    // ready; time an idle connection spent before sending it says nothing
+    // about load
+    limiter_on_sample(&p->limiter, limiter_latency(&c->times, c->ready_ns));
+    atomic_fetch_sub(&p->in_flight, 1);
+    atomic_fetch_sub(&p->open_conns, 1);
+    conn_free(p, c);
+}
+
+void worker_run(struct worker *w, struct conn *c)
+{
+    struct pool *p = w->pool;
+    struct metrics *m = metrics_self();
+    int status;
+    long sent;
+
+    if (c->state == CONN_LOADED)
+    {
+        status = c->res.status;
+        sent = send_loaded_response(c->fd, &c->res);
+        worker_finish(p, c, status, sent);
+        return;
+    }
+
+    phase_end(&c->times, PHASE_QUEUE);
+    c->res.times = &c->times;
+
+    uint64_t start = now_ns();
+    if (codel_should_drop(&w->codel, start - c->ready_ns, start))
+    {
+        shed_connection(c->fd);
+        atomic_fetch_sub(&p->in_flight, 1);
+        atomic_fetch_sub(&p->open_conns, 1);
+        conn_free(p, c);
+        return;
+    }
+
+    if ((sent = serve_stats(c->fd, &c->req)) != -1)
+    {
+        worker_finish(p, c, 200, sent);
+        return;
+    }
+
+    if (p->nio == 0)
+    {
+        sent = serve_request(c->fd, &c->req, p->root_dir, &status, &c->times);
+        worker_finish(p, c, status, sent);
+        return;
+    }
+
+    // Serve inline when the file is already in the page cache
+    if (probe_response(&c->req, p->root_dir, &c->res))
+    {
+        counter_add(&m->pagecache_inline, 1);
+        status = c->res.status;
+        sent = send_loaded_response(c->fd, &c->res);
+        worker_finish(p, c, status, sent);
+        return;
+    }
+
+    counter_add(&m->pagecache_offloaded, 1);
+
+    // In-flight requests fit in the I/O ring (see conn_on_readable), so
+    // this only fails while a consumer has claimed a cell and not yet
+    // released it; read inline then
+    if (task_queue_push(&p->io, c) == 0)
+        return;
+
+    finish_load(&c->res);
+    cache_insert(&c->req, &c->res);
+    status = c->res.status;
+    sent = send_loaded_response(c->fd, &c->res);
+    worker_finish(p, c, status, sent);
+}
+
+void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct pool *p = w->pool;
+    trace_ring_init();
+
+    while (1)
+    {
+        struct conn *c = worker_next_task(w);
+        if (!c)
+        {
+            if (atomic_load(&p->done))
+                break;
+            task_queue_sleep(&p->tasks);
+            continue;
+        }
+
+        atomic_fetch_sub(&p->tasks.queued, 1);
+        ALLOC_SINK(&c->times.allocs);
+        worker_run(w, c);
+        ALLOC_SINK(NULL);
+    }
+
+    return NULL;
+}
+
+// -------------------------------------------
+// I/O pool: blocking file work off the workers
+// -------------------------------------------
+void *io_thread_main(void *arg)
+{
+    struct pool *p = arg;
+    trace_ring_init();
+
+    while (1)
+    {
+        struct conn *c = mpmc_pop(&p->io.ring);
+        if (!c)
+        {
+            if (atomic_load(&p->done))
+                break;
+            task_queue_sleep(&p->io);
+            continue;
+        }
+        atomic_fetch_sub(&p->io.queued, 1);
+
+        ALLOC_SINK(&c->times.allocs);
+        finish_load(&c->res);
+        cache_insert(&c->req, &c->res);
+        ALLOC_SINK(NULL);
+        c->state = CONN_LOADED;
+
+        // Post the completion back. In-flight requests fit in the task ring,
+        // so a push only fails in the few instructions between a consumer
+        // claiming a cell and releasing it.
+        while (task_queue_push(&p->tasks, c) == -1)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+// -------------------------------------------
+// Pool mode: event loops (accept, read, parse)
+// -------------------------------------------
+void conn_finish(struct pool *p, struct conn *c)
+{
+    close_client(c->fd);
+    metrics_conn_closed();
+    atomic_fetch_sub(&p->open_conns, 1);
+    conn_free(p, c);
+}
+
+void conn_on_readable(struct event_loop *loop, struct conn *c)
+{
+    struct pool *p = loop->pool;
+
+#ifdef WITH_TLS
+    // TLS: the socket stays non-blocking until the request is read, and
+    // the handshake runs a step at a time, waking up on whichever way the
+    // socket has to go next
+    if (!tls_ready(c->fd))
+    {
+        int want_write = 0;
+        int r = tls_handshake(c->fd, &want_write);
+        if (r == -1)
+        {
+            conn_finish(p, c);
+            return;
+        }
+        if (r == 0)
+        {
+            struct epoll_event ev = {.events = (want_write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT, .data.ptr = c};
+            epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            return;
+        }
+        // Done: the request may already be here, read on
+    }
+#endif
+
+    int numbytes = io_recv(c->fd, c->buf + c->len, MAXDATASIZE - 1 - c->len, MSG_DONTWAIT);
+    if (numbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        numbytes = 0;
+    else if (numbytes <= 0)
+    {
+        conn_finish(p, c);
+        return;
+    }
 
-#include <stdio.h>
-// Provides standard I/O functions:
-//   - printf(), fprintf(), perror(), snprintf(), fopen(), fread(), fclose()
-// In this code: printing logs, errors, building response strings, reading files
+    if (capture_fd != -1 && numbytes > 0)
+    {
+        int first = c->capture_id == 0;
+        if (first)
+            c->capture_id = capture_conn_id();
+        capture_chunk(c->capture_id, first, c->buf + c->len, numbytes);
+    }
 
-#include <string.h>
-// Provides string manipulation functions:
-//   - strlen(), strcmp(), strncmp(), strstr(), strchr(), memset(), memcpy()
-// In this code: parsing HTTP requests, handling paths, cleaning buffers, comparing strings
+    c->len += numbytes;
+    c->buf[c->len] = '\0';
 
-#include <stdlib.h>
-// Provides general utilities:
-//   - malloc(), free(), exit(), atoi(), system()
-// In this code: dynamic memory allocation for file content, exiting on fatal errors
+    // Wait for the end of the headers (or a full buffer) before parsing
+    if (!strstr(c->buf, "\r\n\r\n") && c->len < MAXDATASIZE - 1)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = c};
+        epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+    phase_end(&c->times, PHASE_RECV);
 
-#include <unistd.h>
-// Provides POSIX API functions:
-//   - close(), read(), write(), getpid(), fork(), sleep()
-// In this code: closing sockets, sending data, interacting with file descriptors
+    const char *error;
+    int status = 0;
+    c->h2 = h2_is_preface(c->buf, c->len);
+    if (!c->h2)
+    {
+        phase_begin(&c->times, PHASE_PARSE);
+        status = parse_request(c->buf, &c->req, &error);
+        phase_end(&c->times, PHASE_PARSE);
+    }
+    if (status != 0)
+    {
+        long sent = send_error(c->fd, status, error);
+        record_request(c->fd, status == 400 ? NULL : &c->req, status, sent, now_ns() - c->accepted_ns, &c->times);
+        conn_finish(p, c);
+        return;
+    }
 
-#include <limits.h>
-// Provides system limits constants:
-//   - PATH_MAX, INT_MAX, LONG_MAX, etc.
-// In this code: defining maximum allowed path length for safe file path operations
+    ALLOC_SINK(NULL); // a worker owns the connection from here on
+    if (tls_enabled)
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) & ~O_NONBLOCK); // workers send blocking
 
-#define BACKLOG 10
-#define MAXDATASIZE 4096
+    // HTTP/2 goes to a thread of its own; the connection is not a request,
+    // its streams are admitted and recorded one by one
+    if (c->h2)
+    {
+        if (h2_dispatch(&p->h2, c->fd, c->buf, c->len, c->capture_id) == -1)
+            conn_finish(p, c);
+        else
+            conn_free(p, c);
+        return;
+    }
 
-// -------------------------------------------
-// Helper: Send a complete HTTP response
-// -------------------------------------------
-void send_response(int fd, int status_code, const char *status_text,
-                   const char *content_type, const char *body)
+    HTTPD_PROBE3(request_parsed, c->fd, c->req.method, c->req.path);
+    // A parsed request holds an in_flight slot until it is answered, on
+    // whichever ring or thread it is. The limiter only looked at in_flight
+    // when the connection was accepted, and idle connections can all send
+    // their requests at once, so cap it here too: at the ring size, neither
+    // ring can fill up.
+    if (atomic_fetch_add(&p->in_flight, 1) >= MPMC_RING_SIZE || pool_submit(p, c) == -1)
+    {
+        shed_connection(c->fd);
+        atomic_fetch_sub(&p->in_flight, 1);
+        atomic_fetch_sub(&p->open_conns, 1);
+        conn_free(p, c);
+    }
+}
+
+void accept_connections(struct event_loop *loop)
 {
-    char header[512];
-    int body_len = body ? strlen(body) : 0;
+    struct pool *p = loop->pool;
 
-    int header_len = snprintf(header, sizeof(header),
-                              "HTTP/1.0 %d %s\r\n"
-                              "Content-Type: %s\r\n"
-                              "Content-Length: %d\r\n"
-                              "\r\n",
-                              status_code, status_text, content_type, body_len);
+    while (1)
+    {
+        struct sockaddr_storage their_addr;
+        socklen_t addr_size = sizeof(their_addr);
+        int new_fd = accept(loop->sockfd, (struct sockaddr *)&their_addr, &addr_size);
+        if (new_fd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        metrics_conn_opened();
+        HTTPD_PROBE1(accept, new_fd);
+
+        // Idle connections only cost memory and a descriptor, so they are
+        // capped by the descriptor limit; the limiter looks at requests
+        struct conn *c = NULL;
+        uint32_t allocs = 0;
+        ALLOC_SINK(&allocs);
+        if (atomic_load(&p->open_conns) < p->max_conns && limiter_admit(&p->limiter, atomic_load(&p->in_flight)))
+            c = conn_new(p);
+        ALLOC_SINK(NULL);
+        if (!c)
+        {
+            shed_connection(new_fd);
+            continue;
+        }
 
-    send(fd, header, header_len, 0);
+        if (tls_enabled)
+            fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL, 0) | O_NONBLOCK);
+        c->fd = new_fd;
+        c->len = 0;
+        c->capture_id = 0;
+        c->accepted_ns = now_ns();
+        memset(&c->times, 0, sizeof(c->times));
+        c->times.allocs = allocs;
+        phase_begin(&c->times, PHASE_RECV);
+        atomic_fetch_add(&p->open_conns, 1);
 
-    if (body && body_len > 0)
-        send(fd, body, body_len, 0);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = c};
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            conn_finish(p, c);
+        }
+    }
 }
 
-// -------------------------------------------
-// Helper: Send an error response (JSON body)
-// -------------------------------------------
-void send_error(int fd, int code, const char *message)
+// SIGUSR1: print a few of the merged counters
+void dump_counters(void)
 {
-    char body[256];
-    snprintf(body, sizeof(body), "{\"error\": \"%s\"}", message);
+    struct metrics *m = malloc(sizeof(*m));
+    if (!m)
+        return;
+    metrics_merge(m);
 
-    switch (code)
+    printf("📊 File reads: %llu from page cache inline, %llu offloaded to I/O threads\n",
+           (unsigned long long)counter_read(&m->pagecache_inline),
+           (unsigned long long)counter_read(&m->pagecache_offloaded));
+    fflush(stdout);
+    free(m);
+}
+
+// SIGTERM/SIGINT: stop the event loops; run_pool() then lets the pool
+// finish and returns, so main() exits normally and atexit work runs (stdio
+// flush, the profile dump of a -fprofile-generate build)
+void handle_signals(struct event_loop *loop)
+{
+    int dump = 0, stop = 0;
+    struct signalfd_siginfo info;
+    while (read(loop->sigfd, &info, sizeof(info)) == sizeof(info))
     {
-    case 400:
-        send_response(fd, 400, "Bad Request", "application/json", body);
-        break;
-    case 403:
-        send_response(fd, 403, "Forbidden", "application/json", body);
-        break;
-    case 404:
-        send_response(fd, 404, "Not Found", "application/json", body);
-        break;
-    case 500:
-        send_response(fd, 500, "Internal Server Error", "application/json", body);
-        break;
-    default:
-        send_response(fd, code, "Error", "application/json", body);
+        if (info.ssi_signo == SIGUSR1)
+            dump = 1;
+        else
+            stop = 1;
     }
+
+    if (dump)
+        dump_counters();
+    if (stop)
+        shutdown_request();
 }
 
-// -------------------------------------------
-// Helper: Read file content into memory
-// -------------------------------------------
-char *read_file(const char *file_path, long *out_size)
+void *event_loop_main(void *arg)
 {
-    FILE *file = fopen(file_path, "rb");
-    if (!file)
-        return NULL;
+    struct event_loop *loop = arg;
+    trace_ring_init();
 
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    rewind(file);
+    // The listening socket is the only entry with a NULL data pointer.
+    // EPOLLEXCLUSIVE: one new connection wakes one loop, not all of them.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sockfd, &ev);
 
-    char *buffer = malloc(size + 1);
-    if (!buffer)
+    if (loop->sigfd != -1)
     {
-        fclose(file);
-        return NULL;
+        struct epoll_event sig_ev = {.events = EPOLLIN, .data.ptr = &loop->sigfd};
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sigfd, &sig_ev);
     }
 
-    size_t bytes_read = fread(buffer, 1, size, file);
-    fclose(file);
+    // Never read, so once written it wakes every loop
+    struct epoll_event stop_ev = {.events = EPOLLIN, .data.ptr = &shutdown_fd};
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, shutdown_fd, &stop_ev);
 
-    if (bytes_read != size)
+    struct epoll_event events[64];
+    while (1)
     {
-        free(buffer);
-        return NULL;
+        int n = epoll_wait(loop->epfd, events, 64, -1);
+        if (n == -1)
+        {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            // Connections still waiting for their request are left to exit()
+            if (events[i].data.ptr == &shutdown_fd)
+                return NULL;
+            if (events[i].data.ptr == NULL)
+                accept_connections(loop);
+            else if (events[i].data.ptr == &loop->sigfd)
+                handle_signals(loop);
+            else
+            {
+                struct conn *c = events[i].data.ptr;
+                ALLOC_SINK(&c->times.allocs);
+                conn_on_readable(loop, c);
+                ALLOC_SINK(NULL);
+            }
+        }
     }
 
-    buffer[size] = '\0';
-    *out_size = size;
-    return buffer;
+    return NULL;
 }
 
-// -------------------------------------------
-// Helper: Detect Content-Type from file extension
-// -------------------------------------------
-const char *get_content_type(const char *path)
+// After a stop signal: nothing new is accepted or parsed. Requests already
+// taken are answered, for up to SHUTDOWN_DRAIN_MS, then the workers and I/O
+// threads exit. One still stuck on a client that stopped reading is left
+// to exit().
+void pool_stop(struct pool *p, struct event_loop *loops, int nloops)
 {
-    const char *ext = strrchr(path, '.');
-    if (!ext)
-        return "text/plain";
-    if (strcmp(ext, ".html") == 0)
-        return "text/html";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0)
-        return "image/jpeg";
-    if (strcmp(ext, ".png") == 0)
-        return "image/png";
-    if (strcmp(ext, ".css") == 0)
-        return "text/css";
-    if (strcmp(ext, ".js") == 0)
-        return "application/javascript";
-    return "application/octet-stream";
+    for (int i = 1; i < nloops; i++)
+        pthread_join(loops[i].thread, NULL);
+
+    uint64_t deadline = now_ns() + SHUTDOWN_DRAIN_MS * 1000000ULL;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000000L};
+    while (atomic_load(&p->in_flight) > 0 && now_ns() < deadline)
+        nanosleep(&pause, NULL);
+
+    // One wakeup token per thread that may be asleep
+    atomic_store(&p->done, 1);
+    uint64_t tokens = p->nworkers;
+    if (write(p->tasks.wake_fd, &tokens, sizeof(tokens)) == -1)
+        perror("eventfd write");
+    tokens = p->nio;
+    if (tokens && write(p->io.wake_fd, &tokens, sizeof(tokens)) == -1)
+        perror("eventfd write");
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec++;
+    int stuck = 0;
+    for (int i = 0; i < p->nworkers; i++)
+        stuck += pthread_timedjoin_np(p->workers[i].thread, NULL, &until) != 0;
+    for (int i = 0; i < p->nio; i++)
+        stuck += pthread_timedjoin_np(p->io_threads[i], NULL, &until) != 0;
+    if (stuck)
+        fprintf(stderr, "%u requests still in flight, %d threads did not stop\n", atomic_load(&p->in_flight),
+                stuck);
 }
 
-// -------------------------------------------
-// Handle a single client connection
-// -------------------------------------------
-void handle_client(int new_fd, const char *root_dir)
+void run_pool(int sockfd, const char *root_dir, int nloops, int nworkers, int nio, int queue_size)
 {
-    char buf[MAXDATASIZE];
-    int numbytes = recv(new_fd, buf, MAXDATASIZE - 1, 0);
+    static struct pool p;
+    p.nworkers = nworkers;
+    p.nio = nio;
+    p.root_dir = root_dir;
+    p.workers = calloc(nworkers, sizeof(struct worker));
+    limiter_init(&p.limiter, queue_size);
+    p.h2 = (struct h2_server){.root_dir = root_dir, .limiter = &p.limiter, .in_flight = &p.in_flight,
+                              .open_conns = &p.open_conns};
 
-    if (numbytes <= 0)
+    // Allow as many connections as the hard descriptor limit permits, less
+    // room for the listening socket, epoll/event fds, the access log and one
+    // open file per worker and I/O thread. Past that, connections get a 503
+    // instead of accept() failing with EMFILE.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
     {
-        close(new_fd);
-        return;
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+    unsigned reserved = 64 + nloops + nworkers + nio;
+    rlim_t limit = getrlimit(RLIMIT_NOFILE, &rl) == 0 ? rl.rlim_cur : 1024;
+    if (limit > (1 << 24))
+        limit = 1 << 24;
+    p.max_conns = limit > 2 * reserved ? limit - reserved : reserved;
 
-    buf[numbytes] = '\0';
+    struct event_loop *loops = calloc(nloops, sizeof(struct event_loop));
+    if (!p.workers || !loops || task_queue_init(&p.tasks) == -1 || task_queue_init(&p.io) == -1)
+    {
+        perror("run_pool");
+        exit(1);
+    }
+    mpmc_init(&p.free_conns);
 
-    char method[8], path[256], protocol[16];
-    if (sscanf(buf, "%7s %255s %15s", method, path, protocol) != 3)
+    // A few spare connections up front, so that a connection closing just
+    // as the next one is accepted does not cost a malloc()
+    for (int i = 0; i < nloops + nworkers; i++)
     {
-        send_error(new_fd, 400, "Malformed request");
-        close(new_fd);
-        return;
+        struct conn *c = malloc(sizeof(struct conn));
+        if (c)
+            conn_free(&p, c);
     }
 
-    // Remove query string and fragments
-    char *qmark = strchr(path, '?');
-    if (qmark)
-        *qmark = '\0';
-    char *hash = strchr(path, '#');
-    if (hash)
-        *hash = '\0';
+    // main() already blocked these in every thread; loop 0 reads them here
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
 
-    // Basic security: block path traversal
-    if (strstr(path, ".."))
+    p.io_threads = calloc(nio ? nio : 1, sizeof(pthread_t));
+    if (!p.io_threads)
     {
-        send_error(new_fd, 403, "Forbidden path traversal");
-        close(new_fd);
-        return;
+        perror("run_pool");
+        exit(1);
     }
-
-    // Only support GET requests
-    if (strcmp(method, "GET") != 0)
+    for (int i = 0; i < nio; i++)
     {
-        send_error(new_fd, 501, "Only GET is supported");
-        close(new_fd);
-        return;
+        if (pthread_create(&p.io_threads[i], NULL, io_thread_main, &p) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
     }
 
-    // Default file (index.html)
-    char requested_path[PATH_MAX];
-    if (strcmp(path, "/") == 0)
-        snprintf(requested_path, sizeof(requested_path), "%s/index.html", root_dir);
-    else
-        snprintf(requested_path, sizeof(requested_path), "%s%s", root_dir, path);
-
-    // Resolve absolute path
-    char real_requested_path[PATH_MAX];
-    if (!realpath(requested_path, real_requested_path))
+    for (int i = 0; i < nworkers; i++)
     {
-        send_error(new_fd, 404, "File not found");
-        close(new_fd);
-        return;
+        struct worker *w = &p.workers[i];
+        w->id = i;
+        w->pool = &p;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
     }
 
-    // Resolve absolute root directory
-    char real_root[PATH_MAX];
-    realpath(root_dir, real_root);
-
-    // Check if requested file is inside root_dir (prevent traversal)
-    if (strncmp(real_requested_path, real_root, strlen(real_root)) != 0)
+    for (int i = 0; i < nloops; i++)
     {
-        send_error(new_fd, 403, "Forbidden path");
-        close(new_fd);
-        return;
+        loops[i].sockfd = sockfd;
+        loops[i].sigfd = i == 0 ? signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC) : -1;
+        loops[i].pool = &p;
+        loops[i].epfd = epoll_create1(0);
+        if (loops[i].epfd == -1)
+        {
+            perror("epoll_create1");
+            exit(1);
+        }
     }
 
-    // Read file
-    long file_size = 0;
-    char *body = read_file(real_requested_path, &file_size);
-    if (!body)
+    // Loop 0 runs on the main thread
+    for (int i = 1; i < nloops; i++)
     {
-        send_error(new_fd, 404, "File not found");
-        close(new_fd);
-        return;
+        if (pthread_create(&loops[i].thread, NULL, event_loop_main, &loops[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
     }
+    event_loop_main(&loops[0]);
+    pool_stop(&p, loops, nloops);
+    free(loops);
+}
 
-    // Send the file with correct Content-Type
-    const char *content_type = get_content_type(real_requested_path);
-    char header[512];
-    int header_len = snprintf(header, sizeof(header),
-                              "HTTP/1.0 200 OK\r\n"
-                              "Content-Type: %s\r\n"
-                              "Content-Length: %ld\r\n"
-                              "\r\n",
-                              content_type, file_size);
+// -------------------------------------------
+// Serial mode: one connection at a time
+// -------------------------------------------
+void run_serial(int sockfd, const char *root_dir, int queue_size)
+{
+    // Static: HTTP/2 threads use the limiter, and may outlive this function
+    static struct accept_queue queue;
+    static struct limiter limiter;
+    static _Atomic unsigned h2_in_flight; // open streams on HTTP/2 threads
+    static struct h2_server h2 = {.limiter = &limiter, .in_flight = &h2_in_flight};
+    struct codel codel = {0};
 
-    // Send header + body
-    send(new_fd, header, header_len, 0);
+    queue.capacity = queue_size;
+    limiter_init(&limiter, queue_size);
+    h2.root_dir = root_dir;
+    trace_ring_init();
 
-    ssize_t sent = send(new_fd, body, file_size, 0);
-    if (sent == -1)
-        send_error(new_fd, 500, "Failed to send response body");
+    // SIGTERM/SIGINT (blocked by main()) end the loop once the queue is empty
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    while (1)
+    {
+        // Nothing to serve: sleep until a connection or a signal shows up
+        if (queue.count == 0)
+        {
+            struct pollfd pfds[2] = {{.fd = sockfd, .events = POLLIN}, {.fd = sigfd, .events = POLLIN}};
+            if (poll(pfds, 2, -1) == -1 && errno != EINTR)
+                perror("poll");
+            if (pfds[1].revents & POLLIN)
+            {
+                // HTTP/2 threads send GOAWAY; give their open streams the
+                // same time to finish as the pool's requests get
+                shutdown_request();
+                uint64_t deadline = now_ns() + SHUTDOWN_DRAIN_MS * 1000000ULL;
+                struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000000L};
+                while (atomic_load(&h2_in_flight) > 0 && now_ns() < deadline)
+                    nanosleep(&pause, NULL);
+                close(sigfd);
+                return;
+            }
+        }
+
+        // Move everything the kernel accepted into the bounded queue,
+        // answering 503 right away once the admission limit is hit
+        while (1)
+        {
+            struct sockaddr_storage their_addr;
+            socklen_t addr_size = sizeof(their_addr);
+            int new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
+            if (new_fd == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("accept");
+                if (errno != EINTR)
+                    break;
+                continue;
+            }
+            metrics_conn_opened();
+            HTTPD_PROBE1(accept, new_fd);
+
+            if (!limiter_admit(&limiter, queue.count + atomic_load(&h2_in_flight)) ||
+                accept_queue_push(&queue, new_fd, now_ns()) == -1)
+                shed_connection(new_fd);
+        }
+
+        struct pending_conn conn;
+        if (accept_queue_pop(&queue, &conn) == -1)
+            continue;
 
-    free(body);
-    close(new_fd);
+        uint64_t start = now_ns();
+        if (codel_should_drop(&codel, start - conn.accepted_ns, start))
+        {
+            shed_connection(conn.fd);
+            continue;
+        }
+
+        handle_client(conn.fd, root_dir, &h2, conn.accepted_ns);
+    }
 }
 
 // -------------------------------------------
@@ -264,14 +6365,126 @@ void handle_client(int new_fd, const char *root_dir)
 // -------------------------------------------
 int main(int argc, char *argv[])
 {
-    if (argc < 3)
+    int backlog = DEFAULT_BACKLOG;
+    int queue_size = ACCEPT_QUEUE_MAX;
+    int workers = 0;
+    int loops = 1;
+    int io_threads = 0;
+    const char *log_path = NULL;
+    const char *hot_file = NULL;
+    const char *capture_path = NULL;
+    const char *cert_file = NULL;
+    const char *key_file = NULL;
+    const char *profile_name = NULL;
+    long value;
+    int bad_value = 0; // -m, -t or -z out of range
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:b:cC:ei:k:K:l:m:pq:r:t:T:w:z:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            loops = atoi(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'c':
+            perf_enabled = 1;
+            break;
+        case 'C':
+            cert_file = optarg;
+            break;
+        case 'e':
+            early_hints = 1;
+            break;
+        case 'i':
+            io_threads = atoi(optarg);
+            break;
+        case 'k':
+            hot_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        case 'l':
+            log_path = optarg;
+            break;
+        case 'm':
+            value = atol(optarg);
+            bad_value |= value <= 0 || value > MAX_CACHE_MB;
+            cache_max_bytes = (size_t)value << 20;
+            break;
+        case 'p':
+            preload_prefetch = 1;
+            break;
+        case 'q':
+            queue_size = atoi(optarg);
+            break;
+        case 'r':
+            capture_path = optarg;
+            break;
+        case 't':
+            value = atol(optarg);
+            bad_value |= value <= 0 || value > INT_MAX;
+            trace_every = value;
+            break;
+        case 'T':
+            profile_name = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'z':
+            value = atol(optarg);
+            bad_value |= value < ZEROCOPY_MIN_KB || value > MAX_ZEROCOPY_KB;
+            zerocopy_min = value << 10;
+            break;
+        default:
+            optind = argc + 1; // force the usage message
+        }
+    }
+
+    if (argc - optind != 2 || backlog <= 0 || queue_size <= 0 || queue_size > ACCEPT_QUEUE_MAX ||
+        workers < 0 || workers > MAX_WORKERS || loops <= 0 || loops > MAX_EVENT_LOOPS ||
+        io_threads < 0 || io_threads > MAX_IO_THREADS || !cert_file != !key_file ||
+        (profile_name && !(socket_profile = socket_profile_find(profile_name))) || bad_value)
     {
-        fprintf(stderr, "Usage: %s <port> <root_directory>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-a event_loops] [-b backlog] [-c] [-C cert -K key] [-e] [-i io_threads] [-k hot_file]"
+                        " [-l access_log] [-m cache_mb] [-p] [-q queue_size] [-r capture_file]"
+                        " [-t trace_every] [-T web|bulk] [-w workers] [-z zerocopy_kb] <port> <root_directory>\n",
+                argv[0]);
+        fprintf(stderr, "  -a  event loop threads accepting and parsing for the pool, 1..%d (default 1)\n",
+                MAX_EVENT_LOOPS);
+        fprintf(stderr, "  -b  listen() backlog (default %d)\n", DEFAULT_BACKLOG);
+        fprintf(stderr, "  -c  count cycles, instructions, cache and branch misses per phase (perf_event_open)\n");
+        fprintf(stderr, "  -C  serve HTTPS with this PEM certificate chain (needs -K)\n");
+        fprintf(stderr, "  -e  send 103 Early Hints preloading the assets of cached HTML documents (needs -m)\n");
+        fprintf(stderr, "  -i  I/O threads doing file opens and reads for the pool, 0..%d (default 0: inline)\n",
+                MAX_IO_THREADS);
+        fprintf(stderr, "  -k  file the hot path list is saved to every %llu s and restored from at startup\n",
+                HOT_SAVE_INTERVAL_NS / 1000000000ULL);
+        fprintf(stderr, "  -K  PEM private key for -C\n");
+        fprintf(stderr, "  -l  binary access log file, written by a background thread (decode with tools/logdecode)\n");
+        fprintf(stderr, "  -m  MiB of memory for pinning the hottest files (default 0: no cache)\n");
+        fprintf(stderr, "  -p  also load the assets cached HTML documents preload into the cache (needs -m)\n");
+        fprintf(stderr, "  -q  max queued connections before shedding with 503, 1..%d (default %d)\n",
+                ACCEPT_QUEUE_MAX, ACCEPT_QUEUE_MAX);
+        fprintf(stderr, "  -r  record raw request bytes with timestamps to this file (replay with bench/replay)\n");
+        fprintf(stderr, "  -t  keep phase timings of 1 in N requests for /__trace (default 0: off)\n");
+        fprintf(stderr, "  -T  socket tuning profile: web (small responses) or bulk (large downloads);"
+                        " default: kernel defaults\n");
+        fprintf(stderr, "  -w  worker threads with work stealing, 0..%d (default 0: serve serially)\n",
+                MAX_WORKERS);
+        fprintf(stderr, "  -z  send in-memory bodies of at least this many KiB with MSG_ZEROCOPY, %d..%ld"
+                        " (default 0: never)\n",
+                ZEROCOPY_MIN_KB, MAX_ZEROCOPY_KB);
         exit(1);
     }
 
-    const char *port = argv[1];
-    const char *root_dir = argv[2];
+    const char *port = argv[optind];
+    const char *root_dir = argv[optind + 1];
 
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
@@ -298,6 +6511,22 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        // Allow restarting right away while old connections sit in TIME_WAIT
+        int yes = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        socket_profile_listen(sockfd);
+        // Inherited by accepted sockets: bounds every blocking write (see io_send())
+        struct timeval send_timeout = {.tv_sec = SEND_TIMEOUT_MS / 1000, .tv_usec = SEND_TIMEOUT_MS % 1000 * 1000};
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        // Accepted sockets inherit it, like the profile's options. Without
+        // it MSG_ZEROCOPY sends are plain copies that post no completion,
+        // and every body would wait ZEROCOPY_WAIT_MS for one.
+        if (zerocopy_min && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1)
+        {
+            perror("setsockopt SO_ZEROCOPY (-z disabled)");
+            zerocopy_min = 0;
+        }
+
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
         {
             perror("bind");
@@ -305,30 +6534,19 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        if (listen(sockfd, BACKLOG) == -1)
+        if (listen(sockfd, backlog) == -1)
         {
             perror("listen");
             close(sockfd);
             continue;
         }
 
-        printf("✅ Server listening on port %s\n", port);
-
-        struct sockaddr_storage their_addr;
-        socklen_t addr_size = sizeof(their_addr);
-
-        while (1)
-        {
-            int new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
-            if (new_fd == -1)
-            {
-                perror("accept");
-                continue;
-            }
+        // Non-blocking so the kernel backlog can be drained into our queue
+        fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
 
-            printf("💻 Client connected!\n");
-            handle_client(new_fd, root_dir);
-        }
+        printf("✅ Server listening on port %s\n", port);
+        if (socket_profile)
+            printf("🔧 Socket tuning profile: %s\n", socket_profile->name);
 
         break;
     }
@@ -340,6 +6558,70 @@ int main(int argc, char *argv[])
     }
 
     freeaddrinfo(servinfo);
+
+    // A client hanging up mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Block SIGUSR1, SIGTERM and SIGINT before starting any thread; they are
+    // read from a signalfd (event loop 0 in pool mode, the poll() in serial
+    // mode)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    ticks_init();
+    shutdown_fd = eventfd(0, EFD_CLOEXEC);
+    if (shutdown_fd == -1)
+    {
+        perror("eventfd");
+        exit(1);
+    }
+
+    // Other threads open their counters on first use; find out here (with
+    // this thread's group) whether the machine has them at all
+    uint64_t values[PERF_COUNTERS];
+    if (perf_enabled && perf_read(&thread_perf, values) == -1)
+    {
+        perror("perf_event_open (hardware counters disabled)");
+        perf_enabled = 0;
+    }
+
+    if (cache_max_bytes)
+        cache_start(root_dir);
+    if (zerocopy_min)
+        zerocopy_start();
+    if (hot_file)
+    {
+        hot_paths_load(hot_file);
+        if (cache_max_bytes)
+            cache_warm(root_dir);
+    }
+    hot_paths_start(hot_file);
+
+    if (log_path)
+        access_log_start(log_path);
+    if (capture_path)
+        capture_start(capture_path);
+    hpack_init();
+    if (cert_file)
+    {
+#ifdef WITH_TLS
+        tls_init(cert_file, key_file);
+#else
+        fprintf(stderr, "-C/-K: this server was built without TLS (build with -DWITH_TLS, see the Makefile)\n");
+        exit(1);
+#endif
+    }
+
+    if (workers > 0)
+        run_pool(sockfd, root_dir, loops, workers, io_threads, queue_size);
+    else
+        run_serial(sockfd, root_dir, queue_size);
+
+    background_stop();
     close(sockfd);
     return 0;
 }
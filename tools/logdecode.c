@@ -0,0 +1,80 @@
+// Decode the server's binary access log (-l) into text, one line per request:
+//
+//   2026-10-17T09:30:01.123456Z GET /index.html 200 39 0.412ms
+//
+// The record layout must match struct access_record in server.c.
+//
+// Build: gcc -O2 -o logdecode tools/logdecode.c
+// Run:   ./logdecode access.log
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ACCESS_LOG_MAGIC "HTTPLOG1"
+#define ACCESS_LOG_PATH_MAX 92
+
+struct access_log_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct access_record
+{
+    uint64_t time_ns;
+    uint64_t latency_ns;
+    uint64_t bytes;
+    uint16_t status;
+    uint16_t path_len;
+    char method[8];
+    char path[ACCESS_LOG_PATH_MAX];
+};
+
+_Static_assert(sizeof(struct access_record) == 128, "access log records are 128 bytes");
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <access_log>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    struct access_log_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != 1 || header.record_size != sizeof(struct access_record))
+    {
+        fprintf(stderr, "%s: not a version 1 access log\n", argv[1]);
+        return 1;
+    }
+
+    struct access_record rec;
+    while (fread(&rec, sizeof(rec), 1, in) == 1)
+    {
+        time_t secs = rec.time_ns / 1000000000ULL;
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+        int stored = rec.path_len < ACCESS_LOG_PATH_MAX ? rec.path_len : ACCESS_LOG_PATH_MAX;
+        printf("%s.%06lluZ %.8s %.*s%s %u %llu %.3fms\n", when,
+               (unsigned long long)(rec.time_ns % 1000000000ULL) / 1000, rec.method,
+               stored, rec.path, stored < rec.path_len ? "..." : "", rec.status,
+               (unsigned long long)rec.bytes, rec.latency_ns / 1e6);
+    }
+
+    fclose(in);
+    return 0;
+}
@@ -0,0 +1,327 @@
+// Syscall budget check: counts the system calls the server makes for each
+// class of request and fails if any class goes over its budget.
+//
+// The server runs in serial mode under ptrace. Between two requests it
+// sleeps in poll(), so every syscall from one poll() to the next belongs to
+// the request in between (the accept loop's final EAGAIN included). Each
+// class is requested RUNS times and judged on the median, so one-off work
+// (the first request filling the cache, a revalidation stat()) does not
+// make the check flaky. The client pauses WARMUP_US after the first run of
+// a class: the server's background threads publish the hot path table (and
+// fill the cache) on their own schedule.
+//
+// Classes the server does not implement yet are listed and skipped. A class
+// can also name how its response must start; the last run is checked, since
+// earlier ones may still be filling the cache.
+//
+// x86-64 Linux only (reads the syscall number from orig_rax).
+//
+// Build: gcc -O2 -pthread -o syscall_budget tools/syscall_budget.c
+// Run:   ./syscall_budget [-v] <server_binary> <root_directory>
+//        (-v prints the syscalls of one request per class)
+//
+// Exit status: 0 within budget, 1 over budget or a wrong response, 2 could
+// not run.
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __x86_64__
+#error "syscall_budget reads x86-64 registers"
+#endif
+
+#define RUNS 7
+#define WARMUP_US 50000
+#define PORT 18089
+#define MAX_SYSCALL 512
+
+struct request_class
+{
+    const char *name;
+    const char *server_args; // extra options for the server run this class needs
+    const char *request;
+    int budget; // syscalls per request (median)
+    const char *unsupported; // why the class is skipped, or NULL
+    const char *expect;      // the last response must start with this, or NULL
+};
+
+// Budgets are the current counts plus a little headroom. Lower them when a
+// change removes syscalls; raising one should be a conscious decision.
+static const struct request_class CLASSES[] = {
+    {"cold file", "", "GET /index.html HTTP/1.0\r\n\r\n", 16, NULL},
+    {"cached hit", "-m 16", "GET /index.html HTTP/1.0\r\n\r\n", 8, NULL},
+    {"404", "", "GET /missing.html HTTP/1.0\r\n\r\n", 11, NULL},
+    {"403 traversal", "", "GET /../server.c HTTP/1.0\r\n\r\n", 8, NULL},
+    {"304", "", NULL, 0, "no conditional GET (ETag / If-None-Match) yet"},
+    {"keep-alive follow-up", "", NULL, 0, "connections close after every response"},
+    {"early hints", "-m 16 -e", "GET /preload.html HTTP/1.1\r\n\r\n", 9, NULL,
+     "HTTP/1.1 103 Early Hints\r\nLink: </image.jpg>; rel=preload; as=image\r\n\r\nHTTP/1.1 200 OK\r\n"},
+    {"no early hints (1.0)", "-m 16 -e", "GET /preload.html HTTP/1.0\r\n\r\n", 8, NULL, "HTTP/1.0 200 OK\r\n"},
+};
+#define NCLASSES (sizeof(CLASSES) / sizeof(CLASSES[0]))
+
+static const struct
+{
+    int nr;
+    const char *name;
+} SYSCALL_NAMES[] = {
+    {SYS_read, "read"},         {SYS_write, "write"},       {SYS_openat, "openat"},
+    {SYS_close, "close"},       {SYS_fstat, "fstat"},       {SYS_newfstatat, "newfstatat"},
+    {SYS_lseek, "lseek"},       {SYS_poll, "poll"},         {SYS_ppoll, "ppoll"},
+    {SYS_accept, "accept"},     {SYS_accept4, "accept4"},   {SYS_recvfrom, "recvfrom"},
+    {SYS_sendto, "sendto"},     {SYS_readlink, "readlink"}, {SYS_getcwd, "getcwd"},
+    {SYS_mmap, "mmap"},         {SYS_munmap, "munmap"},     {SYS_brk, "brk"},
+    {SYS_preadv2, "preadv2"},   {SYS_pread64, "pread64"},   {SYS_getsockname, "getsockname"},
+    {SYS_getpeername, "getpeername"}, {SYS_statx, "statx"}, {SYS_clock_gettime, "clock_gettime"},
+};
+
+static const char *syscall_name(int nr)
+{
+    static char buf[32];
+    for (size_t i = 0; i < sizeof(SYSCALL_NAMES) / sizeof(SYSCALL_NAMES[0]); i++)
+        if (SYSCALL_NAMES[i].nr == nr)
+            return SYSCALL_NAMES[i].name;
+    snprintf(buf, sizeof(buf), "sys_%d", nr);
+    return buf;
+}
+
+// Shared between the tracer (main thread) and the client thread
+static const struct request_class *plan[NCLASSES];
+static int nplan;
+static _Atomic int windows_done; // request windows the tracer has closed
+static _Atomic int client_done;
+static int verbose;
+static int wrong[NCLASSES]; // plan index -> last response did not match expect
+
+static void *client_main(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < nplan * RUNS; i++)
+    {
+        const struct request_class *c = plan[i / RUNS];
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(PORT)};
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            perror("connect");
+            exit(2);
+        }
+        send(fd, c->request, strlen(c->request), MSG_NOSIGNAL);
+        // Keep the start of the response for expect, drop the rest
+        char buf[4096], rest[4096];
+        size_t len = 0;
+        ssize_t n;
+        while ((n = len < sizeof(buf) ? recv(fd, buf + len, sizeof(buf) - len, 0) : recv(fd, rest, sizeof(rest), 0)) > 0)
+            len += len < sizeof(buf) ? n : 0;
+        close(fd);
+        if (c->expect && i % RUNS == RUNS - 1)
+            wrong[i / RUNS] = len < strlen(c->expect) || memcmp(buf, c->expect, strlen(c->expect)) != 0;
+
+        // Next request only once the server is back in poll()
+        while (atomic_load(&windows_done) <= i)
+            usleep(1000);
+        if (i % RUNS == 0)
+            usleep(WARMUP_US);
+    }
+    atomic_store(&client_done, 1);
+    return NULL;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Runs the server under ptrace for every class in plan[]; fills counts
+// [class][run]. Returns 0, or -1 if tracing failed.
+static int trace_server(const char *server, const char *root, const char *extra_args,
+                        int counts[][RUNS])
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", PORT);
+    char extra[64];
+    snprintf(extra, sizeof(extra), "%s", extra_args);
+
+    char *argv[16];
+    int argc = 0;
+    argv[argc++] = (char *)server;
+    for (char *tok = strtok(extra, " "); tok && argc < 12; tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+    argv[argc++] = port;
+    argv[argc++] = (char *)root;
+    argv[argc] = NULL;
+
+    fflush(stdout); // or the child flushes our buffer a second time
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        freopen("/dev/null", "w", stdout);
+        execv(server, argv);
+        perror("execv");
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0); // stopped at exec
+    if (!WIFSTOPPED(status))
+        return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+    int in_syscall = 0;
+    int started = 0;
+    int window = 0;     // syscalls since the last poll()
+    int accepted = 0;   // the window saw a connection
+    int per_nr[MAX_SYSCALL] = {0};
+    int request = 0;
+    pthread_t client;
+    atomic_store(&windows_done, 0);
+    memset(wrong, 0, sizeof(wrong));
+    atomic_store(&client_done, 0);
+
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    while (request < nplan * RUNS)
+    {
+        if (waitpid(pid, &status, 0) == -1 || WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            fprintf(stderr, "server exited while being traced\n");
+            return -1;
+        }
+
+        int sig = 0;
+        if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+        {
+            struct user_regs_struct regs;
+            ptrace(PTRACE_GETREGS, pid, NULL, &regs);
+            int nr = (int)regs.orig_rax;
+            in_syscall = !in_syscall;
+
+            if (in_syscall && (nr == SYS_poll || nr == SYS_ppoll))
+            {
+                // Server idle: close the window of the request just served
+                if (!started)
+                {
+                    started = 1;
+                    pthread_create(&client, NULL, client_main, NULL);
+                }
+                else if (accepted)
+                {
+                    const struct request_class *c = plan[request / RUNS];
+                    counts[request / RUNS][request % RUNS] = window;
+                    if (verbose && request % RUNS == RUNS - 1)
+                    {
+                        printf("  %s:", c->name);
+                        for (int n = 0; n < MAX_SYSCALL; n++)
+                            if (per_nr[n])
+                                printf(" %s=%d", syscall_name(n), per_nr[n]);
+                        printf("\n");
+                    }
+                    request++;
+                    atomic_store(&windows_done, request);
+                }
+                window = 0;
+                accepted = 0;
+                memset(per_nr, 0, sizeof(per_nr));
+            }
+            else if (in_syscall)
+            {
+                window++;
+                if (nr >= 0 && nr < MAX_SYSCALL)
+                    per_nr[nr]++;
+            }
+            else if ((nr == SYS_accept || nr == SYS_accept4) && (long)regs.rax >= 0)
+                accepted = 1;
+        }
+        else if (WIFSTOPPED(status))
+            sig = WSTOPSIG(status);
+
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    pthread_join(client, NULL);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1)
+        verbose = opt == 'v';
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: %s [-v] <server_binary> <root_directory>\n", argv[0]);
+        return 2;
+    }
+    const char *server = argv[optind];
+    const char *root = argv[optind + 1];
+
+    // One traced server run per distinct set of server options
+    int counts[NCLASSES][RUNS];
+    int measured[NCLASSES] = {0};
+    int mismatched[NCLASSES] = {0};
+    for (size_t i = 0; i < NCLASSES; i++)
+    {
+        if (CLASSES[i].unsupported || measured[i])
+            continue;
+
+        int idx[NCLASSES];
+        nplan = 0;
+        for (size_t j = i; j < NCLASSES; j++)
+        {
+            if (CLASSES[j].unsupported || strcmp(CLASSES[j].server_args, CLASSES[i].server_args) != 0)
+                continue;
+            idx[nplan] = j;
+            plan[nplan++] = &CLASSES[j];
+        }
+
+        int run_counts[NCLASSES][RUNS];
+        if (verbose)
+            printf("server %s%s\n", CLASSES[i].server_args[0] ? CLASSES[i].server_args : "(defaults)",
+                   ":");
+        if (trace_server(server, root, CLASSES[i].server_args, run_counts) == -1)
+            return 2;
+        for (int k = 0; k < nplan; k++)
+        {
+            memcpy(counts[idx[k]], run_counts[k], sizeof(run_counts[k]));
+            measured[idx[k]] = 1;
+            mismatched[idx[k]] = wrong[k];
+        }
+    }
+
+    int failed = 0;
+    printf("%-22s %8s %8s %8s  %s\n", "class", "median", "max", "budget", "result");
+    for (size_t i = 0; i < NCLASSES; i++)
+    {
+        const struct request_class *c = &CLASSES[i];
+        if (c->unsupported)
+        {
+            printf("%-22s %8s %8s %8s  skipped: %s\n", c->name, "-", "-", "-", c->unsupported);
+            continue;
+        }
+        qsort(counts[i], RUNS, sizeof(int), cmp_int);
+        int median = counts[i][RUNS / 2];
+        int over = median > c->budget;
+        failed |= over || mismatched[i];
+        printf("%-22s %8d %8d %8d  %s\n", c->name, median, counts[i][RUNS - 1], c->budget,
+               over ? "OVER BUDGET" : mismatched[i] ? "WRONG RESPONSE" : "ok");
+    }
+    return failed;
+}